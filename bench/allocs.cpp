@@ -0,0 +1,180 @@
+// Heap allocations of repeated builds in one process. Replaces the global
+// operator new with a counting one, builds each image a few times to warm
+// the buffer pool (see memory.h) and the stage threads (see pipeline.h),
+// then reports the mean allocations of the builds that follow. Each case is
+// measured twice, with more sections or fragments the second time, so the
+// difference is what one more section costs in steady state.
+//
+// usage: bench/allocs [RUNS]
+//   RUNS  counted builds per case, after 3 warm-up builds (default 10)
+
+#include "../bootimg.h"
+#include "../vendorbootimg.h"
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <fcntl.h>
+#include <functional>
+#include <new>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+namespace {
+
+std::atomic<uint64_t> allocations{0};
+std::atomic<uint64_t> allocated_bytes{0};
+
+void *Allocate(size_t size, size_t alignment) {
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  allocated_bytes.fetch_add(size, std::memory_order_relaxed);
+  void *p = nullptr;
+  if (alignment <= alignof(std::max_align_t))
+    p = std::malloc(size ? size : 1);
+  else if (posix_memalign(&p, alignment, size ? size : 1) != 0)
+    p = nullptr;
+  if (!p)
+    throw std::bad_alloc();
+  return p;
+}
+
+} // namespace
+
+void *operator new(size_t size) { return Allocate(size, 0); }
+void *operator new(size_t size, std::align_val_t alignment) {
+  return Allocate(size, static_cast<size_t>(alignment));
+}
+void operator delete(void *p) noexcept { std::free(p); }
+void operator delete(void *p, size_t) noexcept { std::free(p); }
+void operator delete(void *p, std::align_val_t) noexcept { std::free(p); }
+void operator delete(void *p, size_t, std::align_val_t) noexcept {
+  std::free(p);
+}
+
+namespace {
+
+void WriteFile(const std::string &path, size_t size, char fill) {
+  const int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    std::perror(path.c_str());
+    std::exit(1);
+  }
+  std::vector<char> data(size, fill);
+  if (write(fd, data.data(), data.size()) != static_cast<ssize_t>(size)) {
+    std::perror(path.c_str());
+    std::exit(1);
+  }
+  close(fd);
+}
+
+struct Count {
+  double allocations;
+  double bytes;
+};
+
+// Mean allocations of one `build`, after warm-up builds.
+Count Measure(const std::function<void()> &build, int runs) {
+  for (int i = 0; i < 3; ++i)
+    build();
+  const uint64_t start = allocations.load();
+  const uint64_t start_bytes = allocated_bytes.load();
+  for (int i = 0; i < runs; ++i)
+    build();
+  return {static_cast<double>(allocations.load() - start) / runs,
+          static_cast<double>(allocated_bytes.load() - start_bytes) / runs};
+}
+
+void Report(const char *label, const char *unit, int added,
+            const std::function<void()> &small,
+            const std::function<void()> &large, int runs) {
+  const Count a = Measure(small, runs);
+  const Count b = Measure(large, runs);
+  std::printf("  %-26s %7.1f -> %7.1f allocs  %9.0f -> %9.0f bytes  "
+              "%+.2f allocs per %s\n",
+              label, a.allocations, b.allocations, a.bytes, b.bytes,
+              (b.allocations - a.allocations) / added, unit);
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  const int runs = argc > 1 ? std::atoi(argv[1]) : 10;
+
+  char dir[] = "/tmp/mkbootimg-allocs-XXXXXX";
+  if (!mkdtemp(dir)) {
+    std::perror("mkdtemp");
+    return 1;
+  }
+  const std::string work = dir;
+  // Several copy chunks per section, so per-chunk costs show too.
+  constexpr size_t SECTION_SIZE = 3 << 20;
+  WriteFile(work + "/kernel", SECTION_SIZE, 'k');
+  WriteFile(work + "/ramdisk", SECTION_SIZE, 'r');
+  WriteFile(work + "/second", SECTION_SIZE, 's');
+  WriteFile(work + "/recovery_dtbo", SECTION_SIZE, 'o');
+  WriteFile(work + "/dtb", SECTION_SIZE, 'd');
+  constexpr int FRAGMENTS = 64;
+  for (int i = 0; i < FRAGMENTS; ++i)
+    WriteFile(work + "/frag" + std::to_string(i), 4096 + i, 'a' + i % 26);
+
+  // Arguments are built outside the counted builds, as main() parses them
+  // once.
+  BootImageArgs v2_small;
+  v2_small.kernel = work + "/kernel";
+  v2_small.dtb = {work + "/dtb"};
+  v2_small.header_version = 2;
+  v2_small.output = work + "/boot.img";
+  BootImageArgs v2_large = v2_small;
+  v2_large.ramdisk = work + "/ramdisk";
+  v2_large.second = work + "/second";
+  v2_large.recovery_dtbo = work + "/recovery_dtbo";
+
+  VendorBootArgs vendor_small;
+  vendor_small.header_version = 4;
+  vendor_small.output = work + "/vendor_boot.img";
+  vendor_small.dtb = {work + "/dtb"};
+  VendorBootArgs vendor_large = vendor_small;
+  for (int i = 0; i < FRAGMENTS; ++i) {
+    VendorRamdiskEntry entry;
+    entry.path = work + "/frag" + std::to_string(i);
+    entry.type = 1;
+    entry.name = "frag" + std::to_string(i);
+    (i < 4 ? vendor_small : vendor_large).ramdisks.push_back(entry);
+    if (i < 4)
+      vendor_large.ramdisks.push_back(entry);
+  }
+
+  std::printf("heap allocations per build, mean of %d after warm-up:\n", runs);
+  Report("boot v2, 2 -> 5 sections", "section", 3,
+         [&] { WriteBootImage(v2_small); }, [&] { WriteBootImage(v2_large); },
+         runs);
+  // --manifest takes the sequential writer (see sink.h) instead.
+  BootImageArgs manifest_small = v2_small;
+  BootImageArgs manifest_large = v2_large;
+  manifest_small.manifest = manifest_large.manifest = work + "/boot.json";
+  Report("boot v2 --manifest, 2 -> 5", "section", 3,
+         [&] { WriteBootImage(manifest_small); },
+         [&] { WriteBootImage(manifest_large); }, runs);
+  std::vector<BootImageArgs> variants_small{v2_small};
+  std::vector<BootImageArgs> variants_large{v2_large};
+  for (auto *variants : {&variants_small, &variants_large}) {
+    variants->push_back(variants->front());
+    variants->back().output = work + "/boot2.img";
+  }
+  Report("boot v2 x2, 2 -> 5 sections", "section", 3,
+         [&] { WriteBootImages(variants_small); },
+         [&] { WriteBootImages(variants_large); }, runs);
+  // The builder takes its arguments by value; copy them before counting.
+  std::vector<VendorBootArgs> small_copies(runs + 3, vendor_small);
+  std::vector<VendorBootArgs> large_copies(runs + 3, vendor_large);
+  auto build_vendor = [](std::vector<VendorBootArgs> &copies) {
+    VendorBootBuilder(std::move(copies.back())).Build();
+    copies.pop_back();
+  };
+  Report("vendor v4, 4 -> 64 fragments", "fragment", FRAGMENTS - 4,
+         [&] { build_vendor(small_copies); },
+         [&] { build_vendor(large_copies); }, runs);
+
+  std::filesystem::remove_all(work);
+  return 0;
+}
@@ -0,0 +1,61 @@
+#!/bin/bash
+# Times a vendor_boot v4 build with many ramdisk fragments, passed through a
+# response file the way large fragment lists are.
+#
+# usage: bench/fragments.sh [MKBOOTIMG] [COUNT] [RUNS]
+#   MKBOOTIMG  binary to time (default ./mkbootimg)
+#   COUNT      number of fragments (default 10000)
+#   RUNS       timed builds per mode, after one warm-up (default 5)
+#
+# Fragments are small and distinct except that every tenth one repeats an
+# earlier fragment, so fragment sharing has work to do. Prints the best and
+# median wall time with and without --no-ramdisk-sharing.
+set -euo pipefail
+
+BIN=$(realpath "${1:-./mkbootimg}")
+COUNT=${2:-10000}
+RUNS=${3:-5}
+
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+mkdir "$WORK/frag"
+{
+  for ((i = 0; i < COUNT; i++)); do
+    if ((i % 10 == 9)); then
+      src=$((i - 9))
+    else
+      src=$i
+    fi
+    printf 'fragment %08d\n' "$src" >"$WORK/frag/$i"
+    printf -- '--ramdisk_type dlkm --ramdisk_name f%d --vendor_ramdisk_fragment %s\n' \
+      "$i" "$WORK/frag/$i"
+  done
+} >"$WORK/list.rsp"
+: >"$WORK/dtb"
+
+now_ns() { date +%s%N; }
+
+# Runs one configuration RUNS times and prints "best / median" in ms.
+time_builds() {
+  local times=() start end
+  "$BIN" --vendor_boot "$WORK/out.img" --dtb "$WORK/dtb" "$@" \
+    "@$WORK/list.rsp" >/dev/null
+  for ((run = 0; run < RUNS; run++)); do
+    start=$(now_ns)
+    "$BIN" --vendor_boot "$WORK/out.img" --dtb "$WORK/dtb" "$@" \
+      "@$WORK/list.rsp" >/dev/null
+    end=$(now_ns)
+    times+=($(((end - start) / 1000)))
+  done
+  printf '%s\n' "${times[@]}" | sort -n | awk '
+    { t[NR] = $1 }
+    END { printf "%7.1f / %7.1f ms\n", t[1] / 1000, t[int((NR + 1) / 2)] / 1000 }'
+}
+
+echo "$COUNT fragments, best / median of $RUNS:"
+printf '  sharing:              '
+time_builds
+printf '  --no-ramdisk-sharing: '
+time_builds --no-ramdisk-sharing
+"$BIN" verify "$WORK/out.img" >/dev/null && echo "  verify: OK"
@@ -0,0 +1,120 @@
+// Process start-to-exit latency of a minimal boot v4 build: spawns the
+// binary under test repeatedly with posix_spawn and reports the median and
+// the 10th/90th percentiles, next to /bin/true spawned the same way, which
+// is the floor the sandbox or machine imposes on any process.
+//
+// usage: bench/startup [MKBOOTIMG] [RUNS]
+//   MKBOOTIMG  binary to time (default ./mkbootimg)
+//   RUNS       timed runs per command, after 20 warm-up runs (default 500)
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fcntl.h>
+#include <spawn.h>
+#include <string>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+extern char **environ;
+
+namespace {
+
+void WriteFile(const std::string &path, size_t size) {
+  const int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    std::perror(path.c_str());
+    std::exit(1);
+  }
+  std::vector<char> data(size, 'x');
+  if (write(fd, data.data(), data.size()) != static_cast<ssize_t>(size)) {
+    std::perror(path.c_str());
+    std::exit(1);
+  }
+  close(fd);
+}
+
+// Runs `argv` once and returns its wall time in microseconds.
+double Spawn(const std::vector<std::string> &args) {
+  std::vector<char *> argv;
+  for (const auto &arg : args)
+    argv.push_back(const_cast<char *>(arg.c_str()));
+  argv.push_back(nullptr);
+
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null",
+                                   O_WRONLY, 0);
+  const auto start = std::chrono::steady_clock::now();
+  pid_t pid;
+  if (posix_spawn(&pid, argv[0], &actions, nullptr, argv.data(), environ) !=
+      0) {
+    std::perror(argv[0]);
+    std::exit(1);
+  }
+  int status = 0;
+  waitpid(pid, &status, 0);
+  const auto end = std::chrono::steady_clock::now();
+  posix_spawn_file_actions_destroy(&actions);
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    std::fprintf(stderr, "%s failed\n", argv[0]);
+    std::exit(1);
+  }
+  return std::chrono::duration<double, std::micro>(end - start).count();
+}
+
+void Measure(const char *label, const std::vector<std::string> &args,
+             int runs) {
+  for (int i = 0; i < 20; ++i)
+    Spawn(args);
+  std::vector<double> times;
+  for (int i = 0; i < runs; ++i)
+    times.push_back(Spawn(args));
+  std::sort(times.begin(), times.end());
+  auto at = [&](double q) {
+    return times[static_cast<size_t>(q * (times.size() - 1))] / 1000;
+  };
+  std::printf("  %-22s median %.3f ms  (p10 %.3f, p90 %.3f)\n", label,
+              at(0.5), at(0.1), at(0.9));
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  char resolved[4096];
+  const char *bin = argc > 1 ? argv[1] : "./mkbootimg";
+  if (!realpath(bin, resolved)) {
+    std::perror(bin);
+    return 1;
+  }
+  const int runs = argc > 2 ? std::atoi(argv[2]) : 500;
+
+  char dir[] = "/tmp/mkbootimg-startup-XXXXXX";
+  if (!mkdtemp(dir)) {
+    std::perror("mkdtemp");
+    return 1;
+  }
+  const std::string work = dir;
+  WriteFile(work + "/kernel", 4096);
+  WriteFile(work + "/ramdisk", 2048);
+
+  std::printf("start-to-exit latency, %d runs on a warm cache:\n", runs);
+  Measure("/bin/true", {"/bin/true"}, runs);
+  Measure("v4 build --dry-run",
+          {resolved, "--kernel", work + "/kernel", "--ramdisk",
+           work + "/ramdisk", "--header_version", "4", "--dry-run", "-o",
+           work + "/boot.img"},
+          runs);
+  Measure("v4 build",
+          {resolved, "--kernel", work + "/kernel", "--ramdisk",
+           work + "/ramdisk", "--header_version", "4", "-o",
+           work + "/boot.img"},
+          runs);
+
+  for (const char *name : {"/kernel", "/ramdisk", "/boot.img"})
+    unlink((work + name).c_str());
+  rmdir(dir);
+  return 0;
+}
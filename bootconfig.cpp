@@ -0,0 +1,127 @@
+#include "bootconfig.h"
+#include "memory.h"
+
+#include <unordered_map>
+
+namespace {
+
+constexpr std::string_view TRAILER_MAGIC = "#BOOTCONFIG\n";
+
+std::string_view Trim(std::string_view text) {
+  constexpr std::string_view SPACE = " \t\r";
+  const size_t begin = text.find_first_not_of(SPACE);
+  if (begin == std::string_view::npos)
+    return {};
+  return text.substr(begin, text.find_last_not_of(SPACE) - begin + 1);
+}
+
+bool IsValidKey(std::string_view key) {
+  if (key.empty() || key.front() == '.' || key.back() == '.' ||
+      key.find("..") != std::string_view::npos)
+    return false;
+  return std::all_of(key.begin(), key.end(), [](char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+           (c >= '0' && c <= '9') || c == '_' || c == '-' || c == '.';
+  });
+}
+
+std::string ReadSource(const std::filesystem::path &path) {
+  auto file = utils::OpenInput(path);
+  if (!file)
+    throw std::runtime_error("Could not open bootconfig source " +
+                             path.string() + ".");
+  if (file->stream)
+    utils::Spool(*file, utils::SPOOL_LIMIT, "bootconfig");
+  std::string text(file->size, '\0');
+  if (!file->ReadAt(0, text.data(), text.size()))
+    throw std::runtime_error("Could not read bootconfig source " +
+                             path.string() + ".");
+  return text;
+}
+
+// Parameters in first-seen key order, with the last value given for each.
+class Merger {
+public:
+  // `where` names the parameter in errors.
+  void Add(std::string_view line, const std::string &where) {
+    const size_t eq = line.find('=');
+    if (eq == std::string_view::npos)
+      throw std::runtime_error("Bootconfig parameter without '=' at " +
+                               where + ".");
+    const std::string key(Trim(line.substr(0, eq)));
+    if (!IsValidKey(key))
+      throw std::runtime_error("Invalid bootconfig key '" + key + "' at " +
+                               where + ".");
+    std::string value(Trim(line.substr(eq + 1)));
+    const auto [it, added] = index_.emplace(key, params_.size());
+    if (added)
+      params_.emplace_back(key, std::move(value));
+    else
+      params_[it->second].second = std::move(value);
+  }
+
+  const std::vector<std::pair<std::string, std::string>> &params() const {
+    return params_;
+  }
+
+private:
+  std::vector<std::pair<std::string, std::string>> params_;
+  std::unordered_map<std::string, size_t> index_;
+};
+
+} // namespace
+
+namespace bootconfig {
+
+utils::FileWrapper Build(const std::vector<Source> &sources) {
+  Merger merger;
+  for (const auto &source : sources) {
+    if (source.file.empty()) {
+      if (source.param.find('\n') != std::string::npos)
+        throw std::runtime_error("Bootconfig parameter '" + source.param +
+                                 "' spans lines.");
+      merger.Add(source.param, "'" + source.param + "'");
+      continue;
+    }
+    const std::string text = ReadSource(source.file);
+    std::string_view rest = text;
+    for (size_t number = 1; !rest.empty(); ++number) {
+      const size_t end = rest.find('\n');
+      const std::string_view line = Trim(rest.substr(0, end));
+      rest = end == std::string_view::npos ? std::string_view()
+                                           : rest.substr(end + 1);
+      if (line.empty() || line.front() == '#')
+        continue;
+      merger.Add(line, source.file.string() + ":" + std::to_string(number));
+    }
+  }
+
+  // Serialized and summed in one pass; the trailer follows.
+  std::vector<uint8_t> data;
+  uint32_t checksum = 0;
+  auto append = [&](std::string_view text) {
+    for (const char c : text) {
+      data.push_back(static_cast<uint8_t>(c));
+      checksum += static_cast<uint8_t>(c);
+    }
+  };
+  for (const auto &[key, value] : merger.params()) {
+    append(key);
+    append("=");
+    append(value);
+    append("\n");
+  }
+  if (data.size() > UINT32_MAX - 8 - TRAILER_MAGIC.size())
+    throw std::runtime_error("The bootconfig is larger than 4 GiB.");
+  const uint32_t size = static_cast<uint32_t>(data.size());
+  data.resize(data.size() + 8);
+  utils::StoreU32(data.data() + size, size);
+  utils::StoreU32(data.data() + size + 4, checksum);
+  data.insert(data.end(), TRAILER_MAGIC.begin(), TRAILER_MAGIC.end());
+
+  const size_t total = data.size();
+  return utils::FileWrapper(
+      std::make_unique<utils::BufferReader>(std::move(data)), total);
+}
+
+} // namespace bootconfig
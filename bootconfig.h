@@ -0,0 +1,25 @@
+#pragma once
+
+#include "utils.hpp"
+
+namespace bootconfig {
+
+// One source of bootconfig parameters: a file of "key=value" lines (any
+// input utils::OpenInput takes), or, with `file` empty, a single "key=value"
+// parameter.
+struct Source {
+  std::filesystem::path file;
+  std::string param;
+};
+
+// Builds the bootconfig section from `sources`, merged in order: a later
+// value for a key replaces the earlier one, and the key keeps its first
+// position. Parameters are written as "key=value" lines, followed by the
+// trailer the kernel looks for at the end of the initrd: the size of the
+// parameters and their byte sum (le32 each) and "#BOOTCONFIG\n". Lines of
+// files are trimmed; empty lines and '#' comments are skipped. Throws on
+// unreadable files, lines without '=' and keys that are not dot-separated
+// words of letters, digits, '_' and '-'.
+utils::FileWrapper Build(const std::vector<Source> &sources);
+
+} // namespace bootconfig
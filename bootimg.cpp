@@ -1,228 +1,685 @@
 #include "bootimg.h"
-#include "TinySHA1.hpp"
+#include "delta.h"
+#include "dtb.h"
+#include "format.h"
+#include "hash.h"
+#include "layout.h"
+#include "manifest.h"
+#include "store.h"
+#include "tar.h"
+#include "memory.h"
+#include "pipeline.h"
+#include "sink.h"
 #include "utils.hpp"
 
+#include <iostream>
+
 namespace {
-constexpr uint32_t BOOT_MAGIC_SIZE = 8;
-constexpr std::string_view BOOT_MAGIC = "ANDROID!";
-constexpr uint32_t BOOT_IMAGE_HEADER_V1_SIZE = 1648;
-constexpr uint32_t BOOT_IMAGE_HEADER_V2_SIZE = 1660;
-constexpr uint32_t BOOT_IMAGE_HEADER_V3_SIZE = 1580;
-constexpr uint32_t BOOT_IMAGE_HEADER_V4_SIZE = 1584;
-constexpr uint32_t BOOT_NAME_SIZE = 16;
-constexpr uint32_t BOOT_ARGS_SIZE = 512;
-constexpr uint32_t BOOT_EXTRA_ARGS_SIZE = 1024;
-constexpr uint32_t BOOT_IMAGE_HEADER_V3_PAGESIZE = 4096;
-
-bool WriteHeaderV3Plus(std::ostream &out, const BootImageArgs &args) {
+using format::BOOT_ARGS_SIZE;
+using format::BOOT_EXTRA_ARGS_SIZE;
+using format::BOOT_ID_SIZE;
+using format::BOOT_IMAGE_HEADER_V1_SIZE;
+using format::BOOT_IMAGE_HEADER_V2_SIZE;
+using format::BOOT_IMAGE_HEADER_V3_PAGESIZE;
+using format::BOOT_IMAGE_HEADER_V3_SIZE;
+using format::BOOT_IMAGE_HEADER_V4_SIZE;
+using format::BOOT_MAGIC;
+using format::BOOT_MAGIC_SIZE;
+using format::BOOT_NAME_SIZE;
+
+constexpr size_t COPY_CHUNK_SIZE = 1 << 20;
+
+std::optional<utils::FileWrapper>
+OpenRecoveryDtbo(const BootImageArgs &args) {
+  if (args.recovery_dtbo_overlays.empty())
+    return utils::OpenInput(args.recovery_dtbo);
+  return dtb::OpenOverlayTable(args.recovery_dtbo_overlays, args.page_size);
+}
+
+// Inputs shared by every variant of a fan-out build. Each file is opened once
+// and its size is taken from that single open; a stream (see
+// utils::OpenInput) gets its size when it is copied.
+struct BootInputs {
+  std::optional<utils::FileWrapper> kernel;
+  std::optional<utils::FileWrapper> ramdisk;
+  std::optional<utils::FileWrapper> second;
+  std::optional<utils::FileWrapper> recovery_dtbo;
+  std::optional<utils::FileWrapper> dtb;
+
+  explicit BootInputs(const BootImageArgs &args)
+      : kernel(utils::OpenInput(args.kernel)),
+        ramdisk(utils::OpenInput(args.ramdisk)),
+        second(utils::OpenInput(args.second)),
+        recovery_dtbo(OpenRecoveryDtbo(args)),
+        dtb(dtb::OpenSection(args.dtb)) {}
+};
+
+bool WriteHeaderV3Plus(sink::Sink &out, const BootImageArgs &args,
+                       BootInputs &inputs) {
   const uint32_t header_size = args.header_version > 3
                                    ? BOOT_IMAGE_HEADER_V4_SIZE
                                    : BOOT_IMAGE_HEADER_V3_SIZE;
 
-  out.write(BOOT_MAGIC.data(), BOOT_MAGIC_SIZE);
-  auto kernel = utils::OpenFile(args.kernel);
-  auto ramdisk = utils::OpenFile(args.ramdisk);
+  out.Write(BOOT_MAGIC.data(), BOOT_MAGIC_SIZE);
 
-  utils::WriteU32(out, utils::GetFileSize(kernel));
-  utils::WriteU32(out, utils::GetFileSize(ramdisk));
+  out.WriteU32(utils::GetFileSize(inputs.kernel));
+  out.WriteU32(utils::GetFileSize(inputs.ramdisk));
 
   utils::OSVersion os_version = args.os_version;
   utils::OSVersion::Parse(os_version);
 
-  utils::WriteU32(out, (os_version.version << 11) | os_version.patch_level);
-  utils::WriteU32(out, header_size);
-  utils::WriteU32(out, 0); // reserved
-  utils::WriteU32(out, 0);
-  utils::WriteU32(out, 0);
-  utils::WriteU32(out, 0);
-  utils::WriteU32(out, args.header_version);
+  out.WriteU32(format::PackOsVersion(os_version.version,
+                                             os_version.patch_level));
+  out.WriteU32(header_size);
+  out.WriteU32(0); // reserved
+  out.WriteU32(0);
+  out.WriteU32(0);
+  out.WriteU32(0);
+  out.WriteU32(args.header_version);
 
-  std::vector<char> cmdline(args.cmdline.begin(), args.cmdline.end());
-  cmdline.resize(BOOT_ARGS_SIZE + BOOT_EXTRA_ARGS_SIZE, 0);
-  out.write(cmdline.data(), cmdline.size());
+  const auto cmdline =
+      format::FixedField<BOOT_ARGS_SIZE + BOOT_EXTRA_ARGS_SIZE>(args.cmdline);
+  out.Write(cmdline.data(), cmdline.size());
 
   if (args.header_version >= 4) {
-    utils::WriteU32(out, 0); // boot_signature_size
+    out.WriteU32(0); // boot_signature_size
   }
 
-  utils::PadFile(out, BOOT_IMAGE_HEADER_V3_PAGESIZE);
-  return out.good();
+  out.Pad(BOOT_IMAGE_HEADER_V3_PAGESIZE);
+  return out.Ok();
 }
 
-bool WriteLegacyHeader(std::ostream &out, const BootImageArgs &args) {
+bool WriteLegacyHeader(sink::Sink &out, const BootImageArgs &args,
+                       BootInputs &inputs, const std::string &id) {
   const uint32_t ramdisk_load =
       !args.ramdisk.empty() ? args.base + args.ramdisk_offset : 0;
   const uint32_t second_load =
       !args.second.empty() ? args.base + args.second_offset : 0;
 
-  out.write(BOOT_MAGIC.data(), BOOT_MAGIC_SIZE);
-
-  auto kernel = utils::OpenFile(args.kernel);
-  auto ramdisk = utils::OpenFile(args.ramdisk);
-  auto second = utils::OpenFile(args.second);
-  auto recovery_dtbo = utils::OpenFile(args.recovery_dtbo);
-  auto dtb = utils::OpenFile(args.dtb);
+  out.Write(BOOT_MAGIC.data(), BOOT_MAGIC_SIZE);
 
-  utils::WriteU32(out, utils::GetFileSize(kernel));
+  out.WriteU32(utils::GetFileSize(inputs.kernel));
 
-  utils::WriteU32(out, args.base + args.kernel_offset);
-  utils::WriteU32(out, utils::GetFileSize(ramdisk));
-  utils::WriteU32(out, ramdisk_load);
-  utils::WriteU32(out, utils::GetFileSize(second));
-  utils::WriteU32(out, second_load);
-  utils::WriteU32(out, args.base + args.tags_offset);
-  utils::WriteU32(out, args.page_size);
-  utils::WriteU32(out, args.header_version);
+  out.WriteU32(args.base + args.kernel_offset);
+  out.WriteU32(utils::GetFileSize(inputs.ramdisk));
+  out.WriteU32(ramdisk_load);
+  out.WriteU32(utils::GetFileSize(inputs.second));
+  out.WriteU32(second_load);
+  out.WriteU32(args.base + args.tags_offset);
+  out.WriteU32(args.page_size);
+  out.WriteU32(args.header_version);
 
   utils::OSVersion os_version = args.os_version;
   utils::OSVersion::Parse(os_version);
 
-  utils::WriteU32(out, (os_version.version << 11) |
-                           os_version.patch_level);
-
-  std::vector<char> board(BOOT_NAME_SIZE, 0);
-  std::copy_n(
-      args.board.begin(),
-      std::min(args.board.size(), static_cast<size_t>(BOOT_NAME_SIZE - 1)),
-      board.begin());
-  out.write(board.data(), board.size());
-
-  std::vector<char> cmdline_buf(BOOT_ARGS_SIZE, 0);
-  size_t cmdline_copy_len = std::min(args.cmdline.length(), static_cast<size_t>(BOOT_ARGS_SIZE - 1));
-  std::copy_n(
-      args.cmdline.begin(),
-      cmdline_copy_len,
-      cmdline_buf.begin());
-  out.write(cmdline_buf.data(), cmdline_buf.size());
-
-  sha1::SHA1 sha;
-  constexpr std::array<uint8_t, 4> zero{0, 0, 0, 0};
-  auto update_sha = [&](const std::filesystem::path &path) {
-    if (!path.empty()) {
-      if (auto file = utils::OpenFile(path)) {
-        auto data = utils::ReadFileContents(*file);
-        sha.processBytes(data.data(), data.size());
-
-        uint32_t size = static_cast<uint32_t>(data.size());
-        std::array<uint8_t, 4> size_bytes{
-            static_cast<uint8_t>(size & 0xFF),
-            static_cast<uint8_t>((size >> 8) & 0xFF),
-            static_cast<uint8_t>((size >> 16) & 0xFF),
-            static_cast<uint8_t>((size >> 24) & 0xFF)};
-        sha.processBytes(size_bytes.data(), size_bytes.size());
-      } else {
-        sha.processBytes(zero.data(), zero.size());
-      }
-    } else {
-      sha.processBytes(zero.data(), zero.size());
-    }
-  };
+  out.WriteU32(format::PackOsVersion(os_version.version,
+                                             os_version.patch_level));
 
-  update_sha(args.kernel);
-  update_sha(args.ramdisk);
-  update_sha(args.second);
-  if (args.header_version > 0)
-    update_sha(args.recovery_dtbo);
-  if (args.header_version > 1)
-    update_sha(args.dtb);
+  const auto board =
+      format::FixedField<BOOT_NAME_SIZE>(args.board, BOOT_NAME_SIZE - 1);
+  out.Write(board.data(), board.size());
 
-  uint32_t digest[5];
-  sha.getDigest(digest);
-  std::string digestStr;
-  digestStr.reserve(20);
-  for (size_t i = 0; i < 5; ++i) {
-    digestStr.append(utils::UToS(digest[i]));
-  }
-  utils::WriteS32(out, digestStr);
+  const auto cmdline_buf = format::LegacyCmdline(args.cmdline);
+  out.Write(cmdline_buf.data(), cmdline_buf.size());
 
-  std::vector<char> extra_cmdline_buf(BOOT_EXTRA_ARGS_SIZE, 0);
-  if (args.cmdline.length() > BOOT_ARGS_SIZE - 1) {
-      auto extra_start = args.cmdline.begin() + (BOOT_ARGS_SIZE - 1);
-      size_t remaining_len = args.cmdline.length() - (BOOT_ARGS_SIZE - 1);
-      size_t extra_copy_len = std::min(remaining_len, static_cast<size_t>(BOOT_EXTRA_ARGS_SIZE));
-      std::copy_n(extra_start, extra_copy_len, extra_cmdline_buf.begin());
-  }
-  out.write(extra_cmdline_buf.data(), extra_cmdline_buf.size());
+  const auto id_field = format::FixedField<BOOT_ID_SIZE>(id);
+  out.Write(id_field.data(), id_field.size());
+
+  const auto extra_cmdline_buf = format::LegacyExtraCmdline(args.cmdline);
+  out.Write(extra_cmdline_buf.data(), extra_cmdline_buf.size());
 
   if (args.header_version > 0) {
-    utils::WriteU32(out, utils::GetFileSize(recovery_dtbo));
-    if (recovery_dtbo) {
+    out.WriteU32(utils::GetFileSize(inputs.recovery_dtbo));
+    if (inputs.recovery_dtbo) {
       uint32_t num_header_pages = 1;
-      uint32_t num_kernel_pages =
-          utils::GetNumberOfPages(utils::GetFileSize(kernel), args.page_size);
-      uint32_t num_ramdisk_pages =
-          utils::GetNumberOfPages(utils::GetFileSize(ramdisk), args.page_size);
-      uint32_t num_second_pages =
-          utils::GetNumberOfPages(utils::GetFileSize(second), args.page_size);
+      uint32_t num_kernel_pages = utils::GetNumberOfPages(
+          utils::GetFileSize(inputs.kernel), args.page_size);
+      uint32_t num_ramdisk_pages = utils::GetNumberOfPages(
+          utils::GetFileSize(inputs.ramdisk), args.page_size);
+      uint32_t num_second_pages = utils::GetNumberOfPages(
+          utils::GetFileSize(inputs.second), args.page_size);
       uint64_t dtbo_offset =
           args.page_size * (num_header_pages + num_kernel_pages +
                             num_ramdisk_pages + num_second_pages);
-      utils::WriteU64(out, dtbo_offset);
+      out.WriteU64(dtbo_offset);
     } else {
-      utils::WriteU64(out, 0);
+      out.WriteU64(0);
     }
   }
 
   if (args.header_version == 1) {
-    utils::WriteU32(out, BOOT_IMAGE_HEADER_V1_SIZE);
+    out.WriteU32(BOOT_IMAGE_HEADER_V1_SIZE);
   } else if (args.header_version == 2) {
-    utils::WriteU32(out, BOOT_IMAGE_HEADER_V2_SIZE);
+    out.WriteU32(BOOT_IMAGE_HEADER_V2_SIZE);
   }
 
   if (args.header_version > 1) {
-    if (utils::GetFileSize(dtb) == 0) {
+    out.WriteU32(utils::GetFileSize(inputs.dtb));
+    out.WriteU32(static_cast<uint64_t>(args.base) + args.dtb_offset);
+  }
+
+  out.Pad(args.page_size);
+  return out.Ok();
+}
+
+// Computes the legacy ids for header versions 0..max_version in a single pass
+// over the inputs. Every version hashes kernel, ramdisk and second; v1 adds
+// recovery_dtbo and v2 adds dtb, so the SHA-1 state is forked at those points
+// instead of rehashing the shared prefix for each version.
+std::array<std::string, 3> ComputeLegacyIds(BootInputs &inputs,
+                                            uint32_t max_version) {
+  hashing::Sha1 sha;
+  const size_t chunk_size =
+      memory::BufferSize(COPY_CHUNK_SIZE, pipeline::RING_DEPTH);
+  constexpr std::array<uint8_t, 4> zero{0, 0, 0, 0};
+  auto update_sha = [&](std::optional<utils::FileWrapper> &file) {
+    if (!file) {
+      sha.Update(zero.data(), zero.size());
+      return;
+    }
+    const pipeline::Stage hash = [&](const uint8_t *data, size_t len) {
+      sha.Update(data, len);
+      return true;
+    };
+    if (!pipeline::Run(*file, file->size, hash, chunk_size))
+      throw std::runtime_error("Could not read input while hashing.");
+
+    uint32_t size = static_cast<uint32_t>(file->size);
+    std::array<uint8_t, 4> size_bytes{
+        static_cast<uint8_t>(size & 0xFF),
+        static_cast<uint8_t>((size >> 8) & 0xFF),
+        static_cast<uint8_t>((size >> 16) & 0xFF),
+        static_cast<uint8_t>((size >> 24) & 0xFF)};
+    sha.Update(size_bytes.data(), size_bytes.size());
+  };
+  auto digest = [&]() {
+    const auto bytes = sha.Final();
+    return std::string(bytes.begin(), bytes.end());
+  };
+
+  std::array<std::string, 3> ids;
+  update_sha(inputs.kernel);
+  update_sha(inputs.ramdisk);
+  update_sha(inputs.second);
+  ids[0] = digest();
+  if (max_version > 0) {
+    update_sha(inputs.recovery_dtbo);
+    ids[1] = digest();
+  }
+  if (max_version > 1) {
+    update_sha(inputs.dtb);
+    ids[2] = digest();
+  }
+  return ids;
+}
+
+// Hashes the inputs into the legacy ids while they are copied, as
+// ComputeLegacyIds() does in a pass of its own, for streams that can only be
+// read once.
+class IdSink : public sink::Sink {
+public:
+  // Ends an input by hashing its size; an absent input hashes as empty.
+  void EndInput(size_t size) {
+    std::array<uint8_t, 4> size_bytes;
+    utils::StoreU32(size_bytes.data(), static_cast<uint32_t>(size));
+    sha_.Update(size_bytes.data(), size_bytes.size());
+  }
+  std::string Id() const {
+    const auto bytes = sha_.Final();
+    return std::string(bytes.begin(), bytes.end());
+  }
+
+protected:
+  bool DoWrite(const void *data, size_t len) override {
+    sha_.Update(data, len);
+    return true;
+  }
+
+private:
+  hashing::Sha1 sha_;
+};
+
+// One output image. With a manifest the bytes pass through a digesting sink
+// so the image is hashed while it is written, and with a store through a
+// chunking one on top.
+struct BootOutput {
+  std::unique_ptr<sink::Sink> file;
+  std::unique_ptr<delta::DeltaSink> pages;
+  std::unique_ptr<manifest::DigestingSink> digests;
+  std::unique_ptr<store::StoreSink> chunks;
+  sink::Sink *out;
+
+  BootOutput(std::unique_ptr<sink::Sink> output, const BootImageArgs &args,
+             bool hash)
+      : file(std::move(output)), out(file.get()) {
+    if (!args.delta.empty()) {
+      pages = std::make_unique<delta::DeltaSink>(
+          *out, args.delta_from, args.delta,
+          args.header_version >= 3 ? BOOT_IMAGE_HEADER_V3_PAGESIZE
+                                   : args.page_size);
+      out = pages.get();
+    }
+    if (hash) {
+      digests = std::make_unique<manifest::DigestingSink>(*out);
+      out = digests.get();
+    }
+    if (!args.store.empty()) {
+      chunks = std::make_unique<store::StoreSink>(*out, args.store);
+      out = chunks.get();
+    }
+  }
+};
+
+// Streams one input into every output that carries the section, and into
+// `ids` when given, reading it exactly once on the copy pipeline, then pads
+// each output to its own section alignment. `sinks` is scratch space that
+// the caller keeps across sections.
+bool WriteSection(const char *name, std::optional<utils::FileWrapper> &file,
+                  const std::vector<BootOutput *> &outs,
+                  const std::vector<size_t> &paddings, IdSink *ids,
+                  std::vector<sink::Sink *> &sinks) {
+  if (outs.empty())
+    return true;
+  if (!file)
+    return false;
+
+  sinks.clear();
+  for (auto *out : outs) {
+    out->out->BeginSection(name);
+    sinks.push_back(out->out);
+  }
+  if (ids)
+    sinks.push_back(ids);
+  bool ok = sink::CopyFile(
+      *file, sinks, memory::BufferSize(COPY_CHUNK_SIZE, pipeline::RING_DEPTH));
+
+  for (size_t i = 0; i < outs.size(); ++i) {
+    outs[i]->out->EndSection();
+    ok = outs[i]->out->Pad(paddings[i]) && ok;
+  }
+  return ok;
+}
+// One input section and the header versions that carry it.
+struct BootSection {
+  const char *name;
+  bool given;
+  // The file named on the command line, for errors.
+  const std::filesystem::path *path;
+  std::optional<utils::FileWrapper> *file;
+  bool (*included)(const BootImageArgs &);
+};
+
+// Section order shared by the planner and both writers. v3+ images carry no
+// recovery_dtbo or dtb, but still take second when one is given.
+std::array<BootSection, 5> ListSections(const BootImageArgs &base,
+                                        BootInputs &inputs) {
+  auto always = [](const BootImageArgs &) { return true; };
+  return {{
+      {"kernel", !base.kernel.empty(), &base.kernel, &inputs.kernel, always},
+      {"ramdisk", !base.ramdisk.empty(), &base.ramdisk, &inputs.ramdisk,
+       always},
+      {"second", !base.second.empty(), &base.second, &inputs.second, always},
+      {"recovery_dtbo",
+       !base.recovery_dtbo.empty() || !base.recovery_dtbo_overlays.empty(),
+       &base.recovery_dtbo, &inputs.recovery_dtbo,
+       [](const BootImageArgs &args) {
+         return args.header_version > 0 && args.header_version < 3;
+       }},
+      {"dtb", !base.dtb.empty(), base.dtb.empty() ? nullptr : &base.dtb.front(),
+       &inputs.dtb,
+       [](const BootImageArgs &args) { return args.header_version == 2; }},
+  }};
+}
+
+bool IsStream(const BootSection &section) {
+  return section.given && *section.file && (*section.file)->stream;
+}
+
+// Checks the input sizes against the 32-bit header size fields, and that v2
+// has a dtb. Streams are skipped until `counted`, after they were copied.
+void CheckSizes(std::span<const BootImageArgs> variants,
+                const std::array<BootSection, 5> &sections, bool counted) {
+  for (const auto &section : sections) {
+    if (section.given && (counted || !IsStream(section)) &&
+        (*section.file)->size > UINT32_MAX)
+      throw std::runtime_error(std::string("The ") + section.name +
+                               " is larger than 4 GiB.");
+  }
+  const auto &dtb = sections[4];
+  if (!counted && IsStream(dtb))
+    return;
+  for (const auto &args : variants) {
+    if (args.header_version == 2 && utils::GetFileSize(*dtb.file) == 0)
       throw std::runtime_error("Header version 2 requires dtb image.");
+  }
+}
+
+// Checks everything that is known before the first input byte is read: every
+// given input opened and fits the 32-bit header size fields, each header
+// version has the sections it needs, and every output can be created. A build
+// that passes only fails on I/O errors, or on the size of a stream.
+void Preflight(std::span<const BootImageArgs> variants,
+               const std::array<BootSection, 5> &sections) {
+  for (const auto &section : sections) {
+    if (section.given && !*section.file)
+      throw std::runtime_error(std::string("Could not open ") + section.name +
+                               " " + section.path->string() + ".");
+  }
+  CheckSizes(variants, sections, false);
+  if (!variants.front().tar.empty())
+    sink::CheckOutput(variants.front().tar, false);
+  for (const auto &args : variants) {
+    if (args.tar.empty())
+      sink::CheckOutput(args.output, args.dry_run, args.in_place, args.sparse);
+    if (!args.store.empty())
+      store::CheckStore(args.store);
+  }
+}
+
+// Reads every stream into memory, for builds that need all sizes up front.
+void SpoolStreams(const std::array<BootSection, 5> &sections) {
+  for (const auto &section : sections) {
+    if (IsStream(section))
+      utils::Spool(**section.file, utils::SPOOL_LIMIT, section.name);
+  }
+}
+
+uint32_t SectionAlignment(const BootImageArgs &args) {
+  return args.header_version >= 3 ? BOOT_IMAGE_HEADER_V3_PAGESIZE
+                                  : args.page_size;
+}
+
+layout::Image PlanBootImage(const BootImageArgs &args,
+                            const std::array<BootSection, 5> &sections) {
+  layout::Image plan;
+  plan.path = args.output;
+  plan.kind = "boot";
+  plan.header_version = args.header_version;
+  plan.alignment = SectionAlignment(args);
+  plan.sections.reserve(sections.size() + 1);
+  plan.Add("header", format::BootHeaderSize(args.header_version));
+  for (const auto &section : sections) {
+    if (section.given && section.included(args))
+      plan.Add(section.name, utils::GetFileSize(*section.file));
+  }
+  return plan;
+}
+
+bool WriteHeader(sink::Sink &out, const BootImageArgs &args,
+                 BootInputs &inputs, const std::array<std::string, 3> &ids) {
+  if (args.header_version >= 3)
+    return WriteHeaderV3Plus(out, args, inputs);
+  return WriteLegacyHeader(out, args, inputs, ids[args.header_version]);
+}
+
+// Preallocates every output, copies the sections in parallel straight to
+// their planned offsets and writes the headers last.
+void WritePlanned(std::span<const BootImageArgs> variants, BootInputs &inputs,
+                  const std::array<BootSection, 5> &sections,
+                  const std::array<std::string, 3> &ids) {
+  // Headers are rendered first so that header errors surface before any
+  // output is touched, and written last.
+  std::vector<sink::MemorySink> headers(variants.size());
+  for (size_t i = 0; i < variants.size(); ++i) {
+    if (!WriteHeader(headers[i], variants[i], inputs, ids))
+      throw errors::FileWriteError("header");
+  }
+
+  std::vector<layout::Image> plans;
+  std::vector<std::unique_ptr<layout::OutputFile>> files;
+  for (const auto &args : variants) {
+    plans.push_back(PlanBootImage(args, sections));
+    const uint64_t keep =
+        args.changed_sections
+            ? plans.back().FirstChangedOffset(*args.changed_sections)
+            : 0;
+    files.push_back(std::make_unique<layout::OutputFile>(
+        args.output, plans.back().size, keep));
+  }
+
+  // Reserved up front: the extents point into `targets`.
+  std::vector<layout::Extent> extents;
+  std::vector<layout::Target> targets;
+  extents.reserve(sections.size());
+  targets.reserve(sections.size() * variants.size());
+  for (const auto &section : sections) {
+    if (!section.given)
+      continue;
+    const size_t first = targets.size();
+    for (size_t i = 0; i < variants.size(); ++i) {
+      const auto *placed = plans[i].Find(section.name);
+      if (placed && placed->offset >= files[i]->kept())
+        targets.emplace_back(files[i].get(), placed->offset);
     }
-    utils::WriteU32(out, utils::GetFileSize(dtb));
-    utils::WriteU32(out, static_cast<uint64_t>(args.base) + args.dtb_offset);
+    layout::Extent extent;
+    extent.name = section.name;
+    extent.source = &**section.file;
+    extent.size = (*section.file)->size;
+    extent.targets = std::span(targets).subspan(first);
+    extents.push_back(extent);
   }
+  layout::CopyExtents(
+      extents, memory::BufferSize(COPY_CHUNK_SIZE, pipeline::RING_DEPTH));
 
-  utils::PadFile(out, args.page_size);
-  return out.good();
+  for (size_t i = 0; i < variants.size(); ++i) {
+    const auto &header = headers[i].data();
+    if (!files[i]->WriteAt(0, header.data(), header.size()))
+      throw errors::FileWriteError("header");
+    if (!files[i]->Close())
+      throw errors::FileWriteError("image");
+  }
 }
-} // namespace
 
-void WriteBootImage(const BootImageArgs &args) {
-  std::ofstream out(args.output, std::ios::binary);
-  if (!out)
-    throw std::runtime_error("Could not open output file.");
+// Writes the opened `outs` of `variants` front to back and closes them. With
+// `back_patch` set, streams are copied before their sizes are known: the
+// headers are written with what is known, the legacy ids are hashed during
+// the copy, and the finished headers are patched over the first ones at the
+// end.
+void WriteOutputs(std::span<const BootImageArgs> variants,
+                  std::span<const std::unique_ptr<BootOutput>> outs,
+                  BootInputs &inputs,
+                  const std::array<BootSection, 5> &sections,
+                  std::array<std::string, 3> &ids, bool back_patch) {
+  for (size_t i = 0; i < variants.size(); ++i) {
+    if (!WriteHeader(*outs[i]->out, variants[i], inputs, ids))
+      throw errors::FileWriteError("header");
+  }
+
+  // Versions 0, 1 and 2 hash the first 3, 4 and 5 inputs.
+  IdSink id_sink;
+  size_t id_inputs = 0;
+  for (const auto &args : variants) {
+    if (back_patch && args.header_version < 3)
+      id_inputs = std::max<size_t>(id_inputs, 3 + args.header_version);
+  }
+  // Reused for every section, so copying one allocates nothing.
+  std::vector<BootOutput *> targets;
+  std::vector<size_t> paddings;
+  std::vector<sink::Sink *> sinks;
+  targets.reserve(variants.size());
+  paddings.reserve(variants.size());
+  sinks.reserve(variants.size() + 1);
+  for (size_t k = 0; k < sections.size(); ++k) {
+    const auto &section = sections[k];
+    IdSink *hashing = k < id_inputs ? &id_sink : nullptr;
+    if (section.given) {
+      targets.clear();
+      paddings.clear();
+      for (size_t i = 0; i < variants.size(); ++i) {
+        if (!section.included(variants[i]))
+          continue;
+        targets.push_back(outs[i].get());
+        paddings.push_back(SectionAlignment(variants[i]));
+      }
+      if (!WriteSection(section.name, *section.file, targets, paddings,
+                        hashing, sinks))
+        throw errors::FileWriteError(section.name);
+    }
+    if (hashing) {
+      id_sink.EndInput(utils::GetFileSize(*section.file));
+      if (k >= 2)
+        ids[k - 2] = id_sink.Id();
+    }
+  }
 
-  if (args.header_version >= 3) {
-      if (!WriteHeaderV3Plus(out, args))
+  if (back_patch) {
+    CheckSizes(variants, sections, true);
+    for (size_t i = 0; i < variants.size(); ++i) {
+      // Only the header struct changes; its page padding may already be a
+      // FILL chunk of a sparse output, which cannot be patched.
+      sink::MemorySink header;
+      if (!WriteHeader(header, variants[i], inputs, ids) ||
+          !outs[i]->out->Patch(
+              0, header.data().data(),
+              format::BootHeaderSize(variants[i].header_version)))
         throw errors::FileWriteError("header");
-  } else {
-    if (!WriteLegacyHeader(out, args))
-      throw errors::FileWriteError("header");
+    }
   }
 
-  const size_t data_padding_size = (args.header_version >= 3) ? BOOT_IMAGE_HEADER_V3_PAGESIZE : args.page_size;
+  for (size_t i = 0; i < variants.size(); ++i) {
+    if (!outs[i]->out->Close())
+      throw errors::FileWriteError("image");
+    const auto summary = outs[i]->file->Summary();
+    if (!summary.empty())
+      std::cout << variants[i].output.string() << ": " << summary << "\n";
+    if (outs[i]->chunks)
+      std::cout << variants[i].output.string() << ": "
+                << outs[i]->chunks->Summary() << "\n";
+    if (outs[i]->pages)
+      std::cout << variants[i].delta.string() << ": "
+                << outs[i]->pages->Summary() << "\n";
+  }
+}
 
-  // Write kernel/ramdisk/second data
-  auto write_section = [&](const auto &path) {
-    if (!path.empty()) {
-      auto file = utils::OpenFile(path);
-      if (!file) return false;
-      auto data = utils::ReadFileContents(*file);
-      out.write(reinterpret_cast<const char *>(data.data()), data.size());
-      utils::PadFile(out, data_padding_size);
+// Writes every output front to back through sinks, for manifests, dry runs
+// and the outputs that need the bytes in order; see WriteOutputs(). With a
+// tar archive the images become its members, one after the other.
+void WriteSequential(std::span<const BootImageArgs> variants,
+                     BootInputs &inputs,
+                     const std::array<BootSection, 5> &sections,
+                     std::array<std::string, 3> &ids, bool back_patch) {
+  const BootImageArgs &base = variants.front();
+  const bool hash_outputs = !base.manifest.empty();
+  std::vector<std::unique_ptr<BootOutput>> outs;
+  outs.reserve(variants.size());
+  if (!base.tar.empty()) {
+    // Members cannot interleave, so each image reads the inputs again. Their
+    // sizes are all known, which is what the member headers need.
+    auto archive = tar::Archive::Open(base.tar);
+    for (size_t i = 0; i < variants.size(); ++i) {
+      const uint64_t size = PlanBootImage(variants[i], sections).size;
+      outs.push_back(std::make_unique<BootOutput>(
+          archive->AddMember(variants[i].output, size), variants[i],
+          hash_outputs));
+      WriteOutputs(variants.subspan(i, 1), std::span(outs).subspan(i, 1),
+                   inputs, sections, ids, back_patch);
     }
-    return true;
-  };
+    if (!archive->Close())
+      throw errors::FileWriteError("archive");
+  } else {
+    for (const auto &args : variants)
+      outs.push_back(std::make_unique<BootOutput>(
+          sink::OpenOutput(args.output, args.dry_run, args.in_place,
+                           args.sparse),
+          args, hash_outputs));
+    WriteOutputs(variants, outs, inputs, sections, ids, back_patch);
+  }
 
-  if (!write_section(args.kernel))
-    throw errors::FileWriteError("kernel");
-  if (!write_section(args.ramdisk))
-    throw errors::FileWriteError("ramdisk");
-  if (!write_section(args.second))
-    throw errors::FileWriteError("second");
+  if (hash_outputs) {
+    std::vector<manifest::ImageRecord> records;
+    for (size_t i = 0; i < variants.size(); ++i)
+      records.push_back(outs[i]->digests->Finish(variants[i].output));
+    manifest::WriteManifest(base.manifest, records);
+  }
+}
+} // namespace
+
+void WriteBootImage(const BootImageArgs &args) {
+  WriteBootImages(std::span<const BootImageArgs>(&args, 1));
+}
 
-  if (args.header_version > 0 && args.header_version < 3) {
-    if (!write_section(args.recovery_dtbo))
-     throw errors::FileWriteError("recovery_dtbo");
+std::vector<layout::Image>
+PlanBootImages(std::span<const BootImageArgs> variants) {
+  std::vector<layout::Image> plans;
+  if (variants.empty())
+    return plans;
+  BootInputs inputs(variants.front());
+  const auto sections = ListSections(variants.front(), inputs);
+  SpoolStreams(sections);
+  for (const auto &args : variants)
+    plans.push_back(PlanBootImage(args, sections));
+  return plans;
+}
+
+std::vector<std::pair<std::filesystem::path, std::string>>
+BootInputSections(const BootImageArgs &args) {
+  std::vector<std::pair<std::filesystem::path, std::string>> inputs;
+  auto add = [&](const std::filesystem::path &path, const char *section) {
+    if (!path.empty())
+      inputs.emplace_back(path, section);
+  };
+  add(args.kernel, "kernel");
+  add(args.ramdisk, "ramdisk");
+  add(args.second, "second");
+  add(args.recovery_dtbo, "recovery_dtbo");
+  for (const auto &overlay : args.recovery_dtbo_overlays)
+    add(overlay.path, "recovery_dtbo");
+  for (const auto &path : args.dtb)
+    add(path, "dtb");
+  return inputs;
+}
+
+void WriteBootImages(std::span<const BootImageArgs> variants) {
+  if (variants.empty())
+    return;
+
+  // Variants only differ in header fields and layout; the inputs are shared.
+  const BootImageArgs &base = variants.front();
+  BootInputs inputs(base);
+  const auto sections = ListSections(base, inputs);
+  Preflight(variants, sections);
+
+  // Digests, dry runs, pipes and in-place updates need the bytes in order;
+  // everything else is written at planned offsets.
+  const bool streamed =
+      std::any_of(variants.begin(), variants.end(), [](const auto &args) {
+        return args.in_place || sink::IsBlockDevice(args.output) ||
+               sink::IsStreamOutput(args.output);
+      });
+  // Streams go straight into outputs whose header can be patched once their
+  // sizes are known. A manifest, a store or a delta hashes the header first
+  // and the other sequential outputs never seek back, so for those they are
+  // spooled.
+  const bool has_streams =
+      std::any_of(sections.begin(), sections.end(), IsStream);
+  const bool back_patch = has_streams && base.manifest.empty() &&
+                          base.store.empty() && base.tar.empty() &&
+                          base.delta.empty() && !streamed;
+  if (has_streams && !back_patch) {
+    SpoolStreams(sections);
+    CheckSizes(variants, sections, true);
   }
 
-  if (args.header_version == 2) {
-      if (!write_section(args.dtb))
-        throw errors::FileWriteError("dtb");
+  uint32_t max_legacy_version = 0;
+  bool any_legacy = false;
+  for (const auto &args : variants) {
+    if (args.header_version < 3) {
+      any_legacy = true;
+      max_legacy_version = std::max(max_legacy_version, args.header_version);
+    }
   }
+  std::array<std::string, 3> ids;
+  if (any_legacy && !back_patch)
+    ids = ComputeLegacyIds(inputs, max_legacy_version);
+
+  // Sparse outputs are encoded as they are written; their headers still
+  // patch, so streams go straight in.
+  const bool sparse = std::any_of(variants.begin(), variants.end(),
+                                  [](const auto &args) { return args.sparse; });
+  if (base.manifest.empty() && base.store.empty() && base.tar.empty() &&
+      base.delta.empty() && !base.dry_run && !streamed && !back_patch &&
+      !sparse)
+    WritePlanned(variants, inputs, sections, ids);
+  else
+    WriteSequential(variants, inputs, sections, ids, back_patch);
 }
@@ -1,13 +1,20 @@
 #pragma once
 
+#include "dtb.h"
+#include "layout.h"
 #include "utils.hpp"
+#include <span>
 
 struct BootImageArgs {
   std::filesystem::path kernel;
   std::filesystem::path ramdisk;
   std::filesystem::path second;
-  std::filesystem::path dtb;
+  // One pre-concatenated blob, or several blobs/directories; see dtb.h.
+  std::vector<std::filesystem::path> dtb;
   std::filesystem::path recovery_dtbo;
+  // Overlays of a recovery DTBO built in place of a prebuilt
+  // `recovery_dtbo`; see dtb::OpenOverlayTable.
+  std::vector<dtb::Overlay> recovery_dtbo_overlays;
   std::string cmdline;
   uint32_t base = 0x10000000;
   uint32_t kernel_offset = 0x00008000;
@@ -20,8 +27,38 @@ struct BootImageArgs {
   uint32_t page_size = 2048;
   uint32_t header_version = 4;
   std::filesystem::path output;
+  std::filesystem::path manifest;
+  // Also store the image in this chunk store (see store::StoreSink).
+  std::filesystem::path store;
+  // Write the image as a member of this tar archive, named after `output`,
+  // instead of to `output` itself.
+  std::filesystem::path tar;
+  // Also write the pages that differ from the previous build `delta_from` to
+  // `delta` (see delta::DeltaSink).
+  std::filesystem::path delta_from;
+  std::filesystem::path delta;
   bool print_id = false;
+  // Lay the image out without creating the output file.
+  bool dry_run = false;
+  // Rewrite only the blocks of an existing output that changed (always on
+  // for block devices).
+  bool in_place = false;
+  // Write the image in the Android sparse format (see sink::SparseSink).
+  bool sparse = false;
+  // Set by --watch once the output holds a previous build: only these
+  // sections have new contents. The header and every section from the first
+  // changed one on are rewritten, earlier sections are kept in place.
+  std::optional<std::vector<std::string>> changed_sections;
 };
 
 // std::optional<BootImageArgs> ParseArguments(int argc, char* argv[]);
 void WriteBootImage(const BootImageArgs &args);
+// Builds several boot images that share the same input files. The inputs of
+// the first variant are read once and streamed to every output.
+void WriteBootImages(std::span<const BootImageArgs> variants);
+// Computes the layout of every variant from the input sizes without writing.
+std::vector<layout::Image>
+PlanBootImages(std::span<const BootImageArgs> variants);
+// Every input path of the image paired with the section it feeds.
+std::vector<std::pair<std::filesystem::path, std::string>>
+BootInputSections(const BootImageArgs &args);
@@ -0,0 +1,323 @@
+#include "delta.h"
+#include "hash.h"
+#include "memory.h"
+#include "sink.h"
+#include "utils.hpp"
+
+#include <cstring>
+#include <iostream>
+
+namespace {
+
+constexpr std::string_view DELTA_MAGIC = "MKBDELTA";
+constexpr size_t HEADER_SIZE = 104;
+constexpr size_t RECORD_HEADER_SIZE = 8;
+constexpr size_t DELTA_CHUNK_SIZE = 4 << 20;
+
+// Input that throws on read errors, which keeps the passes below linear.
+class InputFile {
+public:
+  explicit InputFile(const std::filesystem::path &path) : path_(path) {
+    auto file = utils::OpenFile(path);
+    if (!file)
+      throw std::runtime_error("Could not open " + path.string());
+    file_ = std::move(*file);
+  }
+
+  uint64_t size() const { return file_.size; }
+
+  void ReadAt(uint64_t offset, uint8_t *buf, size_t len) const {
+    if (!file_.ReadAt(offset, buf, len))
+      throw std::runtime_error("Could not read " + path_.string());
+  }
+
+private:
+  std::filesystem::path path_;
+  utils::FileWrapper file_;
+};
+
+struct Header {
+  uint32_t page_size = 0;
+  uint64_t base_size = 0;
+  uint64_t target_size = 0;
+  uint32_t changed = 0;
+  hashing::Sha256::Digest base_digest{};
+  hashing::Sha256::Digest target_digest{};
+};
+
+void StoreU64(uint8_t *bytes, uint64_t value) {
+  utils::StoreU32(bytes, static_cast<uint32_t>(value));
+  utils::StoreU32(bytes + 4, static_cast<uint32_t>(value >> 32));
+}
+
+std::array<uint8_t, HEADER_SIZE> EncodeHeader(const Header &header) {
+  std::array<uint8_t, HEADER_SIZE> bytes{};
+  std::copy(DELTA_MAGIC.begin(), DELTA_MAGIC.end(), bytes.begin());
+  utils::StoreU32(bytes.data() + 8, delta::FORMAT_VERSION);
+  utils::StoreU32(bytes.data() + 12, header.page_size);
+  StoreU64(bytes.data() + 16, header.base_size);
+  StoreU64(bytes.data() + 24, header.target_size);
+  utils::StoreU32(bytes.data() + 32, header.changed);
+  std::copy(header.base_digest.begin(), header.base_digest.end(),
+            bytes.begin() + 40);
+  std::copy(header.target_digest.begin(), header.target_digest.end(),
+            bytes.begin() + 72);
+  return bytes;
+}
+
+Header DecodeHeader(const std::array<uint8_t, HEADER_SIZE> &bytes) {
+  if (!std::equal(DELTA_MAGIC.begin(), DELTA_MAGIC.end(), bytes.begin()))
+    throw std::runtime_error("Not a delta file (bad magic).");
+  if (utils::ReadU32(bytes.data() + 8) != delta::FORMAT_VERSION)
+    throw std::runtime_error("Unsupported delta format version " +
+                             std::to_string(utils::ReadU32(bytes.data() + 8)));
+  Header header;
+  header.page_size = utils::ReadU32(bytes.data() + 12);
+  header.base_size = utils::ReadU64(bytes.data() + 16);
+  header.target_size = utils::ReadU64(bytes.data() + 24);
+  header.changed = utils::ReadU32(bytes.data() + 32);
+  std::copy(bytes.begin() + 40, bytes.begin() + 72,
+            header.base_digest.begin());
+  std::copy(bytes.begin() + 72, bytes.begin() + 104,
+            header.target_digest.begin());
+  if (header.page_size == 0)
+    throw std::runtime_error("Delta has a page size of 0.");
+  return header;
+}
+
+uint32_t PageCrc(const uint8_t *data, size_t len) {
+  hashing::Crc32c crc;
+  crc.Update(data, len);
+  return crc.Final();
+}
+
+// Whole pages per read, sized so the two buffers of a pass fit the memory
+// budget.
+size_t ChunkSize(uint32_t page_size) {
+  const size_t budget = memory::BufferSize(DELTA_CHUNK_SIZE, 2);
+  return std::max<size_t>(page_size, budget / page_size * page_size);
+}
+
+} // namespace
+
+namespace delta {
+
+DeltaSink::DeltaSink(sink::Sink &target, const std::filesystem::path &base,
+                     const std::filesystem::path &delta_path,
+                     uint32_t page_size)
+    : target_(target), base_path_(base), page_size_(page_size) {
+  if (page_size == 0)
+    throw std::runtime_error("Delta page size must not be 0.");
+  auto file = utils::OpenFile(base);
+  if (!file)
+    throw std::runtime_error("Could not open " + base.string());
+  base_ = std::move(*file);
+  chunk_size_ = ChunkSize(page_size);
+  page_ = memory::Acquire(page_size);
+  base_chunk_ = memory::Acquire(chunk_size_);
+  out_ = sink::OpenOutput(delta_path, false);
+  const std::array<uint8_t, HEADER_SIZE> placeholder{};
+  out_->Write(placeholder.data(), placeholder.size());
+}
+
+DeltaSink::~DeltaSink() = default;
+
+bool DeltaSink::Flush() { return target_.Flush() && Ok(); }
+
+// Reads the base chunk after the current one, which must hold `offset`. The
+// chunks are read in order, so the base digest is computed as they arrive.
+bool DeltaSink::LoadBase(uint64_t offset) {
+  while (base_offset_ + base_len_ <= offset &&
+         base_offset_ + base_len_ < base_.size) {
+    base_offset_ += base_len_;
+    base_len_ = static_cast<size_t>(
+        std::min<uint64_t>(chunk_size_, base_.size - base_offset_));
+    if (!base_.ReadAt(base_offset_, base_chunk_.get(), base_len_))
+      return false;
+    base_sha_.Update(base_chunk_.get(), base_len_);
+  }
+  return true;
+}
+
+bool DeltaSink::AddPage(const uint8_t *data, size_t len) {
+  if (pages_ > UINT32_MAX)
+    return false;
+  const uint64_t offset = pages_ * page_size_;
+  target_sha_.Update(data, len);
+  if (!LoadBase(offset))
+    return false;
+  // Chunks are whole pages, so a page of the base never straddles two.
+  const bool in_base = offset + len <= base_offset_ + base_len_ &&
+                       offset >= base_offset_;
+  const bool same =
+      in_base &&
+      std::memcmp(base_chunk_.get() + (offset - base_offset_), data, len) == 0;
+  if (!same) {
+    out_->WriteU32(static_cast<uint32_t>(pages_));
+    out_->WriteU32(PageCrc(data, len));
+    out_->Write(data, len);
+    ++changed_;
+  }
+  ++pages_;
+  return out_->Ok();
+}
+
+bool DeltaSink::DoWrite(const void *data, size_t len) {
+  const auto *bytes = static_cast<const uint8_t *>(data);
+  for (size_t done = 0; done < len;) {
+    if (filled_ == 0 && len - done >= page_size_) {
+      if (!AddPage(bytes + done, page_size_))
+        return false;
+      done += page_size_;
+      continue;
+    }
+    const size_t n = std::min(len - done, page_size_ - filled_);
+    std::memcpy(page_.get() + filled_, bytes + done, n);
+    filled_ += n;
+    done += n;
+    if (filled_ == page_size_) {
+      filled_ = 0;
+      if (!AddPage(page_.get(), page_size_))
+        return false;
+    }
+  }
+  return target_.Write(data, len);
+}
+
+bool DeltaSink::Close() {
+  if (!Ok())
+    return false;
+  if (filled_ > 0 && !AddPage(page_.get(), filled_)) {
+    Fail();
+    return false;
+  }
+  filled_ = 0;
+  // The base digest covers the whole base, including anything past the end
+  // of a shorter target; it is read before the target can replace it.
+  if (!LoadBase(base_.size) || !target_.Close()) {
+    Fail();
+    return false;
+  }
+
+  Header header;
+  header.page_size = page_size_;
+  header.base_size = base_.size;
+  header.target_size = Position();
+  header.changed = changed_;
+  header.base_digest = base_sha_.Final();
+  header.target_digest = target_sha_.Final();
+  const auto encoded = EncodeHeader(header);
+  if (!out_->Patch(0, encoded.data(), encoded.size()) || !out_->Close()) {
+    Fail();
+    return false;
+  }
+  return true;
+}
+
+std::string DeltaSink::Summary() const {
+  return std::to_string(changed_) + " of " + std::to_string(pages_) +
+         " pages changed, " + std::to_string(out_->Position()) + " bytes";
+}
+
+void ApplyDelta(const std::filesystem::path &base,
+                const std::filesystem::path &delta_path,
+                const std::filesystem::path &output) {
+  InputFile old_image(base);
+  InputFile patch(delta_path);
+  std::error_code ec;
+  if (std::filesystem::equivalent(base, output, ec) ||
+      std::filesystem::equivalent(delta_path, output, ec))
+    throw std::runtime_error("The output must not overwrite the base image or "
+                             "the delta.");
+
+  std::array<uint8_t, HEADER_SIZE> header_bytes;
+  if (patch.size() < HEADER_SIZE)
+    throw std::runtime_error("Delta file is truncated.");
+  patch.ReadAt(0, header_bytes.data(), header_bytes.size());
+  const Header header = DecodeHeader(header_bytes);
+  if (header.base_size != old_image.size())
+    throw std::runtime_error(
+        "Delta was made against a " + std::to_string(header.base_size) +
+        " byte image, " + base.string() + " has " +
+        std::to_string(old_image.size()) + " bytes.");
+
+  auto out = sink::OpenOutput(output, false);
+  hashing::Sha256 base_sha;
+  hashing::Sha256 target_sha;
+  const uint64_t page_size = header.page_size;
+  const size_t chunk_size = ChunkSize(header.page_size);
+  const auto chunk = memory::Acquire(chunk_size);
+
+  uint64_t record_offset = HEADER_SIZE;
+  uint32_t records_left = header.changed;
+  std::optional<uint64_t> last_page;
+  auto malformed = [] {
+    return std::runtime_error("Delta file is malformed.");
+  };
+
+  for (uint64_t offset = 0; offset < header.target_size;
+       offset += chunk_size) {
+    const size_t len = static_cast<size_t>(
+        std::min<uint64_t>(chunk_size, header.target_size - offset));
+    const size_t from_base =
+        offset < old_image.size()
+            ? static_cast<size_t>(
+                  std::min<uint64_t>(len, old_image.size() - offset))
+            : 0;
+    old_image.ReadAt(offset, chunk.get(), from_base);
+    base_sha.Update(chunk.get(), from_base);
+    std::fill(chunk.get() + from_base, chunk.get() + len, 0);
+
+    // Overlay the changed pages that fall into this chunk.
+    while (records_left > 0) {
+      std::array<uint8_t, RECORD_HEADER_SIZE> record;
+      if (record_offset + record.size() > patch.size())
+        throw malformed();
+      patch.ReadAt(record_offset, record.data(), record.size());
+      const uint64_t page = utils::ReadU32(record.data());
+      const uint64_t page_offset = page * page_size;
+      if (page_offset >= offset + len)
+        break;
+      if (page_offset < offset || (last_page && page <= *last_page))
+        throw malformed();
+      const size_t page_len = static_cast<size_t>(
+          std::min<uint64_t>(page_size, header.target_size - page_offset));
+      const uint64_t data_offset = record_offset + record.size();
+      if (data_offset + page_len > patch.size())
+        throw malformed();
+      uint8_t *data = chunk.get() + (page_offset - offset);
+      patch.ReadAt(data_offset, data, page_len);
+      if (PageCrc(data, page_len) != utils::ReadU32(record.data() + 4))
+        throw std::runtime_error("Delta page " + std::to_string(page) +
+                                 " is corrupt.");
+      record_offset = data_offset + page_len;
+      last_page = page;
+      --records_left;
+    }
+
+    target_sha.Update(chunk.get(), len);
+    if (!out->Write(chunk.get(), len))
+      throw errors::FileWriteError("image");
+  }
+  if (records_left > 0 || record_offset != patch.size())
+    throw malformed();
+
+  // The base digest covers the whole base, including anything past the end
+  // of a shorter target.
+  for (uint64_t offset = header.target_size; offset < old_image.size();
+       offset += chunk_size) {
+    const size_t len = static_cast<size_t>(
+        std::min<uint64_t>(chunk_size, old_image.size() - offset));
+    old_image.ReadAt(offset, chunk.get(), len);
+    base_sha.Update(chunk.get(), len);
+  }
+  if (base_sha.Final() != header.base_digest)
+    throw std::runtime_error("Delta does not apply: " + base.string() +
+                             " is not the image it was made against.");
+  if (target_sha.Final() != header.target_digest)
+    throw std::runtime_error("Delta result does not match its digest.");
+  if (!out->Close())
+    throw errors::FileWriteError("image");
+}
+
+} // namespace delta
@@ -0,0 +1,77 @@
+#pragma once
+
+#include "hash.h"
+#include "memory.h"
+#include "sink.h"
+#include <filesystem>
+
+// Page-granular deltas between two images, for transferring only what changed
+// between builds. A delta file is little-endian:
+//
+//   header (104 bytes): magic "MKBDELTA", u32 format version (1),
+//     u32 page_size, u64 base_size, u64 target_size, u32 changed pages,
+//     u32 reserved, SHA-256 of the base image, SHA-256 of the target image
+//   one record per changed page, in ascending page order: u32 page index,
+//     u32 CRC-32C of the page data, then the page data (page_size bytes, or
+//     the remainder for the last page of the target)
+//
+// Pages past the end of the base are always recorded.
+namespace delta {
+
+constexpr uint32_t FORMAT_VERSION = 1;
+
+// Sink that forwards every byte to `target` and compares each page with
+// `base` as it is written, writing the pages that differ to `delta_path`. The
+// page CRCs and both image digests are computed in the same pass, so neither
+// image is read again afterwards. The base is opened before anything is
+// written and read in full before `target` is closed, so an output that
+// replaces the base (the usual iterative build) still compares against the
+// previous image. Patching is not supported, since pages are final once
+// written. Close() closes `target`, then publishes the delta.
+class DeltaSink : public sink::Sink {
+public:
+  // Throws if the base cannot be opened or the delta file created.
+  DeltaSink(sink::Sink &target, const std::filesystem::path &base,
+            const std::filesystem::path &delta_path, uint32_t page_size);
+  ~DeltaSink() override;
+
+  bool Flush() override;
+  bool Close() override;
+  // "N of M pages changed, B bytes", once closed.
+  std::string Summary() const override;
+
+protected:
+  bool DoWrite(const void *data, size_t len) override;
+
+private:
+  bool AddPage(const uint8_t *data, size_t len);
+  bool LoadBase(uint64_t offset);
+
+  sink::Sink &target_;
+  std::filesystem::path base_path_;
+  utils::FileWrapper base_;
+  std::unique_ptr<sink::Sink> out_;
+  uint32_t page_size_;
+  // The page being collected, and the chunk of the base holding the current
+  // page, which starts at base_offset_.
+  memory::Buffer page_;
+  size_t filled_ = 0;
+  memory::Buffer base_chunk_;
+  size_t chunk_size_;
+  uint64_t base_offset_ = 0;
+  size_t base_len_ = 0;
+  uint64_t pages_ = 0;
+  uint32_t changed_ = 0;
+  hashing::Sha256 base_sha_;
+  hashing::Sha256 target_sha_;
+};
+
+// Rebuilds the target image from `base` and a delta written by WriteDelta().
+// Throws if the delta is malformed, a page fails its CRC, or the base or the
+// result do not match the digests recorded in the delta. The output is staged
+// and only replaced once the result checks out.
+void ApplyDelta(const std::filesystem::path &base,
+                const std::filesystem::path &delta_path,
+                const std::filesystem::path &output);
+
+} // namespace delta
@@ -0,0 +1,329 @@
+#include "dtb.h"
+#include "hash.h"
+#include "memory.h"
+#include "pipeline.h"
+
+#include <algorithm>
+#include <cstring>
+#include <map>
+
+namespace {
+
+constexpr uint32_t FDT_MAGIC = 0xd00dfeed;
+constexpr size_t FDT_HEADER_SIZE = 40;
+constexpr uint32_t DT_TABLE_MAGIC = 0xd7b7ab1e;
+constexpr uint32_t DT_TABLE_HEADER_SIZE = 32;
+constexpr uint32_t DT_TABLE_ENTRY_SIZE = 32;
+constexpr size_t SCAN_CHUNK_SIZE = 256 * 1024;
+
+uint32_t ReadBE32(const uint8_t *p) {
+  return (static_cast<uint32_t>(p[0]) << 24) |
+         (static_cast<uint32_t>(p[1]) << 16) |
+         (static_cast<uint32_t>(p[2]) << 8) | static_cast<uint32_t>(p[3]);
+}
+
+void AppendBE32(std::vector<uint8_t> &out, uint32_t value) {
+  out.push_back(static_cast<uint8_t>(value >> 24));
+  out.push_back(static_cast<uint8_t>(value >> 16));
+  out.push_back(static_cast<uint8_t>(value >> 8));
+  out.push_back(static_cast<uint8_t>(value));
+}
+
+struct ScannedBlob {
+  std::filesystem::path path;
+  uint64_t size = 0;
+  hashing::Sha256::Digest digest{};
+  std::string error;
+};
+
+// Checks the FDT header of one blob and hashes its contents.
+void CheckBlob(ScannedBlob &blob, size_t chunk_size) {
+  auto in = utils::OpenFile(blob.path);
+  if (!in) {
+    blob.error = utils::IsStreamInput(blob.path)
+                     ? "a stream is only accepted as the only --dtb"
+                     : "cannot open";
+    return;
+  }
+  blob.size = in->size;
+
+  std::array<uint8_t, FDT_HEADER_SIZE> hdr;
+  if (blob.size < hdr.size() || !in->ReadAt(0, hdr.data(), hdr.size())) {
+    blob.error = "too small for an FDT header";
+    return;
+  }
+  const uint32_t magic = ReadBE32(hdr.data());
+  const uint32_t totalsize = ReadBE32(hdr.data() + 4);
+  const uint32_t off_dt_struct = ReadBE32(hdr.data() + 8);
+  const uint32_t off_dt_strings = ReadBE32(hdr.data() + 12);
+  const uint32_t size_dt_strings = ReadBE32(hdr.data() + 32);
+  const uint32_t size_dt_struct = ReadBE32(hdr.data() + 36);
+  if (magic != FDT_MAGIC) {
+    blob.error = "bad FDT magic";
+    return;
+  }
+  if (totalsize < FDT_HEADER_SIZE || totalsize > blob.size ||
+      static_cast<uint64_t>(off_dt_struct) + size_dt_struct > totalsize ||
+      static_cast<uint64_t>(off_dt_strings) + size_dt_strings > totalsize) {
+    blob.error = "FDT header sizes are inconsistent";
+    return;
+  }
+
+  hashing::Sha256 sha;
+  sha.Update(hdr.data(), hdr.size());
+  const auto buffer = memory::Acquire(chunk_size);
+  for (uint64_t offset = hdr.size(); offset < blob.size;) {
+    const size_t n =
+        static_cast<size_t>(std::min<uint64_t>(chunk_size, blob.size - offset));
+    if (!in->ReadAt(offset, buffer.get(), n)) {
+      blob.error = "read error";
+      return;
+    }
+    sha.Update(buffer.get(), n);
+    offset += n;
+  }
+  blob.digest = sha.Final();
+}
+
+// CheckBlob(), with anything it throws (an unreadable zip entry, a used-up
+// --max-memory) kept as the blob's error, to be reported in input order.
+void ScanBlob(ScannedBlob &blob, size_t chunk_size) {
+  try {
+    CheckBlob(blob, chunk_size);
+  } catch (const std::exception &e) {
+    blob.error = e.what();
+  }
+}
+
+std::vector<std::filesystem::path>
+ExpandPaths(const std::vector<std::filesystem::path> &paths) {
+  std::vector<std::filesystem::path> files;
+  for (const auto &path : paths) {
+    if (!std::filesystem::is_directory(path)) {
+      files.push_back(path);
+      continue;
+    }
+    std::vector<std::filesystem::path> entries;
+    for (const auto &entry : std::filesystem::directory_iterator(path)) {
+      if (entry.is_regular_file() && entry.path().extension() == ".dtb")
+        entries.push_back(entry.path());
+    }
+    std::sort(entries.begin(), entries.end());
+    files.insert(files.end(), entries.begin(), entries.end());
+  }
+  return files;
+}
+
+// Reads a list of files back to back. Only the blob being read is kept open,
+// so the descriptor count does not grow with the number of blobs.
+class ConcatReader : public utils::Reader {
+public:
+  struct Part {
+    std::filesystem::path path;
+    uint64_t offset;
+    uint64_t size;
+  };
+
+  explicit ConcatReader(std::vector<Part> parts) : parts_(std::move(parts)) {}
+
+  bool ReadAt(uint64_t offset, void *data, size_t len) override {
+    auto *bytes = static_cast<uint8_t *>(data);
+    auto part = std::upper_bound(
+        parts_.begin(), parts_.end(), offset,
+        [](uint64_t value, const Part &p) { return value < p.offset; });
+    if (part == parts_.begin())
+      return len == 0;
+    --part;
+    while (len > 0) {
+      if (part == parts_.end())
+        return false;
+      const uint64_t within = offset - part->offset;
+      if (within >= part->size) {
+        ++part;
+        continue;
+      }
+      const size_t index = static_cast<size_t>(part - parts_.begin());
+      if (index != open_index_ || !file_) {
+        file_ = utils::OpenFile(part->path);
+        open_index_ = index;
+        if (!file_ || file_->size != part->size)
+          return false;
+      }
+      const size_t n =
+          static_cast<size_t>(std::min<uint64_t>(len, part->size - within));
+      if (!file_->ReadAt(within, bytes, n))
+        return false;
+      bytes += n;
+      offset += n;
+      len -= n;
+      ++part;
+    }
+    return true;
+  }
+
+private:
+  std::vector<Part> parts_;
+  std::optional<utils::FileWrapper> file_;
+  size_t open_index_ = 0;
+};
+
+// Reads an in-memory table followed by blobs whose parts start after it.
+class TableReader : public utils::Reader {
+public:
+  TableReader(std::vector<uint8_t> table, std::vector<ConcatReader::Part> blobs)
+      : table_(std::move(table)), blobs_(std::move(blobs)) {}
+
+  bool ReadAt(uint64_t offset, void *data, size_t len) override {
+    auto *bytes = static_cast<uint8_t *>(data);
+    if (offset < table_.size()) {
+      const size_t n =
+          static_cast<size_t>(std::min<uint64_t>(len, table_.size() - offset));
+      std::memcpy(bytes, table_.data() + offset, n);
+      bytes += n;
+      offset += n;
+      len -= n;
+    }
+    return len == 0 || blobs_.ReadAt(offset, bytes, len);
+  }
+
+private:
+  std::vector<uint8_t> table_;
+  ConcatReader blobs_;
+};
+
+// Validates and hashes `files` in parallel. Throws for the first invalid
+// one, in input order, naming it as a `what`.
+std::vector<ScannedBlob>
+ScanBlobs(const std::vector<std::filesystem::path> &files, size_t chunk_size,
+          const char *what) {
+  std::vector<ScannedBlob> blobs(files.size());
+  for (size_t i = 0; i < files.size(); ++i)
+    blobs[i].path = files[i];
+
+  pipeline::RunJobs(blobs.size(), memory::Workers(blobs.size(), chunk_size),
+                    [&](size_t i) {
+                      ScanBlob(blobs[i], chunk_size);
+                      return true;
+                    });
+
+  for (const auto &blob : blobs) {
+    if (!blob.error.empty())
+      throw std::runtime_error(std::string("Invalid ") + what + " " +
+                               blob.path.string() + ": " + blob.error);
+  }
+  return blobs;
+}
+
+// For every blob, the index of the first blob with the same contents (its
+// own index if there is none). Digests pick the candidates, which are then
+// compared byte for byte.
+std::vector<size_t> FindOwners(const std::vector<ScannedBlob> &blobs,
+                               size_t chunk_size) {
+  std::map<hashing::Sha256::Digest, std::vector<size_t>> seen;
+  std::vector<size_t> owners(blobs.size());
+  for (size_t i = 0; i < blobs.size(); ++i) {
+    const auto &blob = blobs[i];
+    auto &candidates = seen[blob.digest];
+    const auto owner =
+        std::find_if(candidates.begin(), candidates.end(), [&](size_t j) {
+          return blobs[j].size == blob.size &&
+                 utils::SameContents(blobs[j].path, blob.path, chunk_size);
+        });
+    if (owner != candidates.end()) {
+      owners[i] = *owner;
+      continue;
+    }
+    candidates.push_back(i);
+    owners[i] = i;
+  }
+  return owners;
+}
+
+} // namespace
+
+namespace dtb {
+
+std::optional<utils::FileWrapper>
+OpenSection(const std::vector<std::filesystem::path> &paths) {
+  if (paths.empty())
+    return std::nullopt;
+  if (paths.size() == 1 && !std::filesystem::is_directory(paths.front()))
+    return utils::OpenInput(paths.front());
+
+  const auto files = ExpandPaths(paths);
+  if (files.empty())
+    throw std::runtime_error("No .dtb files found for --dtb.");
+
+  // The dedup compare holds two buffers, so size them for that.
+  const size_t chunk_size = memory::BufferSize(SCAN_CHUNK_SIZE, 2);
+  const auto blobs = ScanBlobs(files, chunk_size, "dtb");
+  const auto owners = FindOwners(blobs, chunk_size);
+
+  // Keep the first occurrence of every distinct blob, in input order.
+  std::vector<ConcatReader::Part> unique;
+  uint64_t total = 0;
+  for (size_t i = 0; i < blobs.size(); ++i) {
+    if (owners[i] != i)
+      continue;
+    unique.push_back({blobs[i].path, total, blobs[i].size});
+    total += blobs[i].size;
+  }
+
+  return utils::FileWrapper(std::make_unique<ConcatReader>(std::move(unique)),
+                            static_cast<size_t>(total));
+}
+
+utils::FileWrapper OpenOverlayTable(const std::vector<Overlay> &overlays,
+                                    uint32_t page_size) {
+  std::vector<std::filesystem::path> files;
+  files.reserve(overlays.size());
+  for (const auto &overlay : overlays)
+    files.push_back(overlay.path);
+  const size_t chunk_size = memory::BufferSize(SCAN_CHUNK_SIZE, 2);
+  const auto blobs = ScanBlobs(files, chunk_size, "overlay");
+  const auto owners = FindOwners(blobs, chunk_size);
+
+  // Blobs follow the entries back to back, each distinct one once; a
+  // duplicate takes the offset of the blob it repeats.
+  const uint64_t entries_size =
+      static_cast<uint64_t>(DT_TABLE_ENTRY_SIZE) * overlays.size();
+  uint64_t total = DT_TABLE_HEADER_SIZE + entries_size;
+  std::vector<uint64_t> offsets(blobs.size());
+  std::vector<ConcatReader::Part> parts;
+  for (size_t i = 0; i < blobs.size(); ++i) {
+    if (owners[i] != i) {
+      offsets[i] = offsets[owners[i]];
+      continue;
+    }
+    offsets[i] = total;
+    parts.push_back({blobs[i].path, total, blobs[i].size});
+    total += blobs[i].size;
+  }
+  if (total > UINT32_MAX)
+    throw std::runtime_error("The DTBO image is larger than 4 GiB.");
+
+  std::vector<uint8_t> table;
+  table.reserve(static_cast<size_t>(DT_TABLE_HEADER_SIZE + entries_size));
+  AppendBE32(table, DT_TABLE_MAGIC);
+  AppendBE32(table, static_cast<uint32_t>(total));
+  AppendBE32(table, DT_TABLE_HEADER_SIZE);
+  AppendBE32(table, DT_TABLE_ENTRY_SIZE);
+  AppendBE32(table, static_cast<uint32_t>(overlays.size()));
+  AppendBE32(table, DT_TABLE_HEADER_SIZE);
+  AppendBE32(table, page_size);
+  AppendBE32(table, 0); // version: uncompressed blobs
+  for (size_t i = 0; i < overlays.size(); ++i) {
+    AppendBE32(table, static_cast<uint32_t>(blobs[i].size));
+    AppendBE32(table, static_cast<uint32_t>(offsets[i]));
+    AppendBE32(table, overlays[i].id);
+    AppendBE32(table, overlays[i].rev);
+    for (int custom = 0; custom < 4; ++custom)
+      AppendBE32(table, 0);
+  }
+
+  return utils::FileWrapper(
+      std::make_unique<TableReader>(std::move(table), std::move(parts)),
+      static_cast<size_t>(total));
+}
+
+} // namespace dtb
@@ -0,0 +1,34 @@
+#pragma once
+
+#include "utils.hpp"
+
+namespace dtb {
+
+// Opens the dtb section built from `paths`. A single file is used verbatim,
+// as a pre-concatenated blob; it may be a stream (see utils::OpenInput).
+// Several files, or directories (whose *.dtb entries are taken in name
+// order), are validated as flattened device trees in parallel, byte-identical
+// blobs are dropped, and the result reads as the concatenation of the
+// remaining blobs. Returns nullopt when `paths` is empty or the single file
+// cannot be opened; throws on invalid blobs.
+std::optional<utils::FileWrapper>
+OpenSection(const std::vector<std::filesystem::path> &paths);
+
+// One overlay of a DTBO image and the table entry fields that select it.
+struct Overlay {
+  std::filesystem::path path;
+  uint32_t id = 0;
+  uint32_t rev = 0;
+};
+
+// Opens the DTBO image (Android dt_table, version 0) built from `overlays`:
+// the table header, one entry per overlay in order, then the blobs. The
+// overlays are validated as flattened device trees in parallel, and
+// byte-identical ones are stored once with their entries sharing the offset.
+// The table is built in memory from the scanned sizes and the blobs are read
+// from their files as the image is copied. `page_size` is recorded in the
+// header. Throws on invalid overlays or a table over 4 GiB.
+utils::FileWrapper OpenOverlayTable(const std::vector<Overlay> &overlays,
+                                    uint32_t page_size);
+
+} // namespace dtb
@@ -0,0 +1,180 @@
+#include "edit.h"
+#include "format.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+constexpr size_t MAX_HEADER_SIZE = format::VENDOR_BOOT_IMAGE_HEADER_V4_SIZE;
+
+class ImageFile {
+  int fd_ = -1;
+
+public:
+  explicit ImageFile(const std::filesystem::path &path)
+      : fd_(open(path.c_str(), O_RDWR | O_CLOEXEC)) {
+    if (fd_ < 0)
+      throw std::runtime_error("Could not open image: " + path.string());
+  }
+  ~ImageFile() {
+    if (fd_ >= 0)
+      close(fd_);
+  }
+  ImageFile(const ImageFile &) = delete;
+  ImageFile &operator=(const ImageFile &) = delete;
+
+  int fd() const { return fd_; }
+};
+
+// Header bytes read from the image plus the ranges that were modified.
+struct HeaderBuffer {
+  std::array<uint8_t, MAX_HEADER_SIZE> bytes{};
+  size_t size = 0;
+  std::vector<std::pair<size_t, size_t>> dirty;
+
+  template <size_t N>
+  void Set(size_t offset, const std::array<char, N> &field) {
+    std::copy(field.begin(), field.end(), bytes.begin() + offset);
+    dirty.emplace_back(offset, N);
+  }
+  void SetU32(size_t offset, uint32_t value) {
+    for (size_t i = 0; i < 4; ++i)
+      bytes[offset + i] = static_cast<uint8_t>(value >> (8 * i));
+    dirty.emplace_back(offset, 4);
+  }
+};
+
+uint32_t EditOsVersion(uint32_t packed, const HeaderEdits &edits) {
+  utils::OSVersion os_version;
+  os_version.version_str = edits.os_version.value_or("");
+  os_version.patch_level_str = edits.os_patch_level.value_or("");
+  utils::OSVersion::Parse(os_version);
+  const uint32_t version =
+      edits.os_version ? os_version.version : packed >> 11;
+  const uint32_t patch_level =
+      edits.os_patch_level ? os_version.patch_level : packed & 0x7FF;
+  return format::PackOsVersion(version, patch_level);
+}
+
+void EditBootHeader(HeaderBuffer &hdr_buf, uint64_t file_size,
+                    const HeaderEdits &edits) {
+  auto hdr = format::ParseBootHeader(hdr_buf.bytes.data(), hdr_buf.size);
+  if (!hdr)
+    throw std::runtime_error("Truncated boot image header.");
+  if (edits.vendor_cmdline)
+    throw std::runtime_error("--vendor_cmdline only applies to vendor_boot images.");
+
+  if (hdr->header_version >= 3) {
+    const uint32_t expected = hdr->header_version > 3
+                                  ? format::BOOT_IMAGE_HEADER_V4_SIZE
+                                  : format::BOOT_IMAGE_HEADER_V3_SIZE;
+    if (hdr->header_size != expected)
+      throw std::runtime_error("Boot image header_size does not match its version.");
+    if (file_size < format::BOOT_IMAGE_HEADER_V3_PAGESIZE)
+      throw std::runtime_error("Boot image is shorter than its header page.");
+    if (edits.board)
+      throw std::runtime_error("Boot image header v3+ has no board field.");
+
+    if (edits.cmdline) {
+      hdr_buf.Set(format::V3_CMDLINE_OFFSET,
+                  format::FixedField<format::BOOT_ARGS_SIZE +
+                                     format::BOOT_EXTRA_ARGS_SIZE>(
+                      *edits.cmdline));
+    }
+    if (edits.os_version || edits.os_patch_level) {
+      hdr_buf.SetU32(format::V3_OS_VERSION_OFFSET,
+                     EditOsVersion(hdr->os_version, edits));
+    }
+    return;
+  }
+
+  if (!format::IsValidPageSize(hdr->page_size) || file_size < hdr->page_size)
+    throw std::runtime_error("Boot image page_size is invalid.");
+  if ((hdr->header_version == 1 &&
+       hdr->header_size != format::BOOT_IMAGE_HEADER_V1_SIZE) ||
+      (hdr->header_version == 2 &&
+       hdr->header_size != format::BOOT_IMAGE_HEADER_V2_SIZE))
+    throw std::runtime_error("Boot image header_size does not match its version.");
+
+  if (edits.cmdline) {
+    hdr_buf.Set(format::LEGACY_CMDLINE_OFFSET,
+                format::LegacyCmdline(*edits.cmdline));
+    hdr_buf.Set(format::LEGACY_EXTRA_CMDLINE_OFFSET,
+                format::LegacyExtraCmdline(*edits.cmdline));
+  }
+  if (edits.board) {
+    hdr_buf.Set(format::LEGACY_NAME_OFFSET,
+                format::FixedField<format::BOOT_NAME_SIZE>(
+                    *edits.board, format::BOOT_NAME_SIZE - 1));
+  }
+  if (edits.os_version || edits.os_patch_level) {
+    hdr_buf.SetU32(format::LEGACY_OS_VERSION_OFFSET,
+                   EditOsVersion(hdr->os_version, edits));
+  }
+}
+
+void EditVendorBootHeader(HeaderBuffer &hdr_buf, uint64_t file_size,
+                          const HeaderEdits &edits) {
+  auto hdr = format::ParseVendorBootHeader(hdr_buf.bytes.data(), hdr_buf.size);
+  if (!hdr)
+    throw std::runtime_error("Truncated vendor_boot image header.");
+  if (edits.cmdline)
+    throw std::runtime_error("Use --vendor_cmdline for vendor_boot images.");
+  if (edits.os_version || edits.os_patch_level)
+    throw std::runtime_error("vendor_boot images have no os_version field.");
+
+  const uint32_t expected = hdr->header_version > 3
+                                ? format::VENDOR_BOOT_IMAGE_HEADER_V4_SIZE
+                                : format::VENDOR_BOOT_IMAGE_HEADER_V3_SIZE;
+  if (hdr->header_version < 3 || hdr->header_size != expected)
+    throw std::runtime_error("vendor_boot header_size does not match its version.");
+  if (!format::IsValidPageSize(hdr->page_size) ||
+      file_size < utils::GetNumberOfPages(hdr->header_size, hdr->page_size) *
+                      static_cast<uint64_t>(hdr->page_size))
+    throw std::runtime_error("vendor_boot page_size is invalid.");
+
+  if (edits.vendor_cmdline) {
+    hdr_buf.Set(format::VENDOR_CMDLINE_OFFSET,
+                format::FixedField<format::VENDOR_BOOT_ARGS_SIZE>(
+                    *edits.vendor_cmdline));
+  }
+  if (edits.board) {
+    hdr_buf.Set(format::VENDOR_NAME_OFFSET,
+                format::FixedField<format::VENDOR_BOOT_NAME_SIZE>(*edits.board));
+  }
+}
+
+} // namespace
+
+void EditImageHeader(const std::filesystem::path &image,
+                     const HeaderEdits &edits) {
+  ImageFile file(image);
+
+  struct stat st;
+  if (fstat(file.fd(), &st) != 0 || !S_ISREG(st.st_mode))
+    throw std::runtime_error("Not a regular file: " + image.string());
+
+  HeaderBuffer hdr_buf;
+  const ssize_t n = pread(file.fd(), hdr_buf.bytes.data(), hdr_buf.bytes.size(), 0);
+  if (n < static_cast<ssize_t>(format::BOOT_MAGIC_SIZE))
+    throw std::runtime_error("Image is too small to hold a header.");
+  hdr_buf.size = static_cast<size_t>(n);
+
+  std::string_view magic(reinterpret_cast<const char *>(hdr_buf.bytes.data()),
+                         format::BOOT_MAGIC_SIZE);
+  const uint64_t file_size = static_cast<uint64_t>(st.st_size);
+  if (magic == format::BOOT_MAGIC)
+    EditBootHeader(hdr_buf, file_size, edits);
+  else if (magic == format::VENDOR_BOOT_MAGIC)
+    EditVendorBootHeader(hdr_buf, file_size, edits);
+  else
+    throw std::runtime_error("Unknown image magic.");
+
+  for (const auto &[offset, length] : hdr_buf.dirty) {
+    if (pwrite(file.fd(), hdr_buf.bytes.data() + offset, length,
+               static_cast<off_t>(offset)) != static_cast<ssize_t>(length))
+      throw errors::FileWriteError("header");
+  }
+}
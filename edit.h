@@ -0,0 +1,21 @@
+#pragma once
+
+#include <filesystem>
+#include <optional>
+#include <string>
+
+// Header fields that can be changed without touching section data. Unset
+// fields keep their current value.
+struct HeaderEdits {
+  std::optional<std::string> cmdline;
+  std::optional<std::string> vendor_cmdline;
+  std::optional<std::string> board;
+  std::optional<std::string> os_version;
+  std::optional<std::string> os_patch_level;
+};
+
+// Rewrites the requested fields of an existing boot or vendor_boot image in
+// place. The header is validated first and only the affected header bytes are
+// written. The legacy id only covers section data, so it is kept as is.
+void EditImageHeader(const std::filesystem::path &image,
+                     const HeaderEdits &edits);
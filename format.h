@@ -0,0 +1,212 @@
+#pragma once
+
+#include "utils.hpp"
+#include <string_view>
+
+// On-disk layout of boot and vendor_boot image headers. Offsets are in bytes
+// from the start of the image; all fields are little endian.
+namespace format {
+
+constexpr uint32_t BOOT_MAGIC_SIZE = 8;
+constexpr std::string_view BOOT_MAGIC = "ANDROID!";
+constexpr uint32_t BOOT_IMAGE_HEADER_V0_SIZE = 1632;
+constexpr uint32_t BOOT_IMAGE_HEADER_V1_SIZE = 1648;
+constexpr uint32_t BOOT_IMAGE_HEADER_V2_SIZE = 1660;
+constexpr uint32_t BOOT_IMAGE_HEADER_V3_SIZE = 1580;
+constexpr uint32_t BOOT_IMAGE_HEADER_V4_SIZE = 1584;
+constexpr uint32_t BOOT_NAME_SIZE = 16;
+constexpr uint32_t BOOT_ARGS_SIZE = 512;
+constexpr uint32_t BOOT_EXTRA_ARGS_SIZE = 1024;
+constexpr uint32_t BOOT_ID_SIZE = 32;
+constexpr uint32_t BOOT_IMAGE_HEADER_V3_PAGESIZE = 4096;
+
+// boot_img_hdr_v0..v2
+constexpr size_t LEGACY_KERNEL_SIZE_OFFSET = 8;
+constexpr size_t LEGACY_RAMDISK_SIZE_OFFSET = 16;
+constexpr size_t LEGACY_SECOND_SIZE_OFFSET = 24;
+constexpr size_t LEGACY_PAGE_SIZE_OFFSET = 36;
+constexpr size_t LEGACY_OS_VERSION_OFFSET = 44;
+constexpr size_t LEGACY_NAME_OFFSET = 48;
+constexpr size_t LEGACY_CMDLINE_OFFSET = 64;
+constexpr size_t LEGACY_ID_OFFSET = 576;
+constexpr size_t LEGACY_EXTRA_CMDLINE_OFFSET = 608;
+constexpr size_t LEGACY_RECOVERY_DTBO_SIZE_OFFSET = 1632;
+constexpr size_t LEGACY_RECOVERY_DTBO_OFFSET_OFFSET = 1636;
+constexpr size_t LEGACY_HEADER_SIZE_OFFSET = 1644;
+constexpr size_t LEGACY_DTB_SIZE_OFFSET = 1648;
+
+// boot_img_hdr_v3/v4
+constexpr size_t V3_KERNEL_SIZE_OFFSET = 8;
+constexpr size_t V3_RAMDISK_SIZE_OFFSET = 12;
+constexpr size_t V3_OS_VERSION_OFFSET = 16;
+constexpr size_t V3_HEADER_SIZE_OFFSET = 20;
+constexpr size_t V3_CMDLINE_OFFSET = 44;
+
+// Shared by every boot header version.
+constexpr size_t HEADER_VERSION_OFFSET = 40;
+
+constexpr std::string_view VENDOR_BOOT_MAGIC = "VNDRBOOT";
+constexpr uint32_t VENDOR_BOOT_MAGIC_SIZE = 8;
+constexpr uint32_t VENDOR_RAMDISK_NAME_SIZE = 32;
+constexpr uint32_t VENDOR_RAMDISK_TABLE_ENTRY_V4_SIZE = 108;
+constexpr uint32_t VENDOR_BOOT_IMAGE_HEADER_V3_SIZE = 2112;
+constexpr uint32_t VENDOR_BOOT_IMAGE_HEADER_V4_SIZE = 2128;
+constexpr uint32_t VENDOR_BOOT_ARGS_SIZE = 2048;
+constexpr uint32_t VENDOR_BOOT_NAME_SIZE = 16;
+
+// vendor_boot_img_hdr_v3/v4
+constexpr size_t VENDOR_HEADER_VERSION_OFFSET = 8;
+constexpr size_t VENDOR_PAGE_SIZE_OFFSET = 12;
+constexpr size_t VENDOR_RAMDISK_SIZE_OFFSET = 24;
+constexpr size_t VENDOR_CMDLINE_OFFSET = 28;
+constexpr size_t VENDOR_NAME_OFFSET = 2080;
+constexpr size_t VENDOR_HEADER_SIZE_OFFSET = 2096;
+constexpr size_t VENDOR_DTB_SIZE_OFFSET = 2100;
+constexpr size_t VENDOR_TABLE_SIZE_OFFSET = 2112;
+constexpr size_t VENDOR_TABLE_ENTRY_NUM_OFFSET = 2116;
+constexpr size_t VENDOR_TABLE_ENTRY_SIZE_OFFSET = 2120;
+constexpr size_t VENDOR_BOOTCONFIG_SIZE_OFFSET = 2124;
+
+// Fixed-width, zero-filled string field holding at most `max_len` bytes of
+// `value`.
+template <size_t N>
+inline std::array<char, N> FixedField(std::string_view value,
+                                      size_t max_len = N) {
+  std::array<char, N> field{};
+  std::copy_n(value.begin(), std::min({value.size(), max_len, N}),
+              field.begin());
+  return field;
+}
+
+// The legacy header splits the kernel command line: the first 511 bytes go
+// into cmdline (keeping a terminator) and the rest into extra_cmdline.
+inline std::array<char, BOOT_ARGS_SIZE> LegacyCmdline(std::string_view cmdline) {
+  return FixedField<BOOT_ARGS_SIZE>(cmdline, BOOT_ARGS_SIZE - 1);
+}
+
+inline std::array<char, BOOT_EXTRA_ARGS_SIZE>
+LegacyExtraCmdline(std::string_view cmdline) {
+  if (cmdline.size() <= BOOT_ARGS_SIZE - 1)
+    return {};
+  return FixedField<BOOT_EXTRA_ARGS_SIZE>(cmdline.substr(BOOT_ARGS_SIZE - 1));
+}
+
+inline uint32_t PackOsVersion(uint32_t version, uint32_t patch_level) {
+  return (version << 11) | patch_level;
+}
+
+// Size of the boot header struct itself, before page padding.
+inline uint32_t BootHeaderSize(uint32_t header_version) {
+  switch (header_version) {
+  case 0:
+    return BOOT_IMAGE_HEADER_V0_SIZE;
+  case 1:
+    return BOOT_IMAGE_HEADER_V1_SIZE;
+  case 2:
+    return BOOT_IMAGE_HEADER_V2_SIZE;
+  case 3:
+    return BOOT_IMAGE_HEADER_V3_SIZE;
+  default:
+    return BOOT_IMAGE_HEADER_V4_SIZE;
+  }
+}
+
+inline bool IsValidPageSize(uint32_t page_size) {
+  return page_size == 2048 || page_size == 4096 || page_size == 8192 ||
+         page_size == 16384;
+}
+
+// Header fields needed to locate every section of a boot image.
+struct BootHeader {
+  uint32_t header_version = 0;
+  uint32_t page_size = 0;
+  uint32_t header_size = 0;
+  uint32_t os_version = 0;
+  uint32_t kernel_size = 0;
+  uint32_t ramdisk_size = 0;
+  uint32_t second_size = 0;
+  uint32_t recovery_dtbo_size = 0;
+  uint64_t recovery_dtbo_offset = 0;
+  uint32_t dtb_size = 0;
+};
+
+struct VendorBootHeader {
+  uint32_t header_version = 0;
+  uint32_t page_size = 0;
+  uint32_t header_size = 0;
+  uint32_t vendor_ramdisk_size = 0;
+  uint32_t dtb_size = 0;
+  uint32_t table_size = 0;
+  uint32_t table_entry_num = 0;
+  uint32_t table_entry_size = 0;
+  uint32_t bootconfig_size = 0;
+};
+
+// Parses a boot image header from the start of an image. Returns nullopt when
+// the magic does not match or the buffer is too short for the header version.
+inline std::optional<BootHeader> ParseBootHeader(const uint8_t *data,
+                                                 size_t size) {
+  if (size < BOOT_IMAGE_HEADER_V3_SIZE ||
+      std::string_view(reinterpret_cast<const char *>(data),
+                       BOOT_MAGIC_SIZE) != BOOT_MAGIC)
+    return std::nullopt;
+
+  BootHeader hdr;
+  hdr.header_version = utils::ReadU32(data + HEADER_VERSION_OFFSET);
+  if (hdr.header_version >= 3) {
+    hdr.page_size = BOOT_IMAGE_HEADER_V3_PAGESIZE;
+    hdr.kernel_size = utils::ReadU32(data + V3_KERNEL_SIZE_OFFSET);
+    hdr.ramdisk_size = utils::ReadU32(data + V3_RAMDISK_SIZE_OFFSET);
+    hdr.os_version = utils::ReadU32(data + V3_OS_VERSION_OFFSET);
+    hdr.header_size = utils::ReadU32(data + V3_HEADER_SIZE_OFFSET);
+    return hdr;
+  }
+
+  hdr.kernel_size = utils::ReadU32(data + LEGACY_KERNEL_SIZE_OFFSET);
+  hdr.ramdisk_size = utils::ReadU32(data + LEGACY_RAMDISK_SIZE_OFFSET);
+  hdr.second_size = utils::ReadU32(data + LEGACY_SECOND_SIZE_OFFSET);
+  hdr.page_size = utils::ReadU32(data + LEGACY_PAGE_SIZE_OFFSET);
+  hdr.os_version = utils::ReadU32(data + LEGACY_OS_VERSION_OFFSET);
+  if (hdr.header_version > 0) {
+    if (size < BOOT_IMAGE_HEADER_V1_SIZE)
+      return std::nullopt;
+    hdr.recovery_dtbo_size =
+        utils::ReadU32(data + LEGACY_RECOVERY_DTBO_SIZE_OFFSET);
+    hdr.recovery_dtbo_offset =
+        utils::ReadU64(data + LEGACY_RECOVERY_DTBO_OFFSET_OFFSET);
+    hdr.header_size = utils::ReadU32(data + LEGACY_HEADER_SIZE_OFFSET);
+  }
+  if (hdr.header_version > 1) {
+    if (size < LEGACY_DTB_SIZE_OFFSET + 4)
+      return std::nullopt;
+    hdr.dtb_size = utils::ReadU32(data + LEGACY_DTB_SIZE_OFFSET);
+  }
+  return hdr;
+}
+
+inline std::optional<VendorBootHeader> ParseVendorBootHeader(const uint8_t *data,
+                                                             size_t size) {
+  if (size < VENDOR_BOOT_IMAGE_HEADER_V3_SIZE ||
+      std::string_view(reinterpret_cast<const char *>(data),
+                       VENDOR_BOOT_MAGIC_SIZE) != VENDOR_BOOT_MAGIC)
+    return std::nullopt;
+
+  VendorBootHeader hdr;
+  hdr.header_version = utils::ReadU32(data + VENDOR_HEADER_VERSION_OFFSET);
+  hdr.page_size = utils::ReadU32(data + VENDOR_PAGE_SIZE_OFFSET);
+  hdr.vendor_ramdisk_size = utils::ReadU32(data + VENDOR_RAMDISK_SIZE_OFFSET);
+  hdr.header_size = utils::ReadU32(data + VENDOR_HEADER_SIZE_OFFSET);
+  hdr.dtb_size = utils::ReadU32(data + VENDOR_DTB_SIZE_OFFSET);
+  if (hdr.header_version > 3) {
+    if (size < VENDOR_BOOT_IMAGE_HEADER_V4_SIZE)
+      return std::nullopt;
+    hdr.table_size = utils::ReadU32(data + VENDOR_TABLE_SIZE_OFFSET);
+    hdr.table_entry_num = utils::ReadU32(data + VENDOR_TABLE_ENTRY_NUM_OFFSET);
+    hdr.table_entry_size =
+        utils::ReadU32(data + VENDOR_TABLE_ENTRY_SIZE_OFFSET);
+    hdr.bootconfig_size = utils::ReadU32(data + VENDOR_BOOTCONFIG_SIZE_OFFSET);
+  }
+  return hdr;
+}
+
+} // namespace format
@@ -0,0 +1,455 @@
+#include "hash.h"
+
+#include <algorithm>
+#include <cstring>
+#include <utility>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define HASH_HAVE_X86_SHA 1
+#endif
+
+#if defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
+namespace {
+
+using BlockFn = void (*)(uint32_t *state, const uint8_t *data, size_t blocks);
+
+inline uint32_t Rotl(uint32_t value, int count) {
+  return (value << count) | (value >> (32 - count));
+}
+
+inline uint32_t Rotr(uint32_t value, int count) {
+  return (value >> count) | (value << (32 - count));
+}
+
+inline uint32_t LoadBE32(const uint8_t *p) {
+  return (static_cast<uint32_t>(p[0]) << 24) |
+         (static_cast<uint32_t>(p[1]) << 16) |
+         (static_cast<uint32_t>(p[2]) << 8) | static_cast<uint32_t>(p[3]);
+}
+
+// Buffers partial blocks and hands whole 64-byte blocks to `blocks_fn`.
+template <size_t N>
+void UpdateBlocks(std::array<uint32_t, N> &state, std::array<uint8_t, 64> &block,
+                  size_t &block_len, uint64_t &total, const void *data,
+                  size_t len, BlockFn blocks_fn) {
+  const auto *bytes = static_cast<const uint8_t *>(data);
+  total += len;
+
+  if (block_len > 0) {
+    const size_t take = std::min(len, block.size() - block_len);
+    std::memcpy(block.data() + block_len, bytes, take);
+    block_len += take;
+    bytes += take;
+    len -= take;
+    if (block_len < block.size())
+      return;
+    blocks_fn(state.data(), block.data(), 1);
+    block_len = 0;
+  }
+
+  const size_t blocks = len / 64;
+  if (blocks > 0) {
+    blocks_fn(state.data(), bytes, blocks);
+    bytes += blocks * 64;
+    len -= blocks * 64;
+  }
+
+  if (len > 0) {
+    std::memcpy(block.data(), bytes, len);
+    block_len = len;
+  }
+}
+
+// Applies the Merkle-Damgard padding to a copy of the state and returns the
+// big-endian digest.
+template <size_t N>
+std::array<uint8_t, N * 4> FinalBlocks(std::array<uint32_t, N> state,
+                                       const std::array<uint8_t, 64> &block,
+                                       size_t block_len, uint64_t total,
+                                       BlockFn blocks_fn) {
+  std::array<uint8_t, 128> tail{};
+  std::memcpy(tail.data(), block.data(), block_len);
+  tail[block_len] = 0x80;
+  const size_t tail_len = block_len < 56 ? 64 : 128;
+  const uint64_t bits = total * 8;
+  for (int i = 0; i < 8; ++i)
+    tail[tail_len - 1 - i] = static_cast<uint8_t>(bits >> (8 * i));
+  blocks_fn(state.data(), tail.data(), tail_len / 64);
+
+  std::array<uint8_t, N * 4> digest;
+  for (size_t i = 0; i < N; ++i) {
+    digest[i * 4] = static_cast<uint8_t>(state[i] >> 24);
+    digest[i * 4 + 1] = static_cast<uint8_t>(state[i] >> 16);
+    digest[i * 4 + 2] = static_cast<uint8_t>(state[i] >> 8);
+    digest[i * 4 + 3] = static_cast<uint8_t>(state[i]);
+  }
+  return digest;
+}
+
+template <size_t N> std::string ToHex(const std::array<uint8_t, N> &bytes) {
+  constexpr char digits[] = "0123456789abcdef";
+  std::string hex;
+  hex.reserve(N * 2);
+  for (uint8_t b : bytes) {
+    hex.push_back(digits[b >> 4]);
+    hex.push_back(digits[b & 0xF]);
+  }
+  return hex;
+}
+
+void Sha1BlocksPortable(uint32_t *state, const uint8_t *data, size_t blocks) {
+  for (; blocks > 0; --blocks, data += 64) {
+    uint32_t w[80];
+    for (int i = 0; i < 16; ++i)
+      w[i] = LoadBE32(data + i * 4);
+    for (int i = 16; i < 80; ++i)
+      w[i] = Rotl(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3],
+             e = state[4];
+    for (int i = 0; i < 80; ++i) {
+      uint32_t f, k;
+      if (i < 20) {
+        f = (b & c) | (~b & d);
+        k = 0x5A827999;
+      } else if (i < 40) {
+        f = b ^ c ^ d;
+        k = 0x6ED9EBA1;
+      } else if (i < 60) {
+        f = (b & c) | (b & d) | (c & d);
+        k = 0x8F1BBCDC;
+      } else {
+        f = b ^ c ^ d;
+        k = 0xCA62C1D6;
+      }
+      const uint32_t temp = Rotl(a, 5) + f + e + k + w[i];
+      e = d;
+      d = c;
+      c = Rotl(b, 30);
+      b = a;
+      a = temp;
+    }
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+  }
+}
+
+constexpr std::array<uint32_t, 64> SHA256_K = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+    0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+    0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+    0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+    0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+void Sha256BlocksPortable(uint32_t *state, const uint8_t *data, size_t blocks) {
+  for (; blocks > 0; --blocks, data += 64) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; ++i)
+      w[i] = LoadBE32(data + i * 4);
+    for (int i = 16; i < 64; ++i) {
+      const uint32_t s0 = Rotr(w[i - 15], 7) ^ Rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+      const uint32_t s1 = Rotr(w[i - 2], 17) ^ Rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+      w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3],
+             e = state[4], f = state[5], g = state[6], h = state[7];
+    for (int i = 0; i < 64; ++i) {
+      const uint32_t s1 = Rotr(e, 6) ^ Rotr(e, 11) ^ Rotr(e, 25);
+      const uint32_t ch = (e & f) ^ (~e & g);
+      const uint32_t t1 = h + s1 + ch + SHA256_K[i] + w[i];
+      const uint32_t s0 = Rotr(a, 2) ^ Rotr(a, 13) ^ Rotr(a, 22);
+      const uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+      const uint32_t t2 = s0 + maj;
+      h = g;
+      g = f;
+      f = e;
+      e = d + t1;
+      d = c;
+      c = b;
+      b = a;
+      a = t1 + t2;
+    }
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+    state[5] += f;
+    state[6] += g;
+    state[7] += h;
+  }
+}
+
+constexpr std::array<uint32_t, 256> MakeCrc32cTable() {
+  std::array<uint32_t, 256> table{};
+  for (uint32_t i = 0; i < 256; ++i) {
+    uint32_t crc = i;
+    for (int k = 0; k < 8; ++k)
+      crc = (crc >> 1) ^ ((crc & 1) ? 0x82F63B78 : 0);
+    table[i] = crc;
+  }
+  return table;
+}
+
+[[maybe_unused]] uint32_t Crc32cPortable(uint32_t crc, const uint8_t *data, size_t len) {
+  static constexpr auto table = MakeCrc32cTable();
+  for (size_t i = 0; i < len; ++i)
+    crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+  return crc;
+}
+
+#if defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+uint32_t Crc32cArm(uint32_t crc, const uint8_t *data, size_t len) {
+  for (; len >= 8; len -= 8, data += 8) {
+    uint64_t word;
+    std::memcpy(&word, data, sizeof(word));
+    crc = __crc32cd(crc, word);
+  }
+  for (; len > 0; --len, ++data)
+    crc = __crc32cb(crc, *data);
+  return crc;
+}
+#endif
+
+#ifdef HASH_HAVE_X86_SHA
+bool CpuHasSse42() {
+  unsigned int eax, ebx, ecx, edx;
+  return __get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_SSE4_2);
+}
+
+__attribute__((target("sse4.2"))) uint32_t
+Crc32cSse42(uint32_t crc, const uint8_t *data, size_t len) {
+#ifdef __x86_64__
+  uint64_t crc64 = crc;
+  for (; len >= 8; len -= 8, data += 8) {
+    uint64_t word;
+    std::memcpy(&word, data, sizeof(word));
+    crc64 = _mm_crc32_u64(crc64, word);
+  }
+  crc = static_cast<uint32_t>(crc64);
+#endif
+  for (; len > 0; --len, ++data)
+    crc = _mm_crc32_u8(crc, *data);
+  return crc;
+}
+
+bool CpuHasShaExtensions() {
+  unsigned int eax, ebx, ecx, edx;
+  if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & bit_SSE4_1))
+    return false;
+  if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+    return false;
+  return (ebx & bit_SHA) != 0;
+}
+
+// One group of four rounds. Groups alternate between the two E registers and
+// rotate through the four message registers, expanding the schedule ahead of
+// its use exactly like the unrolled reference sequence.
+template <int I>
+__attribute__((target("sha,sse4.1"))) inline void
+Sha1NiGroup(__m128i &abcd, __m128i (&e)[2], __m128i (&msg)[4]) {
+  if constexpr (I == 0) {
+    e[0] = _mm_add_epi32(e[0], msg[0]);
+  } else {
+    e[I % 2] = _mm_sha1nexte_epu32(e[I % 2], msg[I % 4]);
+  }
+  e[(I + 1) % 2] = abcd;
+  if constexpr (I >= 3 && I <= 18)
+    msg[(I + 1) % 4] = _mm_sha1msg2_epu32(msg[(I + 1) % 4], msg[I % 4]);
+  abcd = _mm_sha1rnds4_epu32(abcd, e[I % 2], I / 5);
+  if constexpr (I >= 1 && I <= 16)
+    msg[(I + 3) % 4] = _mm_sha1msg1_epu32(msg[(I + 3) % 4], msg[I % 4]);
+  if constexpr (I >= 2 && I <= 17)
+    msg[(I + 2) % 4] = _mm_xor_si128(msg[(I + 2) % 4], msg[I % 4]);
+}
+
+template <int... I>
+__attribute__((target("sha,sse4.1"))) inline void
+Sha1NiRounds(__m128i &abcd, __m128i (&e)[2], __m128i (&msg)[4],
+             std::integer_sequence<int, I...>) {
+  (Sha1NiGroup<I>(abcd, e, msg), ...);
+}
+
+__attribute__((target("sha,sse4.1"))) void
+Sha1BlocksShaNi(uint32_t *state, const uint8_t *data, size_t blocks) {
+  const __m128i mask =
+      _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+  __m128i abcd = _mm_loadu_si128(reinterpret_cast<const __m128i *>(state));
+  abcd = _mm_shuffle_epi32(abcd, 0x1B);
+  __m128i e0 = _mm_set_epi32(static_cast<int>(state[4]), 0, 0, 0);
+
+  for (; blocks > 0; --blocks, data += 64) {
+    const __m128i abcd_save = abcd;
+    const __m128i e0_save = e0;
+    __m128i msg[4];
+    for (int i = 0; i < 4; ++i) {
+      msg[i] = _mm_shuffle_epi8(
+          _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i * 16)),
+          mask);
+    }
+    __m128i e[2] = {e0, e0};
+    Sha1NiRounds(abcd, e, msg, std::make_integer_sequence<int, 20>{});
+    // Group 19 leaves the last ABCD in e[0]; fold it back into E.
+    e0 = _mm_sha1nexte_epu32(e[0], e0_save);
+    abcd = _mm_add_epi32(abcd, abcd_save);
+  }
+
+  abcd = _mm_shuffle_epi32(abcd, 0x1B);
+  _mm_storeu_si128(reinterpret_cast<__m128i *>(state), abcd);
+  state[4] = static_cast<uint32_t>(_mm_extract_epi32(e0, 3));
+}
+
+// Four SHA-256 rounds. The message registers rotate the same way as in the
+// SHA-1 kernel; msg1/msg2 extend the schedule while it is still needed.
+template <int I>
+__attribute__((target("sha,sse4.1"))) inline void
+Sha256NiGroup(__m128i &state0, __m128i &state1, __m128i (&msg)[4]) {
+  __m128i wk = _mm_add_epi32(
+      msg[I % 4],
+      _mm_loadu_si128(reinterpret_cast<const __m128i *>(&SHA256_K[I * 4])));
+  state1 = _mm_sha256rnds2_epu32(state1, state0, wk);
+  if constexpr (I >= 3 && I <= 14) {
+    const __m128i tmp = _mm_alignr_epi8(msg[I % 4], msg[(I + 3) % 4], 4);
+    msg[(I + 1) % 4] = _mm_add_epi32(msg[(I + 1) % 4], tmp);
+    msg[(I + 1) % 4] = _mm_sha256msg2_epu32(msg[(I + 1) % 4], msg[I % 4]);
+  }
+  wk = _mm_shuffle_epi32(wk, 0x0E);
+  state0 = _mm_sha256rnds2_epu32(state0, state1, wk);
+  if constexpr (I >= 1 && I <= 12)
+    msg[(I + 3) % 4] = _mm_sha256msg1_epu32(msg[(I + 3) % 4], msg[I % 4]);
+}
+
+template <int... I>
+__attribute__((target("sha,sse4.1"))) inline void
+Sha256NiRounds(__m128i &state0, __m128i &state1, __m128i (&msg)[4],
+               std::integer_sequence<int, I...>) {
+  (Sha256NiGroup<I>(state0, state1, msg), ...);
+}
+
+__attribute__((target("sha,sse4.1"))) void
+Sha256BlocksShaNi(uint32_t *state, const uint8_t *data, size_t blocks) {
+  const __m128i mask =
+      _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+  __m128i tmp = _mm_loadu_si128(reinterpret_cast<const __m128i *>(state));
+  __m128i state1 =
+      _mm_loadu_si128(reinterpret_cast<const __m128i *>(state + 4));
+  tmp = _mm_shuffle_epi32(tmp, 0xB1);       // CDAB
+  state1 = _mm_shuffle_epi32(state1, 0x1B); // EFGH
+  __m128i state0 = _mm_alignr_epi8(tmp, state1, 8); // ABEF
+  state1 = _mm_blend_epi16(state1, tmp, 0xF0);      // CDGH
+
+  for (; blocks > 0; --blocks, data += 64) {
+    const __m128i abef_save = state0;
+    const __m128i cdgh_save = state1;
+    __m128i msg[4];
+    for (int i = 0; i < 4; ++i) {
+      msg[i] = _mm_shuffle_epi8(
+          _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i * 16)),
+          mask);
+    }
+    Sha256NiRounds(state0, state1, msg, std::make_integer_sequence<int, 16>{});
+    state0 = _mm_add_epi32(state0, abef_save);
+    state1 = _mm_add_epi32(state1, cdgh_save);
+  }
+
+  tmp = _mm_shuffle_epi32(state0, 0x1B);    // FEBA
+  state1 = _mm_shuffle_epi32(state1, 0xB1); // DCHG
+  state0 = _mm_blend_epi16(tmp, state1, 0xF0); // DCBA
+  state1 = _mm_alignr_epi8(state1, tmp, 8);    // ABEF
+  _mm_storeu_si128(reinterpret_cast<__m128i *>(state), state0);
+  _mm_storeu_si128(reinterpret_cast<__m128i *>(state + 4), state1);
+}
+#endif
+
+BlockFn SelectSha1Blocks() {
+#ifdef HASH_HAVE_X86_SHA
+  if (CpuHasShaExtensions())
+    return Sha1BlocksShaNi;
+#endif
+  return Sha1BlocksPortable;
+}
+
+BlockFn SelectSha256Blocks() {
+#ifdef HASH_HAVE_X86_SHA
+  if (CpuHasShaExtensions())
+    return Sha256BlocksShaNi;
+#endif
+  return Sha256BlocksPortable;
+}
+
+using Crc32cFn = uint32_t (*)(uint32_t crc, const uint8_t *data, size_t len);
+
+Crc32cFn SelectCrc32c() {
+#if defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+  return Crc32cArm;
+#else
+#ifdef HASH_HAVE_X86_SHA
+  if (CpuHasSse42())
+    return Crc32cSse42;
+#endif
+  return Crc32cPortable;
+#endif
+}
+
+void Sha1Blocks(uint32_t *state, const uint8_t *data, size_t blocks) {
+  static const BlockFn fn = SelectSha1Blocks();
+  fn(state, data, blocks);
+}
+
+void Sha256Blocks(uint32_t *state, const uint8_t *data, size_t blocks) {
+  static const BlockFn fn = SelectSha256Blocks();
+  fn(state, data, blocks);
+}
+
+} // namespace
+
+namespace hashing {
+
+void Sha1::Update(const void *data, size_t len) {
+  UpdateBlocks(state_, block_, block_len_, total_, data, len, Sha1Blocks);
+}
+
+Sha1::Digest Sha1::Final() const {
+  return FinalBlocks(state_, block_, block_len_, total_, Sha1Blocks);
+}
+
+void Sha256::Update(const void *data, size_t len) {
+  UpdateBlocks(state_, block_, block_len_, total_, data, len, Sha256Blocks);
+}
+
+Sha256::Digest Sha256::Final() const {
+  return FinalBlocks(state_, block_, block_len_, total_, Sha256Blocks);
+}
+
+void Crc32c::Update(const void *data, size_t len) {
+  static const Crc32cFn fn = SelectCrc32c();
+  crc_ = fn(crc_, static_cast<const uint8_t *>(data), len);
+}
+
+Digests MultiDigest::Final() const {
+  const uint32_t crc = crc32c_.Final();
+  const std::array<uint8_t, 4> crc_bytes{
+      static_cast<uint8_t>(crc >> 24), static_cast<uint8_t>(crc >> 16),
+      static_cast<uint8_t>(crc >> 8), static_cast<uint8_t>(crc)};
+  return {::ToHex(sha256_.Final()), ::ToHex(sha1_.Final()),
+          ::ToHex(crc_bytes)};
+}
+
+std::string ToHex(const Sha256::Digest &digest) { return ::ToHex(digest); }
+
+} // namespace hashing
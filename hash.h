@@ -0,0 +1,87 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace hashing {
+
+// Block-oriented SHA-1. Uses the SHA extensions when the CPU has them and a
+// portable implementation otherwise. Copyable, so a partially hashed prefix
+// can be forked.
+class Sha1 {
+public:
+  static constexpr size_t DIGEST_SIZE = 20;
+  using Digest = std::array<uint8_t, DIGEST_SIZE>;
+
+  Sha1() = default;
+  void Update(const void *data, size_t len);
+  // Returns the digest of everything hashed so far without consuming the state.
+  Digest Final() const;
+
+private:
+  std::array<uint32_t, 5> state_{0x67452301, 0xEFCDAB89, 0x98BADCFE,
+                                 0x10325476, 0xC3D2E1F0};
+  std::array<uint8_t, 64> block_{};
+  size_t block_len_ = 0;
+  uint64_t total_ = 0;
+};
+
+// SHA-256 with the same dispatch and copy semantics as Sha1.
+class Sha256 {
+public:
+  static constexpr size_t DIGEST_SIZE = 32;
+  using Digest = std::array<uint8_t, DIGEST_SIZE>;
+
+  Sha256() = default;
+  void Update(const void *data, size_t len);
+  Digest Final() const;
+
+private:
+  std::array<uint32_t, 8> state_{0x6a09e667, 0xbb67ae85, 0x3c6ef372,
+                                 0xa54ff53a, 0x510e527f, 0x9b05688c,
+                                 0x1f83d9ab, 0x5be0cd19};
+  std::array<uint8_t, 64> block_{};
+  size_t block_len_ = 0;
+  uint64_t total_ = 0;
+};
+
+// CRC-32C (Castagnoli). Uses the SSE4.2 or ARMv8 CRC instructions when
+// available.
+class Crc32c {
+public:
+  void Update(const void *data, size_t len);
+  uint32_t Final() const { return ~crc_; }
+
+private:
+  uint32_t crc_ = 0xFFFFFFFF;
+};
+
+struct Digests {
+  std::string sha256;
+  std::string sha1;
+  std::string crc32c;
+};
+
+// Feeds the same bytes to SHA-256, SHA-1 and CRC-32C.
+class MultiDigest {
+public:
+  void Update(const void *data, size_t len) {
+    sha256_.Update(data, len);
+    sha1_.Update(data, len);
+    crc32c_.Update(data, len);
+  }
+  // Lower-case hex digests of everything hashed so far.
+  Digests Final() const;
+
+private:
+  Sha256 sha256_;
+  Sha1 sha1_;
+  Crc32c crc32c_;
+};
+
+// Lower-case hex of a SHA-256 digest.
+std::string ToHex(const Sha256::Digest &digest);
+
+} // namespace hashing
@@ -0,0 +1,157 @@
+#include "layout.h"
+#include "manifest.h"
+#include "memory.h"
+#include "pipeline.h"
+#include "publish.h"
+
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <ostream>
+#include <unistd.h>
+
+namespace layout {
+
+const Section *Image::Find(std::string_view name) const {
+  for (const auto &section : sections) {
+    if (section.name == name)
+      return &section;
+  }
+  return nullptr;
+}
+
+void WritePlan(std::ostream &out, const std::vector<Image> &images) {
+  out << "{\n  \"images\": [";
+  for (size_t i = 0; i < images.size(); ++i) {
+    const auto &image = images[i];
+    out << (i ? "," : "") << "\n    {\n      \"path\": "
+        << manifest::JsonString(image.path.string())
+        << ",\n      \"kind\": " << manifest::JsonString(image.kind)
+        << ",\n      \"header_version\": " << image.header_version
+        << ",\n      \"alignment\": " << image.alignment
+        << ",\n      \"size\": " << image.size << ",\n      \"sections\": [";
+    for (size_t j = 0; j < image.sections.size(); ++j) {
+      const auto &section = image.sections[j];
+      out << (j ? "," : "") << "\n        {\"name\": "
+          << manifest::JsonString(section.name)
+          << ", \"offset\": " << section.offset
+          << ", \"size\": " << section.size << "}";
+    }
+    out << "\n      ]\n    }";
+  }
+  out << "\n  ]\n}\n";
+}
+
+uint64_t Image::FirstChangedOffset(
+    const std::vector<std::string> &changed) const {
+  // Shared sections are listed after the ones they point into, so the list
+  // is not in offset order.
+  uint64_t first = size;
+  for (const auto &section : sections) {
+    if (std::find(changed.begin(), changed.end(), section.name) !=
+        changed.end())
+      first = std::min(first, section.offset);
+  }
+  return first;
+}
+
+OutputFile::OutputFile(const std::filesystem::path &path, uint64_t size,
+                       uint64_t keep) {
+  if (keep == 0) {
+    staged_ = std::make_unique<publish::StagedFile>(path);
+    fd_ = staged_->fd();
+  } else {
+    fd_ = open(path.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+    if (fd_ < 0)
+      throw std::runtime_error("Could not open output file: " + path.string());
+    struct stat st;
+    kept_ = fstat(fd_, &st) == 0 && static_cast<uint64_t>(st.st_size) >= keep
+                ? std::min(keep, size)
+                : 0;
+    // Drop everything past the kept prefix so padding reads back as zeros.
+    if (ftruncate(fd_, static_cast<off_t>(kept_)) != 0)
+      throw std::runtime_error("Could not resize " + path.string());
+  }
+  if (size <= kept_)
+    return;
+  int err = posix_fallocate(fd_, static_cast<off_t>(kept_),
+                            static_cast<off_t>(size - kept_));
+  if (err == EOPNOTSUPP || err == EINVAL)
+    err = ftruncate(fd_, static_cast<off_t>(size)) == 0 ? 0 : errno;
+  if (err != 0)
+    throw std::runtime_error("Could not allocate " + std::to_string(size) +
+                             " bytes for " + path.string());
+}
+
+OutputFile::~OutputFile() {
+  // A staged file that was never closed is dropped by its own destructor.
+  if (!staged_ && fd_ >= 0)
+    close(fd_);
+}
+
+bool OutputFile::WriteAt(uint64_t offset, const void *data, size_t len) const {
+  const auto *bytes = static_cast<const uint8_t *>(data);
+  while (len > 0) {
+    const ssize_t n = pwrite(fd_, bytes, len, static_cast<off_t>(offset));
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    bytes += n;
+    len -= static_cast<size_t>(n);
+    offset += static_cast<uint64_t>(n);
+  }
+  return true;
+}
+
+bool OutputFile::Close() {
+  if (fd_ < 0)
+    return true;
+  const int fd = fd_;
+  fd_ = -1;
+  if (staged_)
+    return staged_->Commit();
+  const bool synced = !publish::Sync() || fsync(fd) == 0;
+  return close(fd) == 0 && synced;
+}
+
+void CopyExtents(const std::vector<Extent> &extents, size_t chunk_size) {
+  auto copy = [&](const Extent &extent) {
+    std::optional<utils::FileWrapper> opened;
+    utils::FileWrapper *file = extent.source;
+    if (!file) {
+      opened = utils::OpenFile(*extent.path);
+      if (!opened)
+        return false;
+      file = &*opened;
+    }
+    if (file->size != extent.size)
+      return false;
+    uint64_t done = 0;
+    const pipeline::Stage write = [&](const uint8_t *data, size_t len) {
+      for (const auto &[output, offset] : extent.targets) {
+        if (!output->WriteAt(offset + done, data, len))
+          return false;
+      }
+      done += len;
+      return true;
+    };
+    return pipeline::Run(*file, extent.size, write, chunk_size);
+  };
+
+  // Extra threads cost more to start than copying a chunk's worth of bytes.
+  uint64_t total = 0;
+  for (const auto &extent : extents)
+    total += extent.targets.empty() ? 0 : extent.size;
+  const size_t workers =
+      total <= chunk_size
+          ? 1
+          : memory::Workers(extents.size(), chunk_size * pipeline::RING_DEPTH);
+  const auto failed = pipeline::RunJobs(extents.size(), workers, [&](size_t i) {
+    return extents[i].targets.empty() || copy(extents[i]);
+  });
+  if (failed)
+    throw errors::FileWriteError(extents[*failed].name);
+}
+
+} // namespace layout
@@ -0,0 +1,106 @@
+#pragma once
+
+#include "publish.h"
+#include "utils.hpp"
+#include <iosfwd>
+#include <span>
+#include <string>
+
+namespace layout {
+
+struct Section {
+  std::string name;
+  uint64_t offset = 0;
+  uint64_t size = 0;
+};
+
+// Map of one output image. Every offset follows from the header version, the
+// alignment and the input sizes, so the whole map is known before any byte is
+// written.
+struct Image {
+  std::filesystem::path path;
+  std::string kind;
+  uint32_t header_version = 0;
+  uint32_t alignment = 0;
+  std::vector<Section> sections;
+  uint64_t size = 0;
+
+  // Places a section at the current end and pads the image to `alignment`.
+  void Add(std::string name, uint64_t section_size) {
+    Append(std::move(name), section_size);
+    Align();
+  }
+  // Places a section at the current end without padding, for sections that
+  // are packed back to back (vendor ramdisk fragments).
+  void Append(std::string name, uint64_t section_size) {
+    sections.push_back({std::move(name), size, section_size});
+    size += section_size;
+  }
+  // Records a section whose bytes are already stored at `offset`, for
+  // identical vendor ramdisk fragments that share one copy.
+  void Share(std::string name, uint64_t offset, uint64_t section_size) {
+    sections.push_back({std::move(name), offset, section_size});
+  }
+  void Align() { size += (alignment - size % alignment) % alignment; }
+
+  const Section *Find(std::string_view name) const;
+  // Lowest offset of a section named in `changed`, or the image size when
+  // none is. Nothing before it depends on those sections.
+  uint64_t FirstChangedOffset(const std::vector<std::string> &changed) const;
+};
+
+// Prints the plans as JSON: {"images": [{"path", "kind", "header_version",
+// "alignment", "size", "sections": [{"name", "offset", "size"}]}]}.
+void WritePlan(std::ostream &out, const std::vector<Image> &images);
+
+// An output file created at its final size (fallocate, or ftruncate where the
+// filesystem cannot preallocate) and filled with positional writes. It is
+// staged under a temporary name and replaces `path` on Close() (see
+// publish::StagedFile). A non-zero `keep` instead updates the existing output
+// in place, preserving that many leading bytes for incremental rebuilds; if
+// the file is shorter, nothing is kept.
+class OutputFile {
+public:
+  OutputFile(const std::filesystem::path &path, uint64_t size,
+             uint64_t keep = 0);
+  ~OutputFile();
+  OutputFile(const OutputFile &) = delete;
+  OutputFile &operator=(const OutputFile &) = delete;
+
+  int fd() const { return fd_; }
+  // Bytes preserved from the previous contents; callers skip writes below.
+  uint64_t kept() const { return kept_; }
+  bool WriteAt(uint64_t offset, const void *data, size_t len) const;
+  // Closes the descriptor and publishes the file, reporting a deferred write
+  // error. Destroyed without Close(), a staged file is discarded.
+  bool Close();
+
+private:
+  std::unique_ptr<publish::StagedFile> staged_;
+  int fd_ = -1;
+  uint64_t kept_ = 0;
+};
+
+// An output and the offset in it that an extent is copied to.
+using Target = std::pair<const OutputFile *, uint64_t>;
+
+// One input copied to fixed offsets in one or more outputs. The input is
+// either an already opened `source` or a `path` that the worker opens itself,
+// which keeps the number of open descriptors bounded by the worker count.
+// `path` and `targets` point into storage the caller keeps for the copy, so
+// describing a section allocates nothing.
+struct Extent {
+  const char *name = "";
+  utils::FileWrapper *source = nullptr;
+  const std::filesystem::path *path = nullptr;
+  uint64_t size = 0;
+  std::span<const Target> targets;
+};
+
+// Copies every extent on a pool of worker threads with pwrite. Each input is
+// read once through pipeline::Run, in chunks of at most `chunk_size` bytes, so
+// reading the next chunk overlaps writing the previous one. Throws
+// errors::FileWriteError naming the first extent that failed.
+void CopyExtents(const std::vector<Extent> &extents, size_t chunk_size);
+
+} // namespace layout
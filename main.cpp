@@ -1,12 +1,22 @@
 #include "bootimg.h"
+#include "delta.h"
+#include "edit.h"
+#include "format.h"
+#include "memory.h"
+#include "publish.h"
+#include "sink.h"
+#include "store.h"
 #include "vendorbootimg.h"
+#include "verify.h"
+#include "watch.h"
+#include "zip.h"
 #include <algorithm>
+#include <array>
 #include <cstdlib>
 #include <iostream>
 #include <optional>
 #include <string>
 #include <string_view>
-#include <unordered_map>
 #include <unordered_set>
 #include <vector>
 #include <utility>
@@ -15,17 +25,92 @@
 
 namespace { // Use anonymous namespace for internal linkage
 
-    const std::unordered_set<std::string> VENDOR_RAMDISK_BLACKLISTED_NAMES = { "default" };
-
-    uint32_t getRamdiskType(const std::string& type) {
-        static const std::unordered_map<std::string_view, uint32_t> ramdiskMap = {
-            {"none", 0},
-            {"platform", 1},
-            {"recovery", 2},
-            {"dlkm", 3},
-        };
-        auto it = ramdiskMap.find(type);
-        return (it != ramdiskMap.end()) ? it->second : 0;
+    // Constant tables only: nothing here allocates or runs at startup.
+    constexpr std::array<std::string_view, 1> VENDOR_RAMDISK_BLACKLISTED_NAMES = { "default" };
+
+    uint32_t getRamdiskType(std::string_view type) {
+        constexpr std::array<std::string_view, 4> types = { "none", "platform", "recovery", "dlkm" };
+        auto it = std::find(types.begin(), types.end(), type);
+        return (it != types.end()) ? static_cast<uint32_t>(it - types.begin()) : 0;
+    }
+
+    enum class Option {
+        Help, Variant, VendorBoot, RamdiskType, RamdiskName, VendorRamdiskFragment, VendorBootconfig, VendorCmdline,
+        VendorRamdisk, Kernel, RecoveryDtbo, Ramdisk, Second, Dtb, Cmdline, Base,
+        KernelOffset, RamdiskOffset, SecondOffset, DtbOffset, OsVersion, OsPatchLevel, TagsOffset, Board,
+        Bootconfig, BootconfigParam, Pagesize, HeaderVersion, MaxMemory, Manifest, Output, DryRun, Plan, Delta, DeltaFrom, Watch, InPlace, NoRamdiskSharing, Fsync, HugePages, Sparse, Store, Tar,
+        DtboId, DtboRev, RecoveryDtboOverlay,
+    };
+
+    struct OptionSpec {
+        std::string_view name;
+        Option option;
+        // May follow --variant and override the base value for that variant only.
+        bool per_variant = false;
+    };
+
+    // Sorted by name for binary search, which keeps lookups cheap once
+    // fragment lists run to thousands of option groups without building a
+    // hash table at startup.
+    constexpr std::array OPTIONS = {
+        OptionSpec{"--base", Option::Base, true},
+        OptionSpec{"--board", Option::Board, true},
+        OptionSpec{"--bootconfig", Option::Bootconfig},
+        OptionSpec{"--bootconfig-param", Option::BootconfigParam},
+        OptionSpec{"--cmdline", Option::Cmdline, true},
+        OptionSpec{"--delta", Option::Delta},
+        OptionSpec{"--delta-from", Option::DeltaFrom},
+        OptionSpec{"--dry-run", Option::DryRun},
+        OptionSpec{"--dtb", Option::Dtb},
+        OptionSpec{"--dtb_offset", Option::DtbOffset, true},
+        OptionSpec{"--dtbo_id", Option::DtboId},
+        OptionSpec{"--dtbo_rev", Option::DtboRev},
+        OptionSpec{"--fsync", Option::Fsync},
+        OptionSpec{"--header_version", Option::HeaderVersion, true},
+        OptionSpec{"--help", Option::Help, true},
+        OptionSpec{"--huge-pages", Option::HugePages},
+        OptionSpec{"--in-place", Option::InPlace},
+        OptionSpec{"--kernel", Option::Kernel},
+        OptionSpec{"--kernel_offset", Option::KernelOffset, true},
+        OptionSpec{"--manifest", Option::Manifest},
+        OptionSpec{"--max-memory", Option::MaxMemory},
+        OptionSpec{"--no-ramdisk-sharing", Option::NoRamdiskSharing},
+        OptionSpec{"--os_patch_level", Option::OsPatchLevel, true},
+        OptionSpec{"--os_version", Option::OsVersion, true},
+        OptionSpec{"--output", Option::Output},
+        OptionSpec{"--pagesize", Option::Pagesize, true},
+        OptionSpec{"--plan", Option::Plan},
+        OptionSpec{"--ramdisk", Option::Ramdisk},
+        OptionSpec{"--ramdisk_name", Option::RamdiskName},
+        OptionSpec{"--ramdisk_offset", Option::RamdiskOffset, true},
+        OptionSpec{"--ramdisk_type", Option::RamdiskType},
+        OptionSpec{"--recovery_dtbo", Option::RecoveryDtbo},
+        OptionSpec{"--recovery_dtbo_overlay", Option::RecoveryDtboOverlay},
+        OptionSpec{"--second", Option::Second},
+        OptionSpec{"--second_offset", Option::SecondOffset, true},
+        OptionSpec{"--sparse", Option::Sparse},
+        OptionSpec{"--store", Option::Store},
+        OptionSpec{"--tags_offset", Option::TagsOffset, true},
+        OptionSpec{"--tar", Option::Tar},
+        OptionSpec{"--variant", Option::Variant, true},
+        OptionSpec{"--vendor_boot", Option::VendorBoot},
+        OptionSpec{"--vendor_bootconfig", Option::VendorBootconfig},
+        OptionSpec{"--vendor_cmdline", Option::VendorCmdline},
+        OptionSpec{"--vendor_ramdisk", Option::VendorRamdisk},
+        OptionSpec{"--vendor_ramdisk_fragment", Option::VendorRamdiskFragment},
+        OptionSpec{"--watch", Option::Watch},
+        OptionSpec{"-h", Option::Help, true},
+    };
+    static_assert(std::is_sorted(OPTIONS.begin(), OPTIONS.end(),
+        [](const OptionSpec& a, const OptionSpec& b) { return a.name < b.name; }));
+
+    const OptionSpec* lookup_option(std::string_view key) {
+        auto it = std::lower_bound(OPTIONS.begin(), OPTIONS.end(), key,
+            [](const OptionSpec& spec, std::string_view name) { return spec.name < name; });
+        if (it == OPTIONS.end() || it->name != key) {
+            return nullptr;
+        }
+        return &*it;
     }
 
     struct RamdiskEntryFlags {
@@ -36,18 +121,35 @@ namespace { // Use anonymous namespace for internal linkage
 
     [[noreturn]] void print_help() {
         // Using raw string literal for cleaner multi-line output
-        std::cout << R"(usage: mkbootimg [-h|--help] [--kernel KERNEL] [--ramdisk RAMDISK] [--second SECOND] [--dtb DTB] [--recovery_dtbo RECOVERY_DTBO] [--cmdline CMDLINE] [--vendor_cmdline VENDOR_CMDLINE] [--base BASE]
+        std::cout << R"(usage: mkbootimg verify [--max-memory SIZE] IMAGE [IMAGE ...]
+       mkbootimg apply-delta BASE DELTA OUTPUT
+       mkbootimg extract STORE RECIPE OUTPUT
+       mkbootimg edit IMAGE [--cmdline CMDLINE] [--vendor_cmdline VENDOR_CMDLINE] [--board BOARD] [--os_version OS_VERSION] [--os_patch_level OS_PATCH_LEVEL]
+       mkbootimg [-h|--help] [--kernel KERNEL] [--ramdisk RAMDISK] [--second SECOND] [--dtb DTB] [--recovery_dtbo RECOVERY_DTBO] [--recovery_dtbo_overlay OVERLAY ...] [--cmdline CMDLINE] [--vendor_cmdline VENDOR_CMDLINE] [--base BASE]
                     [--kernel_offset KERNEL_OFFSET] [--ramdisk_offset RAMDISK_OFFSET] [--second_offset SECOND_OFFSET] [--dtb_offset DTB_OFFSET] [--os_version OS_VERSION] [--os_patch_level OS_PATCH_LEVEL] [--tags_offset TAGS_OFFSET]
-                    [--board BOARD] [--pagesize {2048,4096,8192,16384}] [--id] [--header_version HEADER_VERSION] [-o/--output OUTPUT] [--vendor_boot VENDOR_BOOT] [--vendor_ramdisk VENDOR_RAMDISK] [--vendor_bootconfig VENDOR_BOOTCONFIG]
+                    [--board BOARD] [--pagesize {2048,4096,8192,16384}] [--id] [--header_version HEADER_VERSION] [-o/--output OUTPUT] [--vendor_boot VENDOR_BOOT] [--vendor_ramdisk VENDOR_RAMDISK] [--vendor_bootconfig VENDOR_BOOTCONFIG] [--bootconfig FILE] [--bootconfig-param KEY=VALUE] [--no-ramdisk-sharing]
+                    [--manifest MANIFEST] [--store STORE] [--tar ARCHIVE] [--dry-run] [--plan] [--in-place] [--sparse] [--fsync] [--huge-pages] [--delta-from PREVIOUS --delta DELTA] [--watch] [--variant OUTPUT ...]
 
 options:
   -h, --help            show this help message and exit
+  @FILE                 read further arguments from FILE (whitespace
+                        separated, "quoted" words, # comment lines)
   --kernel KERNEL       path to the kernel (e.g., --kernel=path or --kernel path)
   --ramdisk RAMDISK     path to the ramdisk
   --second SECOND       path to the second bootloader
-  --dtb DTB             path to the dtb
+  --dtb DTB             path to the dtb; repeat it, or pass a directory of
+                        *.dtb files, to concatenate validated FDT blobs with
+                        duplicates dropped
   --recovery_dtbo RECOVERY_DTBO
                         path to the recovery DTBO
+  --dtbo_id ID, --dtbo_rev REV
+                        id and revision of the next overlay (default 0)
+  --recovery_dtbo_overlay OVERLAY
+                        build the recovery DTBO (a dt_table image) instead of
+                        taking a prebuilt one; each option adds an entry for
+                        the overlay OVERLAY. Overlays are validated in
+                        parallel and identical ones are stored once, with
+                        their entries sharing the offset
   --cmdline CMDLINE     kernel command line arguments (e.g., --cmdline="console=ttyS0 quiet")
   --vendor_cmdline VENDOR_CMDLINE
                         vendor boot kernel command line arguments
@@ -72,13 +174,80 @@ options:
   --header_version HEADER_VERSION
                         boot image header version (default is 3 for vendor_boot and 4 for boot)
   -o, --out, --output, --boot BOOT
-                        output file name
+                        output file name; "-" writes to stdout. Pipes and
+                        FIFOs are written front to back without seeking.
+                        Files are written under a temporary name in the same
+                        directory and renamed into place once complete, so a
+                        failed build leaves the previous output untouched
   --vendor_boot VENDOR_BOOT
-                        vendor boot output file name
+                        vendor boot output file name; "-" writes to stdout
   --vendor_ramdisk VENDOR_RAMDISK
                         path to the vendor ramdisk
   --vendor_bootconfig VENDOR_BOOTCONFIG
                         path to the vendor bootconfig file
+  --bootconfig FILE     build the bootconfig instead, from "key=value" lines
+                        (# comments); repeatable
+  --bootconfig-param KEY=VALUE
+                        add one bootconfig parameter; repeatable. Sources are
+                        merged in order, the last value of a key wins, and the
+                        bootconfig trailer (size, checksum, #BOOTCONFIG) is
+                        appended
+  --dry-run             lay the image out and print its size without creating
+                        the output file
+  --plan                print the section layout of every output as JSON
+                        without writing anything
+  --fsync               sync every output to disk before renaming it into
+                        place, and its directory after
+  --in-place            update an existing output block by block: compare
+                        every 4096-byte block with what the file already
+                        holds, write only the blocks that differ, sync, and
+                        print the changed and unchanged block counts. Always
+                        on when the output is a block device (a partition or
+                        loop device), which is written with O_DIRECT
+  --sparse              write the Android sparse format that fastboot
+                        flashes: runs of 4096-byte blocks repeating one 32-bit
+                        value (such as zero padding) become FILL chunks, the
+                        rest RAW chunks. Needs a regular output file
+  --manifest MANIFEST   write a JSON manifest with SHA-256, SHA-1 and CRC32C
+                        digests of every image and section, hashed while writing
+  --store STORE         also keep every image in the chunk store directory
+                        STORE: sections are cut at their boundaries and into
+                        content-defined chunks of 16K-256K, each stored once
+                        under its SHA-256, plus a recipe named after the
+                        image's SHA-256. "mkbootimg extract STORE RECIPE
+                        OUTPUT" rebuilds the image
+  --tar ARCHIVE         write the images into the tar archive ARCHIVE ("-"
+                        for stdout) instead: each output path names a member,
+                        whose header carries the planned size, so every image
+                        is written straight into the archive in one pass
+
+  Kernel, ramdisk, second, recovery_dtbo, a single dtb, vendor ramdisks and
+  the bootconfig may also be "-" (stdin), a FIFO or a pipe such as
+  <(cpio ... | lz4). They are copied as they are read and the header sizes
+  are patched afterwards; with --manifest, --in-place or a pipe as output
+  they are held in memory first (at most 256M each).
+
+  Any input path may also name an entry of a zip archive, such as
+  target_files.zip!/IMAGES/kernel. Stored entries are copied straight from
+  the archive and deflated ones are inflated while they are copied.
+
+delta arguments:
+  --delta-from PREVIOUS previous build of the same image
+  --delta DELTA         also write the pages of the new image that differ from
+                        PREVIOUS (page_size pages, 4096 for boot v3+), compared
+                        as they are written, with a CRC-32C per page and
+                        SHA-256 digests of both images. PREVIOUS may be the
+                        output itself, which is replaced only afterwards.
+                        "mkbootimg apply-delta PREVIOUS DELTA OUTPUT" rebuilds
+                        the new image from them.
+
+watch arguments:
+  --watch               build, then keep watching every input (including each
+                        vendor ramdisk fragment, dtb and bootconfig) with
+                        inotify and rebuild on change. Only the header and the
+                        sections from the first changed one on are rewritten,
+                        unless --manifest asks for full digests. Each rebuild
+                        prints its latency. Stop with Ctrl-C.
 
 vendor boot version 4 arguments:
   --ramdisk_type {none,platform,recovery,dlkm}
@@ -91,6 +260,30 @@ vendor boot version 4 arguments:
   These options can be specified multiple times, where each vendor ramdisk
   option group ends with a --vendor_ramdisk_fragment option.
   Each option group appends an additional ramdisk to the vendor boot image.
+  Fragments with identical contents are stored once and their table entries
+  share the same offset and size.
+
+  --no-ramdisk-sharing  store every fragment separately, for bootloaders that
+                        expect each table entry to have its own range
+
+resource arguments:
+  --max-memory SIZE     keep resident memory below SIZE bytes (K, M and G
+                        suffixes accepted); copy and hash buffers, spooled
+                        streams and workers share that budget, a stream that
+                        does not fit fails the build, and the peak RSS is
+                        reported on exit (a peak over SIZE fails the run).
+                        Also accepted as the first option of verify.
+  --huge-pages          back copy buffers of 1 MiB and more with transparent
+                        huge pages (rounded up to 2 MiB); ignored with
+                        --max-memory
+
+fan-out arguments:
+  --variant OUTPUT      build an additional boot image from the same inputs
+
+  Options following a --variant apply to that variant only and override the
+  values given before the first --variant: --pagesize, --header_version,
+  --cmdline, --board, --os_version, --os_patch_level, --base and the *_offset
+  options. Every input is read once and streamed to all outputs.
 )";
         exit(EXIT_FAILURE);
     }
@@ -102,6 +295,73 @@ vendor boot version 4 arguments:
         return sv;
     }
 
+    // Replaces every @FILE argument with the words read from FILE, so fragment
+    // lists too long for argv can be passed in a response file. Words are
+    // separated by whitespace, double quotes group a word that contains
+    // spaces, and lines starting with '#' are comments. Response files do not
+    // nest.
+    std::optional<std::vector<std::string>> expand_response_files(int argc, char* argv[]) {
+        std::vector<std::string> words;
+        words.reserve(static_cast<size_t>(argc));
+        for (int i = 0; i < argc; ++i) {
+            if (i == 0 || argv[i][0] != '@') {
+                words.emplace_back(argv[i]);
+                continue;
+            }
+            auto file = utils::OpenFile(argv[i] + 1);
+            std::string contents(file ? file->size : 0, '\0');
+            if (!file || !file->ReadAt(0, contents.data(), contents.size())) {
+                std::cerr << "Could not open response file: " << (argv[i] + 1) << std::endl;
+                return std::nullopt;
+            }
+            std::string_view remaining(contents);
+            while (!remaining.empty()) {
+                const size_t newline = remaining.find('\n');
+                const std::string_view line = remaining.substr(0, newline);
+                remaining.remove_prefix(newline == std::string_view::npos ? remaining.size() : newline + 1);
+                size_t pos = line.find_first_not_of(" \t\r");
+                if (pos == std::string::npos || line[pos] == '#') {
+                    continue;
+                }
+                std::string word;
+                bool in_word = false;
+                bool quoted = false;
+                for (; pos < line.size(); ++pos) {
+                    const char c = line[pos];
+                    if (c == '"') {
+                        quoted = !quoted;
+                        in_word = true;
+                    }
+                    else if (!quoted && (c == ' ' || c == '\t' || c == '\r')) {
+                        if (in_word) {
+                            words.push_back(std::move(word));
+                            word.clear();
+                            in_word = false;
+                        }
+                    }
+                    else {
+                        word.push_back(c);
+                        in_word = true;
+                    }
+                }
+                if (quoted) {
+                    std::cerr << "Unterminated quote in response file: " << (argv[i] + 1) << std::endl;
+                    return std::nullopt;
+                }
+                if (in_word) {
+                    words.push_back(std::move(word));
+                }
+            }
+        }
+        return words;
+    }
+
+    // A following word is a value unless it looks like an option; a lone "-"
+    // is a value (stdout for -o).
+    bool is_value(const char* word) {
+        return word[0] != '-' || std::string_view(word) == "-";
+    }
+
     std::optional<std::vector<std::pair<std::string_view, std::string_view>>>
         tokenize_arguments(int argc, char* argv[]) {
         std::vector<std::pair<std::string_view, std::string_view>> args;
@@ -127,7 +387,7 @@ vendor boot version 4 arguments:
                 }
                 else {
                     key = current_arg;
-                    if (i + 1 < argc && argv[i + 1][0] != '-') {
+                    if (i + 1 < argc && is_value(argv[i + 1])) {
                         value = parse_quoted_string(argv[i + 1]);
                         ++i;
                     }
@@ -138,7 +398,7 @@ vendor boot version 4 arguments:
             }
             else if (current_arg.rfind('-', 0) == 0 && current_arg.length() == 2) {
                 key = current_arg;
-                if (i + 1 < argc && argv[i + 1][0] != '-') {
+                if (i + 1 < argc && is_value(argv[i + 1])) {
                     value = parse_quoted_string(argv[i + 1]);
                     ++i;
                 }
@@ -162,14 +422,59 @@ vendor boot version 4 arguments:
     }
 
 
-    std::optional<std::pair<BootImageArgs, VendorBootArgs>>
+    bool apply_max_memory(std::string_view key, std::string_view value) {
+        auto bytes = memory::ParseSize(value);
+        if (!bytes) {
+            std::cerr << key << " expects a byte count such as 64M, got '" << value << "'" << std::endl;
+            return false;
+        }
+        try {
+            memory::SetLimit(*bytes);
+        }
+        catch (const std::exception& e) {
+            std::cerr << e.what() << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    // Reports the peak RSS under --max-memory; false if it went over the limit.
+    bool report_peak_rss() {
+        if (memory::Limit() == 0) {
+            return true;
+        }
+        const uint64_t peak = memory::PeakRss();
+        std::cerr << "Peak RSS: " << peak / 1024 << " KiB (limit "
+            << memory::Limit() / 1024 << " KiB)" << std::endl;
+        if (peak > memory::Limit()) {
+            std::cerr << "Peak RSS exceeded --max-memory." << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    struct ParsedArguments {
+        BootImageArgs args;
+        std::vector<BootImageArgs> variants;
+        VendorBootArgs vendor_args;
+        bool plan = false;
+        bool watch = false;
+    };
+
+    std::optional<ParsedArguments>
         ProcessArguments(const std::vector<std::pair<std::string_view, std::string_view>>& tokenized_args) {
         BootImageArgs args;
+        std::vector<BootImageArgs> variants;
         VendorBootArgs vendor_args;
         bool parsing_vendor = false;
+        bool plan = false;
+        bool watch = false;
 
         VendorRamdiskEntry currentEntry;
         RamdiskEntryFlags currentFlags;
+        // --dtbo_id and --dtbo_rev apply to the next --recovery_dtbo_overlay.
+        dtb::Overlay currentOverlay;
+        bool pending_overlay = false;
 
         auto finishCurrentEntry = [&]() -> bool {
             if (!currentFlags.has_type && !currentFlags.has_name && !currentFlags.has_fragment) {
@@ -196,147 +501,222 @@ vendor boot version 4 arguments:
             };
 
         for (const auto& [key, value] : tokenized_args) {
+            // Per-variant options target the most recent --variant, everything else the base.
+            BootImageArgs& target = variants.empty() ? args : variants.back();
+            const bool base_options = variants.empty();
+            const OptionSpec* spec = lookup_option(key);
+            if (!spec) {
+                std::cerr << "Unknown argument: " << key << std::endl;
+                return std::nullopt;
+            }
+            if (!base_options && !spec->per_variant) {
+                std::cerr << key << " must precede the first --variant." << std::endl;
+                return std::nullopt;
+            }
+            const Option option = spec->option;
+            const bool is_flag = option == Option::DryRun || option == Option::Plan || option == Option::Watch ||
+                option == Option::InPlace || option == Option::NoRamdiskSharing ||
+                option == Option::Fsync || option == Option::HugePages || option == Option::Sparse;
+            if (is_flag && !value.empty()) {
+                std::cerr << key << " does not take a value." << std::endl;
+                return std::nullopt;
+            }
+            if (value.empty() && option != Option::Help && !is_flag) {
+                std::cerr << key << " requires a value.\n";
+                return std::nullopt;
+            }
             try {
-                if (key == "--help" || key == "-h") {
+                switch (option) {
+                case Option::Help:
                     print_help();
+                case Option::Variant: {
+                    BootImageArgs variant = args;
+                    variant.output = value;
+                    variants.push_back(std::move(variant));
+                    break;
                 }
-                else if (key == "--vendor_boot") {
+                case Option::VendorBoot:
                     parsing_vendor = true;
-                    if (value.empty()) { std::cerr << key << " requires a value.\n"; return std::nullopt; }
                     vendor_args.output = value;
-                }
-                else if (key == "--ramdisk_type") {
+                    break;
+                case Option::RamdiskType:
                     parsing_vendor = true;
-                    if (value.empty()) { std::cerr << key << " requires a value.\n"; return std::nullopt; }
                     if (currentFlags.has_type || currentFlags.has_name || currentFlags.has_fragment) {
                         if (!finishCurrentEntry()) return std::nullopt;
                     }
-                    currentEntry.type = getRamdiskType(std::string(value));
+                    currentEntry.type = getRamdiskType(value);
                     currentFlags.has_type = true;
-                }
-                else if (key == "--ramdisk_name") {
+                    break;
+                case Option::RamdiskName:
                     parsing_vendor = true;
-                    if (value.empty()) { std::cerr << key << " requires a value.\n"; return std::nullopt; }
                     if (!currentFlags.has_type) { std::cerr << key << " provided before --ramdisk_type.\n"; return std::nullopt; }
                     if (currentFlags.has_name) { std::cerr << "Duplicate " << key << " in current vendor entry.\n"; return std::nullopt; }
                     currentEntry.name = value;
                     currentFlags.has_name = true;
-                }
-                else if (key == "--vendor_ramdisk_fragment") {
+                    break;
+                case Option::VendorRamdiskFragment:
                     parsing_vendor = true;
-                    if (value.empty()) { std::cerr << key << " requires a value.\n"; return std::nullopt; }
                     if (!currentFlags.has_type) { std::cerr << key << " provided before --ramdisk_type.\n"; return std::nullopt; }
                     if (currentFlags.has_fragment) { std::cerr << "Duplicate " << key << " in current vendor entry.\n"; return std::nullopt; }
                     currentEntry.path = value;
                     currentFlags.has_fragment = true;
                     if (!finishCurrentEntry()) return std::nullopt;
-                }
-                else if (key == "--vendor_bootconfig") {
+                    break;
+                case Option::VendorBootconfig:
                     parsing_vendor = true;
-                    if (value.empty()) { std::cerr << key << " requires a value.\n"; return std::nullopt; }
                     vendor_args.bootconfig = value;
-                }
-                else if (key == "--vendor_cmdline") {
+                    break;
+                case Option::Bootconfig:
+                    parsing_vendor = true;
+                    vendor_args.bootconfig_sources.push_back({ value, {} });
+                    break;
+                case Option::BootconfigParam:
+                    parsing_vendor = true;
+                    vendor_args.bootconfig_sources.push_back({ {}, std::string(value) });
+                    break;
+                case Option::VendorCmdline:
                     parsing_vendor = true;
-                    if (value.empty()) { std::cerr << key << " requires a value.\n"; return std::nullopt; }
                     vendor_args.vendor_cmdline = value;
-                }
-                else if (key == "--vendor_ramdisk") {
+                    break;
+                case Option::VendorRamdisk:
                     parsing_vendor = true;
-                    if (value.empty()) { std::cerr << key << " requires a value.\n"; return std::nullopt; }
                     vendor_args.vendor_ramdisk = value;
-                }
-                else if (key == "--kernel") {
-                    if (value.empty()) { std::cerr << key << " requires a value.\n"; return std::nullopt; }
+                    break;
+                case Option::Kernel:
                     args.kernel = value;
-                }
-                else if (key == "--recovery_dtbo") {
-                    if (value.empty()) { std::cerr << key << " requires a value.\n"; return std::nullopt; }
+                    break;
+                case Option::RecoveryDtbo:
                     args.recovery_dtbo = value;
-                }
-                else if (key == "--ramdisk") {
-                    if (value.empty()) { std::cerr << key << " requires a value.\n"; return std::nullopt; }
+                    break;
+                case Option::DtboId:
+                    currentOverlay.id = std::stoul(std::string(value), nullptr, 0);
+                    pending_overlay = true;
+                    break;
+                case Option::DtboRev:
+                    currentOverlay.rev = std::stoul(std::string(value), nullptr, 0);
+                    pending_overlay = true;
+                    break;
+                case Option::RecoveryDtboOverlay:
+                    currentOverlay.path = value;
+                    args.recovery_dtbo_overlays.push_back(std::move(currentOverlay));
+                    currentOverlay = {};
+                    pending_overlay = false;
+                    break;
+                case Option::Ramdisk:
                     args.ramdisk = value;
-                }
-                else if (key == "--second") {
-                    if (value.empty()) { std::cerr << key << " requires a value.\n"; return std::nullopt; }
+                    break;
+                case Option::Second:
                     args.second = value;
-                }
-                else if (key == "--dtb") {
-                    if (value.empty()) { std::cerr << key << " requires a value.\n"; return std::nullopt; }
-                    args.dtb = value;
-                    vendor_args.dtb = args.dtb;
-                }
-                else if (key == "--cmdline") {
-                    if (value.empty()) { std::cerr << key << " requires a value.\n"; return std::nullopt; }
-                    args.cmdline = value;
-                }
-                else if (key == "--base") {
-                    if (value.empty()) { std::cerr << key << " requires a value.\n"; return std::nullopt; }
-                    args.base = std::stoul(std::string(value), nullptr, 0);
-                    vendor_args.base = args.base;
-                }
-                else if (key == "--kernel_offset") {
-                    if (value.empty()) { std::cerr << key << " requires a value.\n"; return std::nullopt; }
-                    args.kernel_offset = std::stoul(std::string(value), nullptr, 0);
-                    vendor_args.kernel_offset = args.kernel_offset;
-                }
-                else if (key == "--ramdisk_offset") {
-                    if (value.empty()) { std::cerr << key << " requires a value.\n"; return std::nullopt; }
-                    args.ramdisk_offset = std::stoul(std::string(value), nullptr, 0);
-                    vendor_args.ramdisk_offset = args.ramdisk_offset;
-                }
-                else if (key == "--second_offset") {
-                    if (value.empty()) { std::cerr << key << " requires a value.\n"; return std::nullopt; }
-                    args.second_offset = std::stoul(std::string(value), nullptr, 0);
-                }
-                else if (key == "--dtb_offset") {
-                    if (value.empty()) { std::cerr << key << " requires a value.\n"; return std::nullopt; }
-                    args.dtb_offset = std::stoul(std::string(value), nullptr, 0);
-                    vendor_args.dtb_offset = std::stoull(std::string(value), nullptr, 0);
-                }
-                else if (key == "--os_version") {
-                    if (value.empty()) { std::cerr << key << " requires a value.\n"; return std::nullopt; }
-                    args.os_version.version_str = value;
-                }
-                else if (key == "--os_patch_level") {
-                    if (value.empty()) { std::cerr << key << " requires a value.\n"; return std::nullopt; }
-                    args.os_version.patch_level_str = value;
-                }
-                else if (key == "--tags_offset") {
-                    if (value.empty()) { std::cerr << key << " requires a value.\n"; return std::nullopt; }
-                    args.tags_offset = std::stoul(std::string(value), nullptr, 0);
-                    vendor_args.tags_offset = args.tags_offset;
-                }
-                else if (key == "--board") {
-                    if (value.empty()) { std::cerr << key << " requires a value.\n"; return std::nullopt; }
-                    args.board = value;
-                    vendor_args.board = args.board;
-                }
-                else if (key == "--pagesize") {
-                    if (value.empty()) { std::cerr << key << " requires a value.\n"; return std::nullopt; }
-                    args.page_size = std::stoul(std::string(value), nullptr, 0);
-                    bool isPageSizeValid = args.page_size == 2048 || args.page_size == 4096 ||
-                        args.page_size == 8192 || args.page_size == 16384;
+                    break;
+                case Option::Dtb:
+                    args.dtb.emplace_back(value);
+                    vendor_args.dtb.emplace_back(value);
+                    break;
+                case Option::Cmdline:
+                    target.cmdline = value;
+                    break;
+                case Option::Base:
+                    target.base = std::stoul(std::string(value), nullptr, 0);
+                    if (base_options) vendor_args.base = target.base;
+                    break;
+                case Option::KernelOffset:
+                    target.kernel_offset = std::stoul(std::string(value), nullptr, 0);
+                    if (base_options) vendor_args.kernel_offset = target.kernel_offset;
+                    break;
+                case Option::RamdiskOffset:
+                    target.ramdisk_offset = std::stoul(std::string(value), nullptr, 0);
+                    if (base_options) vendor_args.ramdisk_offset = target.ramdisk_offset;
+                    break;
+                case Option::SecondOffset:
+                    target.second_offset = std::stoul(std::string(value), nullptr, 0);
+                    break;
+                case Option::DtbOffset:
+                    target.dtb_offset = std::stoul(std::string(value), nullptr, 0);
+                    if (base_options) vendor_args.dtb_offset = std::stoull(std::string(value), nullptr, 0);
+                    break;
+                case Option::OsVersion:
+                    target.os_version.version_str = value;
+                    break;
+                case Option::OsPatchLevel:
+                    target.os_version.patch_level_str = value;
+                    break;
+                case Option::TagsOffset:
+                    target.tags_offset = std::stoul(std::string(value), nullptr, 0);
+                    if (base_options) vendor_args.tags_offset = target.tags_offset;
+                    break;
+                case Option::Board:
+                    target.board = value;
+                    if (base_options) vendor_args.board = target.board;
+                    break;
+                case Option::Pagesize: {
+                    target.page_size = std::stoul(std::string(value), nullptr, 0);
+                    bool isPageSizeValid = target.page_size == 2048 || target.page_size == 4096 ||
+                        target.page_size == 8192 || target.page_size == 16384;
                     if (!isPageSizeValid) {
-                        std::cerr << "Invalid page size: " << args.page_size
+                        std::cerr << "Invalid page size: " << target.page_size
                             << ". Must be one of {2048, 4096, 8192, 16384}.\n";
                         return std::nullopt;
                     }
-                    vendor_args.page_size = args.page_size;
-                }
-                else if (key == "--header_version") {
-                    if (value.empty()) { std::cerr << key << " requires a value.\n"; return std::nullopt; }
-                    args.header_version = std::stoul(std::string(value), nullptr, 0);
-                    vendor_args.header_version = args.header_version;
+                    if (base_options) vendor_args.page_size = target.page_size;
+                    break;
                 }
-                else if (key == "--output") {
-                    if (value.empty()) { std::cerr << key << " requires a value.\n"; return std::nullopt; }
+                case Option::HeaderVersion:
+                    target.header_version = std::stoul(std::string(value), nullptr, 0);
+                    if (base_options) vendor_args.header_version = target.header_version;
+                    break;
+                case Option::MaxMemory:
+                    if (!apply_max_memory(key, value)) return std::nullopt;
+                    break;
+                case Option::Manifest:
+                    args.manifest = value;
+                    vendor_args.manifest = value;
+                    break;
+                case Option::Store:
+                    args.store = value;
+                    vendor_args.store = value;
+                    break;
+                case Option::Tar:
+                    args.tar = value;
+                    vendor_args.tar = value;
+                    break;
+                case Option::Output:
                     args.output = value;
-                }
-                else {
-                    std::cerr << "Unknown argument: " << key << std::endl;
-                    return std::nullopt;
+                    break;
+                case Option::DryRun:
+                    args.dry_run = true;
+                    vendor_args.dry_run = true;
+                    break;
+                case Option::Fsync:
+                    publish::SetSync(true);
+                    break;
+                case Option::HugePages:
+                    memory::SetHugePages(true);
+                    break;
+                case Option::NoRamdiskSharing:
+                    vendor_args.share_ramdisks = false;
+                    break;
+                case Option::InPlace:
+                    args.in_place = true;
+                    vendor_args.in_place = true;
+                    break;
+                case Option::Sparse:
+                    args.sparse = true;
+                    vendor_args.sparse = true;
+                    break;
+                case Option::Plan:
+                    plan = true;
+                    break;
+                case Option::Delta:
+                    args.delta = value;
+                    vendor_args.delta = value;
+                    break;
+                case Option::DeltaFrom:
+                    args.delta_from = value;
+                    vendor_args.delta_from = value;
+                    break;
+                case Option::Watch:
+                    watch = true;
+                    break;
                 }
             }
             catch (const std::invalid_argument& e) {
@@ -354,11 +734,77 @@ vendor boot version 4 arguments:
             return std::nullopt;
         }
 
-        if (vendor_args.output.empty() && args.output.empty()) {
+        if (pending_overlay) {
+            std::cerr << "--dtbo_id and --dtbo_rev must be followed by --recovery_dtbo_overlay." << std::endl;
+            return std::nullopt;
+        }
+
+        if (!args.recovery_dtbo.empty() && !args.recovery_dtbo_overlays.empty()) {
+            std::cerr << "--recovery_dtbo cannot be combined with --recovery_dtbo_overlay." << std::endl;
+            return std::nullopt;
+        }
+
+        if (vendor_args.output.empty() && args.output.empty() && variants.empty()) {
             std::cerr << "Either --output (or --boot/-o) or --vendor_boot is required." << std::endl;
             return std::nullopt;
         }
 
+        if (!variants.empty() && !vendor_args.output.empty()) {
+            std::cerr << "--variant is only supported for boot images." << std::endl;
+            return std::nullopt;
+        }
+
+        if (args.delta.empty() != args.delta_from.empty()) {
+            std::cerr << "--delta and --delta-from must be given together." << std::endl;
+            return std::nullopt;
+        }
+
+        if (!args.delta.empty() && (!variants.empty() || args.dry_run || plan || args.sparse)) {
+            std::cerr << "--delta cannot be combined with --variant, --dry-run, --plan or --sparse." << std::endl;
+            return std::nullopt;
+        }
+
+        // An in-place update overwrites the previous build before the delta has read it; a
+        // replaced output is only renamed over it, so the delta still sees the old image.
+        std::error_code same_ec;
+        if (!args.delta.empty() && args.in_place &&
+            std::filesystem::equivalent(args.delta_from, vendor_args.output.empty() ? args.output : vendor_args.output, same_ec)) {
+            std::cerr << "--delta-from cannot be the output of an --in-place update." << std::endl;
+            return std::nullopt;
+        }
+
+        if (!args.store.empty() && args.dry_run) {
+            std::cerr << "--store cannot be combined with --dry-run." << std::endl;
+            return std::nullopt;
+        }
+
+        if (!args.tar.empty() && (!args.delta.empty() || watch || args.dry_run || args.in_place || args.sparse)) {
+            std::cerr << "--tar cannot be combined with --delta, --watch, --dry-run, --in-place or --sparse." << std::endl;
+            return std::nullopt;
+        }
+
+        if (watch && (!args.delta.empty() || args.dry_run || plan)) {
+            std::cerr << "--watch cannot be combined with --delta, --dry-run or --plan." << std::endl;
+            return std::nullopt;
+        }
+
+        const size_t stdout_outputs = (args.tar == "-") + (args.output == "-") + (vendor_args.output == "-") +
+            std::count_if(variants.begin(), variants.end(), [](const BootImageArgs& v) { return v.output == "-"; });
+        if (stdout_outputs > 1) {
+            std::cerr << "Only one output can be written to stdout." << std::endl;
+            return std::nullopt;
+        }
+        const bool streamed = sink::IsStreamOutput(vendor_args.output.empty() ? args.output : vendor_args.output);
+        if (streamed && (watch || !args.delta.empty() || args.in_place)) {
+            std::cerr << "--watch, --delta and --in-place need a regular output file, not a pipe or stdout." << std::endl;
+            return std::nullopt;
+        }
+
+        if (!vendor_args.bootconfig.empty() && !vendor_args.bootconfig_sources.empty()) {
+            std::cerr << "--vendor_bootconfig cannot be combined with --bootconfig or --bootconfig-param." << std::endl;
+            return std::nullopt;
+        }
+
         if (parsing_vendor && vendor_args.ramdisks.empty() && vendor_args.vendor_ramdisk.empty()) {
             std::cerr << "--vendor_boot specified, but no vendor ramdisks provided "
                 << "(--vendor_ramdisk or --vendor_ramdisk_fragment groups)." << std::endl;
@@ -368,7 +814,8 @@ vendor boot version 4 arguments:
         std::unordered_set<std::string> names;
         names.reserve(vendor_args.ramdisks.size());
         for (const auto& entry : vendor_args.ramdisks) {
-            if (VENDOR_RAMDISK_BLACKLISTED_NAMES.count(entry.name)) {
+            if (std::find(VENDOR_RAMDISK_BLACKLISTED_NAMES.begin(), VENDOR_RAMDISK_BLACKLISTED_NAMES.end(),
+                    entry.name) != VENDOR_RAMDISK_BLACKLISTED_NAMES.end()) {
                 std::cerr << "Blocklisted ramdisk name used: " << entry.name << std::endl;
                 return std::nullopt;
             }
@@ -383,16 +830,174 @@ vendor boot version 4 arguments:
             return std::nullopt;
         }
 
-        return std::make_pair(std::move(args), std::move(vendor_args));
+        return ParsedArguments{ std::move(args), std::move(variants), std::move(vendor_args), plan, watch };
+    }
+
+    // Builds the requested images, then rebuilds them whenever an input changes.
+    [[noreturn]] void watch_and_rebuild(const std::vector<BootImageArgs>& boot_images, const VendorBootArgs& vendor_args) {
+        const bool vendor = !vendor_args.output.empty();
+        std::vector<watch::Input> inputs;
+        const auto sections = vendor ? VendorBootBuilder(VendorBootArgs(vendor_args)).InputSections()
+                                     : BootInputSections(boot_images.front());
+        for (const auto& [path, section] : sections) {
+            if (utils::IsStreamInput(path)) {
+                throw std::runtime_error("--watch needs files to watch, but the " + section + " input " +
+                                         path.string() + " is a stream.");
+            }
+            // An archive entry changes with its archive.
+            const auto entry = zip::SplitPath(path);
+            inputs.push_back({ entry ? entry->archive : path, section });
+        }
+        watch::Run(inputs, [&](const std::vector<std::string>* changed) {
+            if (vendor) {
+                VendorBootArgs current = vendor_args;
+                if (changed) {
+                    current.changed_sections = *changed;
+                }
+                VendorBootBuilder(std::move(current)).Build();
+                return;
+            }
+            std::vector<BootImageArgs> current = boot_images;
+            for (auto& image : current) {
+                if (changed) {
+                    image.changed_sections = *changed;
+                }
+            }
+            WriteBootImages(current);
+        });
+    }
+
+    std::optional<HeaderEdits>
+        ProcessEditArguments(const std::vector<std::pair<std::string_view, std::string_view>>& tokenized_args) {
+        HeaderEdits edits;
+        for (const auto& [key, value] : tokenized_args) {
+            if (key == "--help" || key == "-h") {
+                print_help();
+            }
+            if (value.empty()) { std::cerr << key << " requires a value.\n"; return std::nullopt; }
+            if (key == "--cmdline") {
+                edits.cmdline = value;
+            }
+            else if (key == "--vendor_cmdline") {
+                edits.vendor_cmdline = value;
+            }
+            else if (key == "--board") {
+                edits.board = value;
+            }
+            else if (key == "--os_version") {
+                edits.os_version = value;
+            }
+            else if (key == "--os_patch_level") {
+                edits.os_patch_level = value;
+            }
+            else {
+                std::cerr << "Argument not supported by edit: " << key << std::endl;
+                return std::nullopt;
+            }
+        }
+        return edits;
     }
 
 } // anonymous namespace
 
-int main(int argc, char* argv[]) {
+int main(int raw_argc, char* raw_argv[]) {
+    auto words = expand_response_files(raw_argc, raw_argv);
+    if (!words) {
+        return EXIT_FAILURE;
+    }
+    std::vector<char*> arg_pointers;
+    arg_pointers.reserve(words->size() + 1);
+    for (auto& word : *words) {
+        arg_pointers.push_back(word.data());
+    }
+    arg_pointers.push_back(nullptr);
+    const int argc = static_cast<int>(words->size());
+    char** argv = arg_pointers.data();
+
     if (argc < 2) {
         print_help();
     }
 
+    if (std::string_view(argv[1]) == "verify") {
+        if (argc < 3) {
+            std::cerr << "verify requires at least one image." << std::endl;
+            return EXIT_FAILURE;
+        }
+        int first = 2;
+        std::string_view option(argv[first]);
+        if (option.rfind("--max-memory=", 0) == 0) {
+            if (!apply_max_memory("--max-memory", option.substr(13))) return EXIT_FAILURE;
+            ++first;
+        }
+        else if (option == "--max-memory" && argc > 3) {
+            if (!apply_max_memory(option, argv[3])) return EXIT_FAILURE;
+            first += 2;
+        }
+        std::vector<std::filesystem::path> paths(argv + first, argv + argc);
+        if (paths.empty()) {
+            std::cerr << "verify requires at least one image." << std::endl;
+            return EXIT_FAILURE;
+        }
+        const bool ok = VerifyImages(paths);
+        const bool within_limit = report_peak_rss();
+        return ok && within_limit ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    if (std::string_view(argv[1]) == "apply-delta") {
+        if (argc != 5) {
+            std::cerr << "apply-delta requires BASE DELTA OUTPUT." << std::endl;
+            return EXIT_FAILURE;
+        }
+        try {
+            delta::ApplyDelta(argv[2], argv[3], argv[4]);
+        }
+        catch (const std::exception& e) {
+            std::cerr << e.what() << std::endl;
+            return EXIT_FAILURE;
+        }
+        return EXIT_SUCCESS;
+    }
+
+    if (std::string_view(argv[1]) == "extract") {
+        if (argc != 5) {
+            std::cerr << "extract requires STORE RECIPE OUTPUT." << std::endl;
+            return EXIT_FAILURE;
+        }
+        try {
+            store::Extract(argv[2], argv[3], argv[4]);
+        }
+        catch (const std::exception& e) {
+            std::cerr << e.what() << std::endl;
+            return EXIT_FAILURE;
+        }
+        return EXIT_SUCCESS;
+    }
+
+    if (std::string_view(argv[1]) == "edit") {
+        if (argc < 4) {
+            std::cerr << "edit requires an image and at least one field to change." << std::endl;
+            return EXIT_FAILURE;
+        }
+        // argv[2] is the image; tokenize the options that follow it.
+        auto tokenized = tokenize_arguments(argc - 2, argv + 2);
+        if (!tokenized) {
+            return EXIT_FAILURE;
+        }
+        auto edits = ProcessEditArguments(*tokenized);
+        if (!edits) {
+            std::cerr << "Failed to process arguments." << std::endl;
+            return EXIT_FAILURE;
+        }
+        try {
+            EditImageHeader(argv[2], *edits);
+        }
+        catch (const std::exception& e) {
+            std::cerr << e.what() << std::endl;
+            return EXIT_FAILURE;
+        }
+        return EXIT_SUCCESS;
+    }
+
     auto tokenized_args_opt = tokenize_arguments(argc, argv);
     if (!tokenized_args_opt) {
         return EXIT_FAILURE;
@@ -404,12 +1009,30 @@ int main(int argc, char* argv[]) {
         return EXIT_FAILURE;
     }
 
-    auto& [args, vendor_args] = *parsed_opt;
+    auto& [args, variants, vendor_args, plan, watch] = *parsed_opt;
 
     try {
-        if (!vendor_args.output.empty()) {
+        if (!variants.empty() && !args.output.empty()) {
+            variants.insert(variants.begin(), args);
+        }
+        if (watch) {
+            watch_and_rebuild(variants.empty() ? std::vector<BootImageArgs>{ args } : variants, vendor_args);
+        }
+        if (plan) {
+            std::vector<layout::Image> plans;
+            if (!vendor_args.output.empty()) {
+                plans.push_back(VendorBootBuilder(std::move(vendor_args)).Plan());
+            } else if (!variants.empty()) {
+                plans = PlanBootImages(variants);
+            } else {
+                plans = PlanBootImages(std::span<const BootImageArgs>(&args, 1));
+            }
+            layout::WritePlan(std::cout, plans);
+        } else if (!vendor_args.output.empty()) {
             VendorBootBuilder builder(std::move(vendor_args));
             builder.Build();
+        } else if (!variants.empty()) {
+            WriteBootImages(variants);
         } else if (!args.output.empty()) {
             WriteBootImage(args);
         } else {
@@ -427,5 +1050,5 @@ int main(int argc, char* argv[]) {
         return EXIT_FAILURE;
     }
 
-    return EXIT_SUCCESS;
+    return report_peak_rss() ? EXIT_SUCCESS : EXIT_FAILURE;
 }
@@ -0,0 +1,120 @@
+#include "manifest.h"
+#include "utils.hpp"
+
+#include <fstream>
+
+namespace {
+
+// Digests are lowercase hex, which JSON takes without escaping.
+void WriteDigests(std::ostream &out, const hashing::Digests &digests) {
+  out << "\"sha256\": \"" << digests.sha256 << "\", \"sha1\": \""
+      << digests.sha1 << "\", \"crc32c\": \"" << digests.crc32c << '"';
+}
+
+} // namespace
+
+namespace manifest {
+
+std::string JsonString(std::string_view value) {
+  std::string out = "\"";
+  for (char c : value) {
+    switch (c) {
+    case '"':
+      out += "\\\"";
+      break;
+    case '\\':
+      out += "\\\\";
+      break;
+    case '\n':
+      out += "\\n";
+      break;
+    case '\t':
+      out += "\\t";
+      break;
+    default:
+      if (static_cast<unsigned char>(c) < 0x20) {
+        constexpr char digits[] = "0123456789abcdef";
+        out += "\\u00";
+        out.push_back(digits[(c >> 4) & 0xF]);
+        out.push_back(digits[c & 0xF]);
+      } else {
+        out.push_back(c);
+      }
+    }
+  }
+  out += "\"";
+  return out;
+}
+
+void DigestingSink::BeginSection(std::string_view name) {
+  current_ = SectionRecord{std::string(name), Position(), 0, {}};
+  section_ = hashing::MultiDigest();
+  in_section_ = true;
+}
+
+void DigestingSink::EndSection() {
+  if (!in_section_)
+    return;
+  current_.size = Position() - current_.offset;
+  current_.digests = section_.Final();
+  sections_.push_back(std::move(current_));
+  in_section_ = false;
+}
+
+bool DigestingSink::Flush() { return target_.Flush() && Ok(); }
+
+bool DigestingSink::Close() { return target_.Close() && Ok(); }
+
+ImageRecord DigestingSink::Finish(const std::filesystem::path &path) {
+  return ImageRecord{path, Position(), image_.Final(), std::move(sections_)};
+}
+
+void DigestingSink::Digest(const void *data, size_t len) {
+  image_.Update(data, len);
+  if (in_section_)
+    section_.Update(data, len);
+}
+
+bool DigestingSink::Store(const void *data, size_t len) {
+  digested_ = true;
+  const bool ok = Write(data, len);
+  digested_ = false;
+  return ok;
+}
+
+bool DigestingSink::DoWrite(const void *data, size_t len) {
+  if (!digested_)
+    Digest(data, len);
+  return target_.Write(data, len);
+}
+
+void WriteManifest(const std::filesystem::path &path,
+                   const std::vector<ImageRecord> &images) {
+  std::ofstream out(path);
+  if (!out)
+    throw std::runtime_error("Could not open manifest file.");
+
+  out << "{\n  \"images\": [";
+  for (size_t i = 0; i < images.size(); ++i) {
+    const auto &image = images[i];
+    out << (i ? "," : "") << "\n    {\n      \"path\": "
+        << JsonString(image.path.string()) << ",\n      \"size\": "
+        << image.size << ",\n      ";
+    WriteDigests(out, image.digests);
+    out << ",\n      \"sections\": [";
+    for (size_t j = 0; j < image.sections.size(); ++j) {
+      const auto &section = image.sections[j];
+      out << (j ? "," : "") << "\n        {\"name\": "
+          << JsonString(section.name) << ", \"offset\": " << section.offset
+          << ", \"size\": " << section.size << ", ";
+      WriteDigests(out, section.digests);
+      out << "}";
+    }
+    out << "\n      ]\n    }";
+  }
+  out << "\n  ]\n}\n";
+  if (!out)
+    throw errors::FileWriteError("manifest");
+}
+
+} // namespace manifest
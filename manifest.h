@@ -0,0 +1,65 @@
+#pragma once
+
+#include "hash.h"
+#include "sink.h"
+#include <filesystem>
+#include <string>
+#include <vector>
+
+namespace manifest {
+
+struct SectionRecord {
+  std::string name;
+  uint64_t offset = 0;
+  uint64_t size = 0;
+  hashing::Digests digests;
+};
+
+struct ImageRecord {
+  std::filesystem::path path;
+  uint64_t size = 0;
+  hashing::Digests digests;
+  std::vector<SectionRecord> sections;
+};
+
+// Sink that forwards every byte to `target` while hashing it. The whole
+// stream feeds one digest set; bytes written between BeginSection() and
+// EndSection() also feed a per-section set, so section digests cover the
+// copied input data but not its alignment padding. Patching is not supported
+// since the digests require a strictly sequential stream.
+class DigestingSink : public sink::Sink {
+public:
+  explicit DigestingSink(sink::Sink &target) : target_(target) {}
+
+  void BeginSection(std::string_view name) override;
+  void EndSection() override;
+  bool Flush() override;
+  bool Close() override;
+  bool HashesWrites() const override { return true; }
+  void Digest(const void *data, size_t len) override;
+  bool Store(const void *data, size_t len) override;
+  // Digests of everything written so far, tagged with the output path. The
+  // section records move into the result, so call it once, at the end.
+  ImageRecord Finish(const std::filesystem::path &path);
+
+protected:
+  bool DoWrite(const void *data, size_t len) override;
+
+private:
+  sink::Sink &target_;
+  hashing::MultiDigest image_;
+  bool in_section_ = false;
+  bool digested_ = false;
+  SectionRecord current_;
+  hashing::MultiDigest section_;
+  std::vector<SectionRecord> sections_;
+};
+
+// Quotes and escapes `value` as a JSON string literal.
+std::string JsonString(std::string_view value);
+
+// Writes the records as a JSON document: {"images": [...]}.
+void WriteManifest(const std::filesystem::path &path,
+                   const std::vector<ImageRecord> &images);
+
+} // namespace manifest
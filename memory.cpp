@@ -0,0 +1,303 @@
+#include "memory.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <mutex>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <thread>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+namespace {
+
+constexpr size_t MIN_BUFFER_SIZE = 4096;
+// Headroom for code, stdio buffers and allocator overhead that become
+// resident after the limit is set.
+constexpr uint64_t RESERVED_SIZE = 2 << 20;
+
+uint64_t limit = 0;
+uint64_t budget = 0;
+bool huge_pages = false;
+
+constexpr size_t HUGE_PAGE_SIZE = 2 << 20;
+
+// A pool buffer: page-aligned anonymous memory from mmap, so it is never
+// zero-filled in user space and is returned to the kernel on release.
+struct Block {
+  uint8_t *data;
+  size_t capacity;
+};
+
+std::mutex pool_mutex;
+// Bytes of leased buffers and reservations, and of free pool blocks. Guarded
+// by pool_mutex; only held against the budget under a limit.
+uint64_t in_use = 0;
+uint64_t pooled = 0;
+
+// Free blocks, leaked at exit with the rest of the address space.
+std::vector<Block> &FreeBlocks() {
+  static auto *blocks = new std::vector<Block>();
+  return *blocks;
+}
+
+Block Map(size_t size) {
+  size_t capacity =
+      (size + memory::BUFFER_ALIGNMENT - 1) / memory::BUFFER_ALIGNMENT *
+      memory::BUFFER_ALIGNMENT;
+  const bool huge = huge_pages && limit == 0 && size >= HUGE_PAGE_SIZE / 2;
+  if (huge)
+    capacity = (capacity + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+  void *p = mmap(nullptr, capacity, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED)
+    throw std::bad_alloc();
+  if (huge)
+    madvise(p, capacity, MADV_HUGEPAGE);
+  return {static_cast<uint8_t *>(p), capacity};
+}
+
+void Unmap(const Block &block) { munmap(block.data, block.capacity); }
+
+// Unmaps every free block. Called with pool_mutex held.
+void ReleaseFreeBlocks() {
+  auto &blocks = FreeBlocks();
+  for (const auto &block : blocks)
+    Unmap(block);
+  blocks.clear();
+  pooled = 0;
+}
+
+// Takes `bytes` more of the budget, unmapping free blocks to make room.
+// Called with pool_mutex held.
+bool Reserve(uint64_t bytes) {
+  if (limit != 0 && in_use + pooled + bytes > budget) {
+    ReleaseFreeBlocks();
+    if (in_use + bytes > budget)
+      return false;
+  }
+  in_use += bytes;
+  return true;
+}
+
+void Release(uint8_t *data, size_t capacity) {
+  if (!data)
+    return;
+  std::lock_guard<std::mutex> lock(pool_mutex);
+  FreeBlocks().push_back({data, capacity});
+  in_use -= capacity;
+  pooled += capacity;
+}
+
+} // namespace
+
+namespace memory {
+
+void SetLimit(uint64_t bytes) {
+  limit = bytes;
+  budget = 0;
+  if (bytes == 0)
+    return;
+  const uint64_t resident = CurrentRss();
+  if (bytes <= resident + RESERVED_SIZE + MIN_BUFFER_SIZE)
+    throw std::runtime_error(
+        "--max-memory " + std::to_string(bytes) + " is too small: " +
+        std::to_string(resident) + " bytes are already resident and " +
+        std::to_string(RESERVED_SIZE) + " are reserved.");
+  budget = bytes - resident - RESERVED_SIZE;
+}
+
+uint64_t Limit() { return limit; }
+
+uint64_t Available() {
+  if (limit == 0)
+    return UINT64_MAX;
+  std::lock_guard<std::mutex> lock(pool_mutex);
+  return budget - std::min(budget, in_use);
+}
+
+size_t BufferSize(size_t preferred, size_t count) {
+  if (limit == 0)
+    return preferred;
+  const uint64_t share = Available() / std::max<size_t>(count, 1);
+  if (share < MIN_BUFFER_SIZE)
+    throw std::runtime_error("--max-memory leaves less than " +
+                             std::to_string(MIN_BUFFER_SIZE) +
+                             " bytes per buffer.");
+  const size_t rounded =
+      static_cast<size_t>(share - share % MIN_BUFFER_SIZE);
+  return std::min(preferred, rounded);
+}
+
+size_t Workers(size_t tasks, size_t per_worker) {
+  size_t workers = std::min<size_t>(
+      std::max(1u, std::thread::hardware_concurrency()), tasks);
+  if (limit != 0 && per_worker > 0)
+    workers = std::min<size_t>(workers, std::max<uint64_t>(
+                                            1, Available() / per_worker));
+  return std::max<size_t>(workers, 1);
+}
+
+Buffer::Buffer(Buffer &&other) noexcept
+    : data_(std::exchange(other.data_, nullptr)),
+      capacity_(std::exchange(other.capacity_, 0)) {}
+
+Buffer &Buffer::operator=(Buffer &&other) noexcept {
+  if (this != &other) {
+    Release(data_, capacity_);
+    data_ = std::exchange(other.data_, nullptr);
+    capacity_ = std::exchange(other.capacity_, 0);
+  }
+  return *this;
+}
+
+Buffer::~Buffer() { Release(data_, capacity_); }
+
+Buffer Acquire(size_t size) {
+  size = (std::max(size, BUFFER_ALIGNMENT) + BUFFER_ALIGNMENT - 1) /
+         BUFFER_ALIGNMENT * BUFFER_ALIGNMENT;
+  {
+    std::lock_guard<std::mutex> lock(pool_mutex);
+    auto &blocks = FreeBlocks();
+    auto best = blocks.end();
+    for (auto it = blocks.begin(); it != blocks.end(); ++it) {
+      // A larger block would hold more of the budget than was asked for.
+      const bool fits = limit == 0 ? it->capacity >= size
+                                   : it->capacity == size;
+      if (fits && (best == blocks.end() || it->capacity < best->capacity))
+        best = it;
+    }
+    if (best != blocks.end()) {
+      const Block block = *best;
+      *best = blocks.back();
+      blocks.pop_back();
+      pooled -= block.capacity;
+      in_use += block.capacity;
+      return Buffer(block.data, block.capacity);
+    }
+    // Every free block is too small for this request and for any larger
+    // working set that follows.
+    ReleaseFreeBlocks();
+    if (!Reserve(size))
+      throw std::runtime_error(
+          "--max-memory is used up: a " + std::to_string(size) +
+          "-byte buffer does not fit next to the " + std::to_string(in_use) +
+          " bytes already in use.");
+  }
+  Block block;
+  try {
+    block = Map(size);
+  } catch (...) {
+    std::lock_guard<std::mutex> lock(pool_mutex);
+    in_use -= size;
+    throw;
+  }
+  std::lock_guard<std::mutex> lock(pool_mutex);
+  in_use += block.capacity - size;
+  return Buffer(block.data, block.capacity);
+}
+
+Reservation::Reservation(Reservation &&other) noexcept
+    : bytes_(std::exchange(other.bytes_, 0)) {}
+
+Reservation &Reservation::operator=(Reservation &&other) noexcept {
+  if (this != &other) {
+    std::lock_guard<std::mutex> lock(pool_mutex);
+    in_use -= bytes_;
+    bytes_ = std::exchange(other.bytes_, 0);
+  }
+  return *this;
+}
+
+Reservation::~Reservation() {
+  if (bytes_ == 0)
+    return;
+  std::lock_guard<std::mutex> lock(pool_mutex);
+  in_use -= bytes_;
+}
+
+bool Reservation::Resize(uint64_t bytes) {
+  std::lock_guard<std::mutex> lock(pool_mutex);
+  if (bytes <= bytes_)
+    in_use -= bytes_ - bytes;
+  else if (!Reserve(bytes - bytes_))
+    return false;
+  bytes_ = bytes;
+  return true;
+}
+
+void SetHugePages(bool enabled) { huge_pages = enabled; }
+
+uint64_t CurrentRss() {
+  FILE *statm = std::fopen("/proc/self/statm", "r");
+  if (!statm)
+    return 0;
+  unsigned long size = 0, resident = 0;
+  const int fields = std::fscanf(statm, "%lu %lu", &size, &resident);
+  std::fclose(statm);
+  if (fields != 2)
+    return 0;
+  return static_cast<uint64_t>(resident) *
+         static_cast<uint64_t>(sysconf(_SC_PAGESIZE));
+}
+
+// VmHWM rather than getrusage(): ru_maxrss keeps the high-water mark of the
+// image this process exec'd from, so a large parent would count against the
+// limit.
+uint64_t PeakRss() {
+  FILE *status = std::fopen("/proc/self/status", "r");
+  if (!status) {
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+      return 0;
+    return static_cast<uint64_t>(usage.ru_maxrss) * 1024; // KiB on Linux
+  }
+  char line[256];
+  unsigned long peak = 0;
+  while (std::fgets(line, sizeof(line), status))
+    if (std::sscanf(line, "VmHWM: %lu kB", &peak) == 1)
+      break;
+  std::fclose(status);
+  return static_cast<uint64_t>(peak) * 1024;
+}
+
+std::optional<uint64_t> ParseSize(std::string_view text) {
+  if (text.empty())
+    return std::nullopt;
+  uint64_t shift = 0;
+  switch (text.back()) {
+  case 'K':
+  case 'k':
+    shift = 10;
+    break;
+  case 'M':
+  case 'm':
+    shift = 20;
+    break;
+  case 'G':
+  case 'g':
+    shift = 30;
+    break;
+  }
+  if (shift)
+    text.remove_suffix(1);
+  if (text.empty() ||
+      !std::all_of(text.begin(), text.end(),
+                   [](char c) { return c >= '0' && c <= '9'; }))
+    return std::nullopt;
+  uint64_t value = 0;
+  for (char c : text) {
+    if (value > (UINT64_MAX - 9) / 10)
+      return std::nullopt;
+    value = value * 10 + static_cast<uint64_t>(c - '0');
+  }
+  if (value > (UINT64_MAX >> shift))
+    return std::nullopt;
+  return value << shift;
+}
+
+} // namespace memory
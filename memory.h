@@ -0,0 +1,94 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string_view>
+
+namespace memory {
+
+// Process-wide ceiling on resident memory. The part of the ceiling that is not
+// already resident when it is set becomes the budget for the builders'
+// working buffers: copy chunks, hash buffers, spooled streams and concurrent
+// workers all draw from it, so together they stay within it. 0 (the default)
+// means no ceiling.
+void SetLimit(uint64_t bytes);
+uint64_t Limit();
+
+// Part of the budget not held by leased buffers or reservations; UINT64_MAX
+// without a limit.
+uint64_t Available();
+
+// Size for each of `count` buffers that are live at the same time, never more
+// than `preferred`, taken from what is available now. Throws if that cannot
+// fit `count` minimal buffers.
+size_t BufferSize(size_t preferred, size_t count = 1);
+
+// Number of workers to run for `tasks` independent tasks when each worker
+// holds `per_worker` bytes of buffers.
+size_t Workers(size_t tasks, size_t per_worker);
+
+// A share of the budget held for memory that is not a pool buffer, such as a
+// spooled stream. It is returned when the reservation is destroyed.
+class Reservation {
+public:
+  Reservation() = default;
+  Reservation(Reservation &&other) noexcept;
+  Reservation &operator=(Reservation &&other) noexcept;
+  ~Reservation();
+
+  // Sets the reservation to `bytes` in total. Shrinking always succeeds;
+  // growing returns false, keeping what was held, if the budget cannot
+  // cover it.
+  bool Resize(uint64_t bytes);
+  uint64_t size() const { return bytes_; }
+
+private:
+  uint64_t bytes_ = 0;
+};
+
+constexpr size_t BUFFER_ALIGNMENT = 4096;
+
+// Page-aligned, uninitialized working buffer leased from the process-wide
+// pool; it goes back to the pool when the lease is destroyed.
+class Buffer {
+public:
+  Buffer() = default;
+  Buffer(Buffer &&other) noexcept;
+  Buffer &operator=(Buffer &&other) noexcept;
+  ~Buffer();
+
+  uint8_t *get() const { return data_; }
+  size_t capacity() const { return capacity_; }
+
+private:
+  friend Buffer Acquire(size_t size);
+  Buffer(uint8_t *data, size_t capacity) : data_(data), capacity_(capacity) {}
+
+  uint8_t *data_ = nullptr;
+  size_t capacity_ = 0;
+};
+
+// Leases a buffer of at least `size` bytes, O_DIRECT aligned. Buffers are
+// never zeroed and are reused across sections and images: a free buffer that
+// is large enough is handed out again, so once the pool holds the working set
+// of a build, copying another section allocates nothing. When no free buffer
+// fits, the smaller free ones are released before allocating, which keeps the
+// pool at the size of the largest working set rather than the sum of all.
+// Under a limit the lease draws its size from the budget, only a free buffer
+// of exactly that size is reused, and free buffers count against the budget
+// until they are released. Throws if the budget cannot cover the lease.
+Buffer Acquire(size_t size);
+
+// Backs pool buffers of 1 MiB and more with transparent huge pages, rounding
+// them up to 2 MiB. Fewer TLB misses on large copies, at the cost of that
+// rounding; ignored under a memory limit.
+void SetHugePages(bool enabled);
+
+uint64_t CurrentRss();
+uint64_t PeakRss();
+
+// Parses a byte count with an optional K, M or G suffix (powers of 1024).
+std::optional<uint64_t> ParseSize(std::string_view text);
+
+} // namespace memory
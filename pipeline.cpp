@@ -0,0 +1,256 @@
+#include "pipeline.h"
+#include "memory.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace {
+
+constexpr size_t END_OF_INPUT = SIZE_MAX;
+
+// Blocking FIFO of ring slot indices handed from one stage to the next. It
+// never holds more than the ring's slots and one END_OF_INPUT.
+class SlotQueue {
+public:
+  void Push(size_t slot) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      slots_[(head_ + count_++) % slots_.size()] = slot;
+    }
+    ready_.notify_one();
+  }
+
+  size_t Pop() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    ready_.wait(lock, [&] { return count_ > 0; });
+    const size_t slot = slots_[head_];
+    head_ = (head_ + 1) % slots_.size();
+    --count_;
+    return slot;
+  }
+
+private:
+  std::mutex mutex_;
+  std::condition_variable ready_;
+  std::array<size_t, pipeline::RING_DEPTH + 1> slots_{};
+  size_t head_ = 0;
+  size_t count_ = 0;
+};
+
+// One call of pipeline::Parallel handed to a pooled thread.
+struct Task {
+  void (*run)(void *context, size_t index) = nullptr;
+  void *context = nullptr;
+  size_t index = 0;
+};
+
+// Threads that run Tasks. A thread parks when its task is done and is reused
+// by the next Submit(); a new one starts only when none is parked. The pool
+// is never destroyed, so parked threads simply end with the process.
+class ThreadPool {
+public:
+  static ThreadPool &Get() {
+    static auto *pool = new ThreadPool;
+    return *pool;
+  }
+
+  void Submit(Task task) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (parked_.empty()) {
+      auto &worker = workers_.emplace_back();
+      worker.task = task;
+      std::thread([this, &worker] { Loop(worker); }).detach();
+      return;
+    }
+    Worker *worker = parked_.back();
+    parked_.pop_back();
+    worker->task = task;
+    lock.unlock();
+    worker->wake.notify_one();
+  }
+
+private:
+  struct Worker {
+    std::condition_variable wake;
+    Task task;
+  };
+
+  void Loop(Worker &worker) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    for (;;) {
+      worker.wake.wait(lock, [&] { return worker.task.run != nullptr; });
+      const Task task = std::exchange(worker.task, Task{});
+      lock.unlock();
+      task.run(task.context, task.index);
+      lock.lock();
+      parked_.push_back(&worker);
+    }
+  }
+
+  std::mutex mutex_;
+  // A deque, so workers keep their address as the pool grows.
+  std::deque<Worker> workers_;
+  std::vector<Worker *> parked_;
+};
+
+} // namespace
+
+namespace pipeline {
+
+void Parallel(size_t count, const std::function<void(size_t)> &task) {
+  if (count == 0)
+    return;
+  struct Group {
+    const std::function<void(size_t)> &task;
+    std::mutex mutex;
+    std::condition_variable done;
+    size_t running;
+    std::exception_ptr error;
+  } group{task, {}, {}, count - 1, nullptr};
+
+  auto run = [](void *context, size_t index) {
+    auto &group = *static_cast<Group *>(context);
+    std::exception_ptr error;
+    try {
+      group.task(index);
+    } catch (...) {
+      error = std::current_exception();
+    }
+    // Notified under the lock: the caller cannot return and destroy `group`
+    // before this thread lets go of it.
+    std::lock_guard<std::mutex> lock(group.mutex);
+    if (error && !group.error)
+      group.error = error;
+    if (--group.running == 0)
+      group.done.notify_one();
+  };
+  for (size_t i = 0; i + 1 < count; ++i)
+    ThreadPool::Get().Submit({run, &group, i});
+  std::exception_ptr error;
+  try {
+    task(count - 1);
+  } catch (...) {
+    error = std::current_exception();
+  }
+  std::unique_lock<std::mutex> lock(group.mutex);
+  group.done.wait(lock, [&] { return group.running == 0; });
+  if (!error)
+    error = group.error;
+  if (error)
+    std::rethrow_exception(error);
+}
+
+std::optional<size_t> RunJobs(size_t count, size_t workers,
+                              const std::function<bool(size_t)> &job) {
+  std::atomic<size_t> next{0};
+  std::mutex failure_mutex;
+  std::optional<size_t> failed;
+  Parallel(std::min(workers, count), [&](size_t) {
+    for (size_t i = next++; i < count; i = next++) {
+      if (job(i))
+        continue;
+      std::lock_guard<std::mutex> lock(failure_mutex);
+      if (!failed || i < *failed)
+        failed = i;
+    }
+  });
+  return failed;
+}
+
+bool Run(utils::FileWrapper &file, uint64_t size,
+         std::span<const Stage> stages, size_t chunk_size) {
+  if (stages.empty() || stages.size() > MAX_STAGES || chunk_size == 0)
+    return false;
+  if (size == 0 && !file.stream)
+    return true;
+
+  if (size <= chunk_size && !file.stream) {
+    auto buffer = memory::Acquire(static_cast<size_t>(size));
+    const size_t n = static_cast<size_t>(size);
+    if (!file.ReadAt(0, buffer.get(), n))
+      return false;
+    for (const auto &stage : stages) {
+      if (!stage(buffer.get(), n))
+        return false;
+    }
+    return true;
+  }
+
+  std::array<memory::Buffer, RING_DEPTH> ring;
+  std::array<size_t, RING_DEPTH> lengths{};
+  for (auto &buffer : ring)
+    buffer = memory::Acquire(chunk_size);
+
+  // queues[0] holds free slots; queues[i + 1] feeds stages[i].
+  std::array<SlotQueue, MAX_STAGES + 1> queues;
+  const size_t queue_count = stages.size() + 1;
+  for (size_t i = 0; i < RING_DEPTH; ++i)
+    queues[0].Push(i);
+  std::atomic<bool> failed{false};
+
+  auto run_stage = [&](size_t index) {
+    auto &input = queues[index + 1];
+    auto &output = queues[(index + 2) % queue_count];
+    const bool last = index + 1 == stages.size();
+    for (;;) {
+      const size_t slot = input.Pop();
+      if (slot == END_OF_INPUT) {
+        if (!last)
+          output.Push(END_OF_INPUT);
+        return;
+      }
+      if (!failed && !stages[index](ring[slot].get(), lengths[slot]))
+        failed = true;
+      output.Push(slot);
+    }
+  };
+
+  auto read = [&] {
+    uint64_t offset = 0;
+    while ((file.stream || offset < size) && !failed) {
+      const size_t slot = queues[0].Pop();
+      size_t n = chunk_size;
+      bool read = false;
+      if (file.stream) {
+        const auto got = file.ReadNext(ring[slot].get(), chunk_size);
+        read = got.has_value();
+        n = got.value_or(0);
+      } else {
+        n = static_cast<size_t>(std::min<uint64_t>(size - offset, chunk_size));
+        read = file.ReadAt(offset, ring[slot].get(), n);
+      }
+      if (!read || n == 0) {
+        if (!read)
+          failed = true;
+        queues[0].Push(slot);
+        break;
+      }
+      lengths[slot] = n;
+      queues[1].Push(slot);
+      offset += n;
+      if (n < chunk_size && file.stream)
+        break;
+    }
+    if (file.stream)
+      file.size = static_cast<size_t>(offset);
+    queues[1].Push(END_OF_INPUT);
+  };
+  // Index 0 reads; index i + 1 runs stages[i], the last on this thread.
+  Parallel(stages.size() + 1, [&](size_t index) {
+    if (index == 0)
+      read();
+    else
+      run_stage(index - 1);
+  });
+  return !failed;
+}
+
+} // namespace pipeline
@@ -0,0 +1,48 @@
+#pragma once
+
+#include "utils.hpp"
+#include <functional>
+#include <optional>
+#include <span>
+
+namespace pipeline {
+
+// Number of buffers in the ring shared by the stages of one copy.
+constexpr size_t RING_DEPTH = 4;
+// Most stages one copy can pass its chunks through.
+constexpr size_t MAX_STAGES = 4;
+
+// Receives one chunk of input; returns false to abort the copy.
+using Stage = std::function<bool(const uint8_t *data, size_t len)>;
+
+// Calls `task(i)` for every i below `count` at once, on threads kept in a
+// process-wide pool, and returns when every call has. `task(count - 1)` runs
+// on the calling thread. The pool only grows, so once a call as wide has
+// been made no thread is started. A call that throws does not stop the
+// others; once all have returned, the first exception is rethrown.
+void Parallel(size_t count, const std::function<void(size_t)> &task);
+
+// Runs `job(i)` for every i below `count` on `workers` threads (see
+// Parallel), handing the indices out in order. Every job runs even after one
+// has failed. Returns the lowest i whose job returned false, or nullopt when
+// all succeeded.
+std::optional<size_t> RunJobs(size_t count, size_t workers,
+                              const std::function<bool(size_t)> &job);
+
+// Reads the first `size` bytes of `file` into a ring of buffers leased from
+// the memory pool, at most `chunk_size` bytes each, and passes every chunk
+// through `stages` (at most MAX_STAGES) in order. The reader and every stage
+// but the last run on pooled threads (see Parallel), so disk reads, hashing
+// and writes overlap; the last stage runs on the calling thread. Chunks reach
+// each stage in input order. Inputs that fit in one chunk are processed
+// inline on the calling thread. A stream is read to its end whatever `size`
+// says, and its `size` is set to the bytes read. Returns false if the input
+// cannot be read or any stage fails.
+bool Run(utils::FileWrapper &file, uint64_t size,
+         std::span<const Stage> stages, size_t chunk_size);
+inline bool Run(utils::FileWrapper &file, uint64_t size, const Stage &stage,
+                size_t chunk_size) {
+  return Run(file, size, std::span<const Stage>(&stage, 1), chunk_size);
+}
+
+} // namespace pipeline
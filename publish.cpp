@@ -0,0 +1,101 @@
+#include "publish.h"
+
+#include <cerrno>
+#include <cstdlib>
+#include <fcntl.h>
+#include <stdexcept>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+bool sync_outputs = false;
+
+std::filesystem::path Directory(const std::filesystem::path &path) {
+  const auto parent = path.parent_path();
+  return parent.empty() ? std::filesystem::path(".") : parent;
+}
+
+// Mode for a new output: that of the file it replaces, else what open(2)
+// with 0644 would give under the current umask.
+mode_t OutputMode(const std::filesystem::path &path) {
+  struct stat st;
+  if (stat(path.c_str(), &st) == 0)
+    return st.st_mode & 07777;
+  static const mode_t mask = [] {
+    const mode_t current = umask(0);
+    umask(current);
+    return current;
+  }();
+  return 0644 & ~mask;
+}
+
+bool SyncDirectory(const std::filesystem::path &dir) {
+  const int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0)
+    return false;
+  const bool ok = fsync(fd) == 0;
+  close(fd);
+  return ok;
+}
+
+} // namespace
+
+namespace publish {
+
+void SetSync(bool sync) { sync_outputs = sync; }
+
+bool Sync() { return sync_outputs; }
+
+void CheckDestination(const std::filesystem::path &path) {
+  const auto dir = Directory(path);
+  if (access(dir.c_str(), W_OK | X_OK) != 0)
+    throw std::runtime_error("Cannot write to " + dir.string() + " for " +
+                             path.string());
+}
+
+StagedFile::StagedFile(const std::filesystem::path &path) : path_(path) {
+  // Follow symlinks, dangling ones included, the way open(2) would.
+  std::error_code ec;
+  for (int hops = 0; hops < 40 && std::filesystem::is_symlink(path_, ec);
+       ++hops) {
+    auto target = std::filesystem::read_symlink(path_, ec);
+    if (ec)
+      break;
+    path_ = target.is_absolute() ? target : path_.parent_path() / target;
+  }
+  auto pattern = Directory(path_) / ".";
+  pattern += path_.filename();
+  pattern += ".XXXXXX";
+  std::string name = pattern.string();
+  fd_ = mkostemp(name.data(), O_CLOEXEC);
+  if (fd_ < 0)
+    throw std::runtime_error("Could not open output file: " + path.string());
+  temp_ = name;
+  if (fchmod(fd_, OutputMode(path_)) != 0) {
+    close(fd_);
+    unlink(temp_.c_str());
+    throw std::runtime_error("Could not open output file: " + path.string());
+  }
+}
+
+StagedFile::~StagedFile() {
+  if (fd_ >= 0)
+    close(fd_);
+  if (!committed_)
+    unlink(temp_.c_str());
+}
+
+bool StagedFile::Commit() {
+  if (sync_outputs && fsync(fd_) != 0)
+    return false;
+  const bool closed = close(fd_) == 0;
+  fd_ = -1;
+  if (!closed || rename(temp_.c_str(), path_.c_str()) != 0)
+    return false;
+  committed_ = true;
+  return !sync_outputs || SyncDirectory(Directory(path_));
+}
+
+} // namespace publish
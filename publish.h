@@ -0,0 +1,42 @@
+#pragma once
+
+#include <filesystem>
+
+namespace publish {
+
+// Process-wide durability policy. When set, every published output is synced
+// to disk before it is renamed into place, and its directory after.
+void SetSync(bool sync);
+bool Sync();
+
+// Throws unless an output could be published at `path`: its directory must
+// exist and be writable. Lets builders fail before reading or writing
+// anything.
+void CheckDestination(const std::filesystem::path &path);
+
+// An output written under a temporary name in the destination's directory and
+// renamed over the destination by Commit(). Destroyed without a successful
+// Commit(), it removes the temporary, so a failed build leaves the previous
+// output untouched and never a truncated one. A destination that is a symlink
+// is replaced at its target.
+class StagedFile {
+public:
+  // Creates the temporary. Throws if it cannot be created.
+  explicit StagedFile(const std::filesystem::path &path);
+  ~StagedFile();
+  StagedFile(const StagedFile &) = delete;
+  StagedFile &operator=(const StagedFile &) = delete;
+
+  int fd() const { return fd_; }
+  // Syncs when the policy asks for it, closes the descriptor and renames the
+  // temporary into place. Returns false if any step fails.
+  bool Commit();
+
+private:
+  std::filesystem::path path_;
+  std::filesystem::path temp_;
+  int fd_ = -1;
+  bool committed_ = false;
+};
+
+} // namespace publish
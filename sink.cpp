@@ -0,0 +1,561 @@
+#include "sink.h"
+#include "memory.h"
+#include "pipeline.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+constexpr size_t FILE_BUFFER_SIZE = 256 * 1024;
+constexpr size_t UPDATE_CHUNK_SIZE = 1024 * 1024;
+
+// Android sparse image format (libsparse sparse_format.h).
+constexpr uint32_t SPARSE_MAGIC = 0xed26ff3a;
+constexpr size_t SPARSE_HEADER_SIZE = 28;
+constexpr size_t SPARSE_CHUNK_HEADER_SIZE = 12;
+constexpr uint16_t CHUNK_TYPE_RAW = 0xCAC1;
+constexpr uint16_t CHUNK_TYPE_FILL = 0xCAC2;
+// Chunk sizes in bytes, header included, are 32-bit.
+constexpr uint32_t MAX_RAW_CHUNK_BLOCKS =
+    (UINT32_MAX - SPARSE_CHUNK_HEADER_SIZE) /
+    sink::SparseSink::SPARSE_BLOCK_SIZE;
+
+void StoreU16(uint8_t *bytes, uint16_t value) {
+  bytes[0] = static_cast<uint8_t>(value & 0xFF);
+  bytes[1] = static_cast<uint8_t>(value >> 8);
+}
+
+std::array<uint8_t, SPARSE_HEADER_SIZE> SparseHeader(uint32_t blocks,
+                                                     uint32_t chunks) {
+  std::array<uint8_t, SPARSE_HEADER_SIZE> header{};
+  utils::StoreU32(header.data(), SPARSE_MAGIC);
+  StoreU16(header.data() + 4, 1); // major version
+  StoreU16(header.data() + 6, 0); // minor version
+  StoreU16(header.data() + 8, SPARSE_HEADER_SIZE);
+  StoreU16(header.data() + 10, SPARSE_CHUNK_HEADER_SIZE);
+  utils::StoreU32(header.data() + 12, sink::SparseSink::SPARSE_BLOCK_SIZE);
+  utils::StoreU32(header.data() + 16, blocks);
+  utils::StoreU32(header.data() + 20, chunks);
+  // The image checksum at 24 is optional and left 0.
+  return header;
+}
+
+bool WriteAll(int fd, const uint8_t *data, size_t len) {
+  while (len > 0) {
+    const ssize_t n = write(fd, data, len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    data += n;
+    len -= static_cast<size_t>(n);
+  }
+  return true;
+}
+
+bool PwriteAll(int fd, const uint8_t *data, size_t len, uint64_t offset) {
+  while (len > 0) {
+    const ssize_t n = pwrite(fd, data, len, static_cast<off_t>(offset));
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    data += n;
+    len -= static_cast<size_t>(n);
+    offset += static_cast<uint64_t>(n);
+  }
+  return true;
+}
+
+} // namespace
+
+namespace sink {
+
+bool Sink::WriteU32(uint32_t value) {
+  std::array<uint8_t, 4> bytes;
+  utils::StoreU32(bytes.data(), value);
+  return Write(bytes.data(), bytes.size());
+}
+
+bool Sink::WriteU64(uint64_t value) {
+  std::array<uint8_t, 8> bytes;
+  utils::StoreU32(bytes.data(), static_cast<uint32_t>(value));
+  utils::StoreU32(bytes.data() + 4, static_cast<uint32_t>(value >> 32));
+  return Write(bytes.data(), bytes.size());
+}
+
+bool Sink::Pad(size_t alignment) {
+  if (alignment == 0)
+    return ok_;
+  static constexpr std::array<uint8_t, 4096> zeros{};
+  uint64_t pad = (alignment - position_ % alignment) % alignment;
+  while (pad > 0) {
+    const size_t n = static_cast<size_t>(std::min<uint64_t>(pad, zeros.size()));
+    if (!Write(zeros.data(), n))
+      return false;
+    pad -= n;
+  }
+  return ok_;
+}
+
+bool Sink::Patch(uint64_t, const void *, size_t) { return false; }
+
+FdSink::~FdSink() {
+  if (owned_ && fd_ >= 0)
+    close(fd_);
+}
+
+bool FdSink::CanPatch() const { return lseek(fd_, 0, SEEK_CUR) >= 0; }
+
+bool FdSink::Patch(uint64_t offset, const void *data, size_t len) {
+  if (offset + len > Position())
+    return false;
+  return PwriteAll(fd_, static_cast<const uint8_t *>(data), len, offset);
+}
+
+bool FdSink::Flush() { return Ok(); }
+
+bool FdSink::DoWrite(const void *data, size_t len) {
+  return WriteAll(fd_, static_cast<const uint8_t *>(data), len);
+}
+
+std::unique_ptr<FileSink> FileSink::Create(const std::filesystem::path &path) {
+  auto staged = std::make_unique<publish::StagedFile>(path);
+  const int fd = staged->fd();
+  return std::unique_ptr<FileSink>(new FileSink(
+      fd, std::move(staged), memory::BufferSize(FILE_BUFFER_SIZE)));
+}
+
+std::unique_ptr<FileSink> FileSink::Wrap(int fd) {
+  return std::unique_ptr<FileSink>(
+      new FileSink(fd, nullptr, memory::BufferSize(FILE_BUFFER_SIZE)));
+}
+
+FileSink::FileSink(int fd, std::unique_ptr<publish::StagedFile> staged,
+                   size_t buffer_size)
+    : FdSink(fd), staged_(std::move(staged)),
+      buffer_(memory::Acquire(buffer_size)), buffer_size_(buffer_size) {}
+
+FileSink::~FileSink() {
+  // An unpublished staged file is about to be removed; only stdout needs the
+  // tail.
+  if (!staged_)
+    Drain();
+}
+
+bool FileSink::Drain() {
+  if (used_ == 0)
+    return true;
+  const bool ok = WriteAll(fd(), buffer_.get(), used_);
+  used_ = 0;
+  return ok;
+}
+
+bool FileSink::DoWrite(const void *data, size_t len) {
+  const auto *bytes = static_cast<const uint8_t *>(data);
+  if (used_ + len > buffer_size_) {
+    if (!Drain())
+      return false;
+    // Large writes skip the buffer entirely.
+    if (len >= buffer_size_)
+      return WriteAll(fd(), bytes, len);
+  }
+  std::memcpy(buffer_.get() + used_, bytes, len);
+  used_ += len;
+  return true;
+}
+
+bool FileSink::Patch(uint64_t offset, const void *data, size_t len) {
+  if (!Drain()) {
+    Fail();
+    return false;
+  }
+  return FdSink::Patch(offset, data, len);
+}
+
+bool FileSink::Flush() {
+  if (!Drain())
+    Fail();
+  return FdSink::Flush();
+}
+
+bool FileSink::Close() {
+  if (!Flush())
+    return false;
+  if (staged_ && !staged_->Commit())
+    Fail();
+  return Ok();
+}
+
+bool MemorySink::Patch(uint64_t offset, const void *data, size_t len) {
+  if (offset + len > data_.size())
+    return false;
+  std::memcpy(data_.data() + offset, data, len);
+  return true;
+}
+
+bool MemorySink::DoWrite(const void *data, size_t len) {
+  const auto *bytes = static_cast<const uint8_t *>(data);
+  data_.insert(data_.end(), bytes, bytes + len);
+  return true;
+}
+
+std::unique_ptr<UpdateSink>
+UpdateSink::Open(const std::filesystem::path &path) {
+  struct stat st;
+  const bool device = stat(path.c_str(), &st) == 0 && S_ISBLK(st.st_mode);
+  int fd = -1;
+  if (device)
+    fd = open(path.c_str(), O_RDWR | O_CLOEXEC | O_DIRECT);
+  // Some devices (and every regular file here) go through the page cache.
+  if (fd < 0)
+    fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (fd < 0)
+    return nullptr;
+  uint64_t size = 0;
+  bool sized = false;
+  if (device)
+    sized = ioctl(fd, BLKGETSIZE64, &size) == 0;
+  else if (fstat(fd, &st) == 0) {
+    size = static_cast<uint64_t>(st.st_size);
+    sized = true;
+  }
+  if (!sized) {
+    close(fd);
+    return nullptr;
+  }
+  // One chunk of new bytes and one of existing bytes are live at a time.
+  size_t chunk_size = memory::BufferSize(UPDATE_CHUNK_SIZE, 2);
+  chunk_size = std::max(chunk_size - chunk_size % UPDATE_BLOCK_SIZE, UPDATE_BLOCK_SIZE);
+  return std::unique_ptr<UpdateSink>(
+      new UpdateSink(fd, device, size, chunk_size));
+}
+
+UpdateSink::UpdateSink(int fd, bool device, uint64_t existing_size,
+                       size_t chunk_size)
+    : fd_(fd), device_(device), existing_size_(existing_size),
+      chunk_size_(chunk_size), fresh_(memory::Acquire(chunk_size)),
+      current_(memory::Acquire(chunk_size)) {}
+
+UpdateSink::~UpdateSink() { close(fd_); }
+
+bool UpdateSink::Drain() {
+  if (used_ == 0)
+    return true;
+  const size_t span = (used_ + UPDATE_BLOCK_SIZE - 1) / UPDATE_BLOCK_SIZE * UPDATE_BLOCK_SIZE;
+  // Bytes the output already holds under this chunk; nothing past its end.
+  size_t have = 0;
+  if (chunk_offset_ < existing_size_) {
+    have = static_cast<size_t>(
+        std::min<uint64_t>(span, existing_size_ - chunk_offset_));
+    if (!utils::PreadAll(fd_, chunk_offset_, current_.get(), have))
+      return false;
+  }
+  // Devices are only written in whole blocks: a partial last block keeps the
+  // bytes the device has after the image.
+  size_t end = used_;
+  if (device_ && span > used_) {
+    if (have < span)
+      return false;
+    std::memcpy(fresh_.get() + used_, current_.get() + used_, span - used_);
+    end = span;
+  }
+
+  auto write = [&](size_t from, size_t to) {
+    return PwriteAll(fd_, fresh_.get() + from, to - from, chunk_offset_ + from);
+  };
+  std::optional<size_t> run;
+  for (size_t start = 0; start < end; start += UPDATE_BLOCK_SIZE) {
+    const size_t len = std::min(UPDATE_BLOCK_SIZE, end - start);
+    // glibc's memcmp compares a block with wide vector loads and stops at the
+    // first difference.
+    const bool same =
+        start + len <= have &&
+        std::memcmp(fresh_.get() + start, current_.get() + start, len) == 0;
+    if (same) {
+      ++unchanged_;
+      if (run && !write(*run, start))
+        return false;
+      run.reset();
+    } else {
+      ++changed_;
+      if (!run)
+        run = start;
+    }
+  }
+  if (run && !write(*run, end))
+    return false;
+  chunk_offset_ += used_;
+  used_ = 0;
+  return true;
+}
+
+bool UpdateSink::DoWrite(const void *data, size_t len) {
+  const auto *bytes = static_cast<const uint8_t *>(data);
+  while (len > 0) {
+    const size_t n = std::min(len, chunk_size_ - used_);
+    std::memcpy(fresh_.get() + used_, bytes, n);
+    used_ += n;
+    bytes += n;
+    len -= n;
+    if (used_ == chunk_size_ && !Drain())
+      return false;
+  }
+  return true;
+}
+
+bool UpdateSink::Flush() {
+  if (!Ok())
+    return false;
+  if (!Drain() ||
+      (!device_ && existing_size_ > Position() &&
+       ftruncate(fd_, static_cast<off_t>(Position())) != 0) ||
+      fdatasync(fd_) != 0)
+    Fail();
+  return Ok();
+}
+
+std::string UpdateSink::Summary() const {
+  return std::to_string(changed_) + " blocks changed, " +
+         std::to_string(unchanged_) + " unchanged";
+}
+
+SparseSink::SparseSink(std::unique_ptr<Sink> out) : out_(std::move(out)) {
+  // Counts stay 0 until Close() patches them in.
+  const auto header = SparseHeader(0, 0);
+  if (!out_->Write(header.data(), header.size()))
+    Fail();
+}
+
+bool SparseSink::DoWrite(const void *data, size_t len) {
+  const auto *bytes = static_cast<const uint8_t *>(data);
+  // Whole blocks are classified where they are; only partial ones are
+  // collected in block_.
+  while (len > 0) {
+    if (used_ == 0 && len >= SPARSE_BLOCK_SIZE) {
+      if (!AddBlock(bytes))
+        return false;
+      bytes += SPARSE_BLOCK_SIZE;
+      len -= SPARSE_BLOCK_SIZE;
+      continue;
+    }
+    const size_t n = std::min(len, SPARSE_BLOCK_SIZE - used_);
+    std::memcpy(block_.data() + used_, bytes, n);
+    used_ += n;
+    bytes += n;
+    len -= n;
+    if (used_ == SPARSE_BLOCK_SIZE) {
+      used_ = 0;
+      if (!AddBlock(block_.data()))
+        return false;
+    }
+  }
+  return true;
+}
+
+bool SparseSink::AddBlock(const uint8_t *block) {
+  // A block equal to itself shifted by one word repeats that word.
+  const bool fill = std::memcmp(block, block + 4, SPARSE_BLOCK_SIZE - 4) == 0;
+  const uint32_t value = utils::ReadU32(block);
+  if (chunk_blocks_ > 0 &&
+      (raw_ ? fill || chunk_blocks_ == MAX_RAW_CHUNK_BLOCKS
+            : !fill || value != fill_value_) &&
+      !EndChunk())
+    return false;
+  if (chunk_blocks_ == 0) {
+    raw_ = !fill;
+    fill_value_ = value;
+    if (raw_) {
+      // The header is patched in by EndChunk() once the run is complete.
+      static constexpr std::array<uint8_t, SPARSE_CHUNK_HEADER_SIZE> blank{};
+      chunk_header_ = out_->Position();
+      raw_runs_.push_back({blocks_, 0, chunk_header_ + blank.size()});
+      if (!out_->Write(blank.data(), blank.size()))
+        return false;
+    }
+  }
+  if (raw_) {
+    if (!out_->Write(block, SPARSE_BLOCK_SIZE))
+      return false;
+    ++raw_runs_.back().blocks;
+  } else {
+    ++fill_blocks_;
+  }
+  ++chunk_blocks_;
+  ++blocks_;
+  return true;
+}
+
+bool SparseSink::EndChunk() {
+  if (chunk_blocks_ == 0)
+    return true;
+  std::array<uint8_t, SPARSE_CHUNK_HEADER_SIZE + 4> header{};
+  StoreU16(header.data(), raw_ ? CHUNK_TYPE_RAW : CHUNK_TYPE_FILL);
+  utils::StoreU32(header.data() + 4, chunk_blocks_);
+  const uint32_t body = raw_ ? chunk_blocks_ * SPARSE_BLOCK_SIZE : 4;
+  utils::StoreU32(header.data() + 8, SPARSE_CHUNK_HEADER_SIZE + body);
+  utils::StoreU32(header.data() + SPARSE_CHUNK_HEADER_SIZE, fill_value_);
+  ++chunks_;
+  chunk_blocks_ = 0;
+  if (raw_)
+    return out_->Patch(chunk_header_, header.data(), SPARSE_CHUNK_HEADER_SIZE);
+  return out_->Write(header.data(), header.size());
+}
+
+bool SparseSink::Patch(uint64_t offset, const void *data, size_t len) {
+  if (offset > Position() || len > Position() - offset)
+    return false;
+  const auto *bytes = static_cast<const uint8_t *>(data);
+  while (len > 0) {
+    const uint64_t block = offset / SPARSE_BLOCK_SIZE;
+    if (block == blocks_) {
+      std::memcpy(block_.data() + offset % SPARSE_BLOCK_SIZE, bytes, len);
+      return true;
+    }
+    // Runs are in block order; bytes that went into FILL chunks are gone.
+    auto run = std::upper_bound(
+        raw_runs_.begin(), raw_runs_.end(), block,
+        [](uint64_t b, const RawRun &r) { return b < r.first_block; });
+    if (run == raw_runs_.begin())
+      return false;
+    --run;
+    const uint64_t start = run->first_block * SPARSE_BLOCK_SIZE;
+    const uint64_t end = start + run->blocks * SPARSE_BLOCK_SIZE;
+    if (offset >= end)
+      return false;
+    const size_t n = static_cast<size_t>(std::min<uint64_t>(len, end - offset));
+    if (!out_->Patch(run->offset + (offset - start), bytes, n)) {
+      Fail();
+      return false;
+    }
+    offset += n;
+    bytes += n;
+    len -= n;
+  }
+  return true;
+}
+
+bool SparseSink::Flush() {
+  if (!out_->Flush())
+    Fail();
+  return Ok();
+}
+
+bool SparseSink::Close() {
+  if (Ok() && used_ > 0) {
+    std::memset(block_.data() + used_, 0, SPARSE_BLOCK_SIZE - used_);
+    used_ = 0;
+    if (!AddBlock(block_.data()))
+      Fail();
+  }
+  if (Ok() && !EndChunk())
+    Fail();
+  const auto header = SparseHeader(static_cast<uint32_t>(blocks_), chunks_);
+  if (Ok() && !out_->Patch(0, header.data(), header.size()))
+    Fail();
+  // A failed output is left unpublished.
+  if (Ok() && !out_->Close())
+    Fail();
+  return Ok();
+}
+
+std::string SparseSink::Summary() const {
+  std::string summary = std::to_string(blocks_) + " blocks in " +
+                        std::to_string(chunks_) + " sparse chunks, " +
+                        std::to_string(fill_blocks_) + " filled";
+  const auto inner = out_->Summary();
+  return inner.empty() ? summary : inner + ", " + summary;
+}
+
+bool CopyFile(utils::FileWrapper &file, std::span<Sink *const> outs,
+              size_t chunk_size) {
+  const bool hashing = std::any_of(outs.begin(), outs.end(), [](Sink *out) {
+    return out->HashesWrites();
+  });
+  const std::array<pipeline::Stage, 2> stages = {
+      [&](const uint8_t *data, size_t len) {
+        for (auto *out : outs) {
+          if (out->HashesWrites())
+            out->Digest(data, len);
+        }
+        return true;
+      },
+      [&](const uint8_t *data, size_t len) {
+        bool ok = true;
+        for (auto *out : outs)
+          ok = out->Store(data, len) && ok;
+        return ok;
+      }};
+  // Without a hashing sink the digest stage would only cost a thread.
+  if (!pipeline::Run(file, file.size,
+                     std::span(stages).subspan(hashing ? 0 : 1), chunk_size))
+    return false;
+  for (auto *out : outs) {
+    if (!out->Ok())
+      return false;
+  }
+  return true;
+}
+
+bool CopyFile(utils::FileWrapper &file, Sink &out, size_t chunk_size) {
+  Sink *const outs[] = {&out};
+  return CopyFile(file, outs, chunk_size);
+}
+
+bool IsBlockDevice(const std::filesystem::path &path) {
+  struct stat st;
+  return stat(path.c_str(), &st) == 0 && S_ISBLK(st.st_mode);
+}
+
+bool IsStreamOutput(const std::filesystem::path &path) {
+  if (path == "-")
+    return true;
+  struct stat st;
+  return stat(path.c_str(), &st) == 0 &&
+         (S_ISFIFO(st.st_mode) || S_ISSOCK(st.st_mode) || S_ISCHR(st.st_mode));
+}
+
+void CheckOutput(const std::filesystem::path &path, bool dry_run,
+                 bool in_place, bool sparse) {
+  if (sparse && !dry_run &&
+      (in_place || IsStreamOutput(path) || IsBlockDevice(path)))
+    throw std::runtime_error("A sparse image needs a new regular output "
+                             "file, not stdout, a pipe, a device or an "
+                             "in-place update: " +
+                             path.string());
+  if (dry_run || IsStreamOutput(path) || IsBlockDevice(path))
+    return;
+  if (in_place && access(path.c_str(), F_OK) == 0) {
+    if (access(path.c_str(), R_OK | W_OK) != 0)
+      throw std::runtime_error("Cannot update " + path.string());
+    return;
+  }
+  publish::CheckDestination(path);
+}
+
+std::unique_ptr<Sink> OpenOutput(const std::filesystem::path &path,
+                                 bool dry_run, bool in_place, bool sparse) {
+  if (sparse)
+    return std::make_unique<SparseSink>(OpenOutput(path, dry_run, in_place));
+  if (dry_run)
+    return std::make_unique<NullSink>();
+  if (path == "-")
+    return FileSink::Wrap(STDOUT_FILENO);
+  if (in_place || IsBlockDevice(path)) {
+    auto update = UpdateSink::Open(path);
+    if (!update)
+      throw std::runtime_error("Could not open output for update: " +
+                               path.string());
+    return update;
+  }
+  return FileSink::Create(path);
+}
+
+} // namespace sink
@@ -0,0 +1,268 @@
+#pragma once
+
+#include "memory.h"
+#include "publish.h"
+#include "utils.hpp"
+#include <span>
+#include <string_view>
+
+namespace sink {
+
+// Destination for image bytes. Sinks are append-only and track their own
+// position, so padding and offset bookkeeping never have to query the
+// underlying file. Errors are sticky: once a write fails, Ok() stays false and
+// further writes are dropped.
+class Sink {
+public:
+  virtual ~Sink() = default;
+
+  bool Write(const void *data, size_t len) {
+    if (ok_ && len > 0) {
+      ok_ = DoWrite(data, len);
+      position_ += len;
+    }
+    return ok_;
+  }
+  bool WriteU32(uint32_t value);
+  bool WriteU64(uint64_t value);
+  // Writes zeros up to the next multiple of `alignment`.
+  bool Pad(size_t alignment);
+
+  uint64_t Position() const { return position_; }
+  bool Ok() const { return ok_; }
+
+  // Overwrites bytes that were already written. Only sinks backed by
+  // random-access storage support it.
+  virtual bool CanPatch() const { return false; }
+  virtual bool Patch(uint64_t offset, const void *data, size_t len);
+
+  virtual bool Flush() { return ok_; }
+  // Finishes the output: flushes it and publishes outputs that are staged
+  // under a temporary name. Nothing may be written afterwards.
+  virtual bool Close() { return Flush(); }
+  // One line on what the last Flush() did, for sinks with something to
+  // report (byte counts of dry runs, blocks rewritten in place); else empty.
+  virtual std::string Summary() const { return {}; }
+
+  // Section markers. Sinks that care (such as the digesting tee) record the
+  // bytes written in between under `name`; the others ignore them.
+  virtual void BeginSection(std::string_view /*name*/) {}
+  virtual void EndSection() {}
+
+  // Lets a copy pipeline hash on a stage of its own. For sinks that hash what
+  // they are given, Digest() absorbs a chunk and a later Store() of the same
+  // chunk only forwards it; for the others Store() is a plain Write().
+  virtual bool HashesWrites() const { return false; }
+  virtual void Digest(const void * /*data*/, size_t /*len*/) {}
+  virtual bool Store(const void *data, size_t len) { return Write(data, len); }
+
+protected:
+  virtual bool DoWrite(const void *data, size_t len) = 0;
+  void Fail() { ok_ = false; }
+
+private:
+  uint64_t position_ = 0;
+  bool ok_ = true;
+};
+
+// Unbuffered sink over a file descriptor, e.g. stdout. Takes ownership of the
+// descriptor only when `owned` is set.
+class FdSink : public Sink {
+public:
+  explicit FdSink(int fd, bool owned = false) : fd_(fd), owned_(owned) {}
+  ~FdSink() override;
+  FdSink(const FdSink &) = delete;
+  FdSink &operator=(const FdSink &) = delete;
+
+  bool CanPatch() const override;
+  bool Patch(uint64_t offset, const void *data, size_t len) override;
+  bool Flush() override;
+
+protected:
+  bool DoWrite(const void *data, size_t len) override;
+  int fd() const { return fd_; }
+
+private:
+  int fd_;
+  bool owned_;
+};
+
+// Output file opened by path, with writes coalesced in a user-space buffer.
+class FileSink : public FdSink {
+public:
+  // Stages a new file for `path` (see publish::StagedFile) that replaces it
+  // on Close(). Throws if it cannot be created.
+  static std::unique_ptr<FileSink> Create(const std::filesystem::path &path);
+  // Buffers writes to an open descriptor it does not own, such as stdout.
+  static std::unique_ptr<FileSink> Wrap(int fd);
+  ~FileSink() override;
+
+  bool Patch(uint64_t offset, const void *data, size_t len) override;
+  bool Flush() override;
+  bool Close() override;
+
+protected:
+  bool DoWrite(const void *data, size_t len) override;
+
+private:
+  FileSink(int fd, std::unique_ptr<publish::StagedFile> staged,
+           size_t buffer_size);
+  bool Drain();
+
+  std::unique_ptr<publish::StagedFile> staged_;
+  memory::Buffer buffer_;
+  size_t buffer_size_;
+  size_t used_ = 0;
+};
+
+// Collects the image in memory.
+class MemorySink : public Sink {
+public:
+  bool CanPatch() const override { return true; }
+  bool Patch(uint64_t offset, const void *data, size_t len) override;
+  const std::vector<uint8_t> &data() const { return data_; }
+
+protected:
+  bool DoWrite(const void *data, size_t len) override;
+
+private:
+  std::vector<uint8_t> data_;
+};
+
+// Discards everything and only counts bytes; used by --dry-run.
+class NullSink : public Sink {
+public:
+  bool CanPatch() const override { return true; }
+  bool Patch(uint64_t offset, const void *, size_t len) override {
+    return offset + len <= Position();
+  }
+
+  std::string Summary() const override {
+    return std::to_string(Position()) + " bytes";
+  }
+
+protected:
+  bool DoWrite(const void *, size_t) override { return true; }
+};
+
+// Rewrites an existing image in place, one UPDATE_BLOCK_SIZE block at a
+// time: each chunk of new bytes is compared with what the output already holds
+// at that offset and only the blocks that differ are written back, so a small
+// change to a flashed partition costs a few blocks of writes instead of the
+// whole image. Block devices are opened with O_DIRECT where supported, which
+// is why buffers and writes are block aligned; a trailing partial block is
+// merged with the existing bytes. Regular files are truncated to the new
+// size. Flush() syncs the output.
+class UpdateSink : public Sink {
+public:
+  static constexpr size_t UPDATE_BLOCK_SIZE = 4096;
+
+  // Opens `path` for update, creating a regular file if it does not exist.
+  // Returns nullptr if it cannot be opened.
+  static std::unique_ptr<UpdateSink> Open(const std::filesystem::path &path);
+  ~UpdateSink() override;
+  UpdateSink(const UpdateSink &) = delete;
+  UpdateSink &operator=(const UpdateSink &) = delete;
+
+  bool Flush() override;
+  std::string Summary() const override;
+
+protected:
+  bool DoWrite(const void *data, size_t len) override;
+
+private:
+  UpdateSink(int fd, bool device, uint64_t existing_size, size_t chunk_size);
+  bool Drain();
+
+  int fd_;
+  bool device_;
+  // Bytes the output held before the update (the device size for devices).
+  uint64_t existing_size_;
+  size_t chunk_size_;
+  memory::Buffer fresh_;
+  memory::Buffer current_;
+  size_t used_ = 0;
+  uint64_t chunk_offset_ = 0;
+  uint64_t changed_ = 0;
+  uint64_t unchanged_ = 0;
+};
+
+// Writes the image it is given in the Android sparse format that fastboot
+// flashes, one SPARSE_BLOCK_SIZE block at a time. A block that repeats one
+// 32-bit word, such as the zero padding between sections, joins a FILL chunk
+// of 16 bytes; runs of other blocks are copied into RAW chunks. Chunk and file
+// headers are patched in once their counts are known, so `out` must support
+// Patch(). A trailing partial block is padded with zeros. Patch() reaches the
+// bytes that went into RAW chunks and the block still being collected.
+class SparseSink : public Sink {
+public:
+  static constexpr uint32_t SPARSE_BLOCK_SIZE = 4096;
+
+  explicit SparseSink(std::unique_ptr<Sink> out);
+
+  bool CanPatch() const override { return out_->CanPatch(); }
+  bool Patch(uint64_t offset, const void *data, size_t len) override;
+  bool Flush() override;
+  bool Close() override;
+  std::string Summary() const override;
+
+protected:
+  bool DoWrite(const void *data, size_t len) override;
+
+private:
+  // Image blocks stored back to back in a RAW chunk, at `offset` in `out_`.
+  struct RawRun {
+    uint64_t first_block;
+    uint64_t blocks;
+    uint64_t offset;
+  };
+
+  bool AddBlock(const uint8_t *block);
+  bool EndChunk();
+
+  std::unique_ptr<Sink> out_;
+  std::array<uint8_t, SPARSE_BLOCK_SIZE> block_;
+  size_t used_ = 0;
+  // Whole blocks passed to AddBlock() so far, and chunks finished.
+  uint64_t blocks_ = 0;
+  uint32_t chunks_ = 0;
+  uint64_t fill_blocks_ = 0;
+  // The chunk being extended, if chunk_blocks_ is non-zero: RAW with its
+  // header at chunk_header_, or FILL with fill_value_.
+  bool raw_ = false;
+  uint32_t fill_value_ = 0;
+  uint32_t chunk_blocks_ = 0;
+  uint64_t chunk_header_ = 0;
+  std::vector<RawRun> raw_runs_;
+};
+
+// Streams the whole file into every sink in `outs` through a pipeline::Run
+// ring of buffers of at most `chunk_size` bytes, so memory use does not grow
+// with the input. Hashing sinks get their digest work on a separate stage.
+bool CopyFile(utils::FileWrapper &file, std::span<Sink *const> outs,
+              size_t chunk_size);
+bool CopyFile(utils::FileWrapper &file, Sink &out, size_t chunk_size);
+
+// True for block devices, which are always updated in place.
+bool IsBlockDevice(const std::filesystem::path &path);
+
+// True for outputs that can only be written front to back: "-" (stdout),
+// FIFOs, sockets and character devices. These take the sequential writer,
+// which tracks its position itself and never seeks.
+bool IsStreamOutput(const std::filesystem::path &path);
+
+// Throws if OpenOutput() with the same arguments is bound to fail, without
+// creating anything.
+void CheckOutput(const std::filesystem::path &path, bool dry_run,
+                 bool in_place = false, bool sparse = false);
+
+// Opens the sink for an image output: a NullSink when `dry_run` is set, an
+// UpdateSink for block devices or when `in_place` is set, otherwise a
+// FileSink: on stdout for "-", else staged and published by Close(). With
+// `sparse` set, that sink is wrapped in a SparseSink; only new regular files
+// and dry runs take it. Throws if the file cannot be created.
+std::unique_ptr<Sink> OpenOutput(const std::filesystem::path &path,
+                                 bool dry_run, bool in_place = false,
+                                 bool sparse = false);
+
+} // namespace sink
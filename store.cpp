@@ -0,0 +1,297 @@
+#include "store.h"
+#include "layout.h"
+#include "pipeline.h"
+#include "publish.h"
+
+#include <fstream>
+#include <map>
+#include <sstream>
+
+namespace {
+
+constexpr std::string_view RECIPE_MAGIC = "mkbootimg-recipe";
+constexpr int RECIPE_VERSION = 1;
+// Cut where the top 16 bits of the gear hash are zero: on average every
+// 64 KiB past MIN_CHUNK. The top bits depend on the last 64 bytes.
+constexpr uint64_t CUT_MASK = 0xFFFFull << 48;
+
+// Fixed pseudo-random values (splitmix64) for the gear hash. Changing them
+// moves every content-defined boundary, so existing chunks would stop being
+// reused.
+constexpr std::array<uint64_t, 256> GEAR = [] {
+  std::array<uint64_t, 256> gear{};
+  uint64_t state = 0x6d6b626f6f74696dull;
+  for (auto &value : gear) {
+    uint64_t z = (state += 0x9E3779B97F4A7C15ull);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    value = z ^ (z >> 31);
+  }
+  return gear;
+}();
+
+std::filesystem::path ChunkPath(const std::filesystem::path &dir,
+                                const std::string &sha256) {
+  return dir / "chunks" / sha256.substr(0, 2) / sha256;
+}
+
+bool WriteFile(const std::filesystem::path &path, const void *data,
+               size_t len) {
+  publish::StagedFile file(path);
+  const auto *bytes = static_cast<const uint8_t *>(data);
+  while (len > 0) {
+    const ssize_t n = write(file.fd(), bytes, len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    bytes += n;
+    len -= static_cast<size_t>(n);
+  }
+  return file.Commit();
+}
+
+bool IsSha256(std::string_view text) {
+  return text.size() == 2 * hashing::Sha256::DIGEST_SIZE &&
+         text.find_first_not_of("0123456789abcdef") == std::string_view::npos;
+}
+
+struct Recipe {
+  uint64_t size = 0;
+  // Chunk id to the image offsets it fills, and its size.
+  std::map<std::string, std::pair<size_t, std::vector<uint64_t>>> chunks;
+};
+
+Recipe ReadRecipe(const std::filesystem::path &path) {
+  std::ifstream in(path);
+  if (!in)
+    throw std::runtime_error("Could not open recipe " + path.string() + ".");
+  auto malformed = [&] {
+    return std::runtime_error("Recipe " + path.string() + " is malformed.");
+  };
+  Recipe recipe;
+  std::string magic;
+  int version = 0;
+  std::string image;
+  if (!(in >> magic >> version >> recipe.size >> image) ||
+      magic != RECIPE_MAGIC || !IsSha256(image))
+    throw malformed();
+  if (version != RECIPE_VERSION)
+    throw std::runtime_error("Recipe " + path.string() + " has version " +
+                             std::to_string(version) + ", expected " +
+                             std::to_string(RECIPE_VERSION) + ".");
+  uint64_t offset = 0;
+  std::string sha256;
+  size_t size = 0;
+  while (in >> sha256 >> size) {
+    if (!IsSha256(sha256) || size == 0 ||
+        size > store::StoreSink::MAX_CHUNK)
+      throw malformed();
+    auto &[chunk_size, offsets] = recipe.chunks[sha256];
+    if (!offsets.empty() && chunk_size != size)
+      throw malformed();
+    chunk_size = size;
+    offsets.push_back(offset);
+    offset += size;
+  }
+  if (!in.eof() || offset != recipe.size)
+    throw malformed();
+  return recipe;
+}
+
+} // namespace
+
+namespace store {
+
+StoreSink::StoreSink(sink::Sink &target, const std::filesystem::path &dir)
+    : target_(target), dir_(dir), chunk_(memory::Acquire(MAX_CHUNK)) {
+  std::error_code ec;
+  std::filesystem::create_directories(dir_ / "chunks", ec);
+  if (!ec)
+    std::filesystem::create_directories(dir_ / "recipes", ec);
+  if (ec)
+    throw std::runtime_error("Could not create store " + dir_.string() +
+                             ": " + ec.message());
+}
+
+void StoreSink::BeginSection(std::string_view name) {
+  Cut();
+  in_section_ = true;
+  target_.BeginSection(name);
+}
+
+void StoreSink::EndSection() {
+  Cut();
+  in_section_ = false;
+  target_.EndSection();
+}
+
+bool StoreSink::Flush() { return target_.Flush() && Ok() && !failed_; }
+
+bool StoreSink::Close() {
+  Cut();
+  if (failed_)
+    Fail();
+  if (!target_.Close() || !Ok() || !WriteRecipe())
+    Fail();
+  return Ok();
+}
+
+std::string StoreSink::Summary() const {
+  return "stored as " + id_ + " in " + dir_.string() + ", " +
+         std::to_string(recipe_.size()) + " chunks, " +
+         std::to_string(new_chunks_) + " new (" + std::to_string(new_bytes_) +
+         " bytes)";
+}
+
+void StoreSink::Digest(const void *data, size_t len) {
+  Absorb(static_cast<const uint8_t *>(data), len);
+  target_.Digest(data, len);
+}
+
+bool StoreSink::Store(const void *data, size_t len) {
+  digested_ = true;
+  const bool ok = Write(data, len);
+  digested_ = false;
+  return ok;
+}
+
+bool StoreSink::DoWrite(const void *data, size_t len) {
+  if (digested_)
+    return target_.Store(data, len) && !failed_;
+  Absorb(static_cast<const uint8_t *>(data), len);
+  return target_.Write(data, len) && !failed_;
+}
+
+void StoreSink::Absorb(const uint8_t *data, size_t len) {
+  image_.Update(data, len);
+  while (len > 0) {
+    const size_t room = MAX_CHUNK - used_;
+    const size_t limit = std::min(len, room);
+    size_t take = limit;
+    bool cut = limit == room;
+    if (in_section_) {
+      // The first MIN_CHUNK bytes of a chunk never end it and are not hashed.
+      size_t i = used_ < MIN_CHUNK ? std::min(limit, MIN_CHUNK - used_) : 0;
+      uint64_t hash = hash_;
+      for (; i < limit; ++i) {
+        hash = (hash << 1) + GEAR[data[i]];
+        if ((hash & CUT_MASK) == 0) {
+          take = i + 1;
+          cut = true;
+          break;
+        }
+      }
+      hash_ = hash;
+    }
+    std::memcpy(chunk_.get() + used_, data, take);
+    used_ += take;
+    data += take;
+    len -= take;
+    if (cut)
+      Cut();
+  }
+}
+
+void StoreSink::Cut() {
+  if (used_ == 0)
+    return;
+  hashing::Sha256 sha;
+  sha.Update(chunk_.get(), used_);
+  std::string id = hashing::ToHex(sha.Final());
+  if (seen_.insert(id).second && !WriteChunk(id, chunk_.get(), used_))
+    failed_ = true;
+  recipe_.push_back({std::move(id), used_});
+  used_ = 0;
+  hash_ = 0;
+}
+
+bool StoreSink::WriteChunk(const std::string &sha256, const uint8_t *data,
+                           size_t len) {
+  const auto path = ChunkPath(dir_, sha256);
+  if (access(path.c_str(), F_OK) == 0)
+    return true;
+  std::error_code ec;
+  std::filesystem::create_directories(path.parent_path(), ec);
+  try {
+    if (ec || !WriteFile(path, data, len))
+      return false;
+  } catch (const std::exception &) {
+    return false;
+  }
+  ++new_chunks_;
+  new_bytes_ += len;
+  return true;
+}
+
+bool StoreSink::WriteRecipe() {
+  id_ = hashing::ToHex(image_.Final());
+  std::ostringstream text;
+  text << RECIPE_MAGIC << ' ' << RECIPE_VERSION << ' ' << Position() << ' '
+       << id_ << '\n';
+  for (const auto &chunk : recipe_)
+    text << chunk.sha256 << ' ' << chunk.size << '\n';
+  const std::string recipe = text.str();
+  try {
+    return WriteFile(dir_ / "recipes" / id_, recipe.data(), recipe.size());
+  } catch (const std::exception &) {
+    return false;
+  }
+}
+
+void CheckStore(const std::filesystem::path &dir) {
+  std::error_code ec;
+  if (std::filesystem::is_directory(dir, ec)) {
+    if (access(dir.c_str(), W_OK) != 0)
+      throw std::runtime_error("Cannot write to store " + dir.string() + ".");
+    return;
+  }
+  publish::CheckDestination(dir);
+}
+
+void Extract(const std::filesystem::path &dir, const std::string &recipe_name,
+             const std::filesystem::path &output) {
+  const std::filesystem::path recipe_path =
+      IsSha256(recipe_name) && !std::filesystem::exists(recipe_name)
+          ? dir / "recipes" / recipe_name
+          : std::filesystem::path(recipe_name);
+  const Recipe recipe = ReadRecipe(recipe_path);
+  std::vector<const decltype(recipe.chunks)::value_type *> chunks;
+  chunks.reserve(recipe.chunks.size());
+  for (const auto &chunk : recipe.chunks)
+    chunks.push_back(&chunk);
+
+  layout::OutputFile out(output, recipe.size);
+  auto copy = [&](const std::string &sha256, size_t size,
+                  const std::vector<uint64_t> &offsets) {
+    // Leased per chunk; after the first few the pool hands back its own.
+    const auto buffer = memory::Acquire(StoreSink::MAX_CHUNK);
+    auto file = utils::OpenFile(ChunkPath(dir, sha256));
+    if (!file || file->size != size || !file->ReadAt(0, buffer.get(), size))
+      return false;
+    hashing::Sha256 sha;
+    sha.Update(buffer.get(), size);
+    if (hashing::ToHex(sha.Final()) != sha256)
+      return false;
+    for (const uint64_t offset : offsets) {
+      if (!out.WriteAt(offset, buffer.get(), size))
+        return false;
+    }
+    return true;
+  };
+
+  const size_t workers =
+      memory::Workers(chunks.size(), StoreSink::MAX_CHUNK);
+  const auto failed = pipeline::RunJobs(chunks.size(), workers, [&](size_t i) {
+    const auto &[sha256, placement] = *chunks[i];
+    return copy(sha256, placement.first, placement.second);
+  });
+
+  if (failed)
+    throw std::runtime_error("Chunk " + chunks[*failed]->first + " of " +
+                             recipe_path.string() + " is missing or corrupt.");
+  if (!out.Close())
+    throw errors::FileWriteError("image");
+}
+
+} // namespace store
@@ -0,0 +1,88 @@
+#pragma once
+
+#include "hash.h"
+#include "memory.h"
+#include "sink.h"
+#include <atomic>
+#include <filesystem>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+// Content-addressed archive of built images. Images are cut into chunks that
+// are stored once each, by SHA-256, so images that share inputs share their
+// chunks. A store directory holds
+//
+//   chunks/<first two hex digits>/<sha256>  chunk contents
+//   recipes/<sha256 of the image>          one recipe per image
+//
+// A recipe is text: "mkbootimg-recipe 1 <image size> <image sha256>", then
+// one "<chunk sha256> <chunk size>" line per chunk, in image order.
+namespace store {
+
+// Sink that forwards every byte to `target` while cutting it into chunks for
+// the store at `dir`. Chunks end at every section boundary, so a section's
+// bytes chunk the same whatever header and layout surround them. Inside a
+// section, boundaries are content-defined (a gear rolling hash, MIN_CHUNK to
+// MAX_CHUNK bytes) and survive insertions; outside, only MAX_CHUNK cuts.
+// Close() closes `target`, then writes the recipe. Patching is not supported.
+class StoreSink : public sink::Sink {
+public:
+  static constexpr size_t MIN_CHUNK = 16 * 1024;
+  static constexpr size_t MAX_CHUNK = 256 * 1024;
+
+  // Throws if the store directories cannot be created.
+  StoreSink(sink::Sink &target, const std::filesystem::path &dir);
+
+  void BeginSection(std::string_view name) override;
+  void EndSection() override;
+  bool Flush() override;
+  bool Close() override;
+  bool HashesWrites() const override { return true; }
+  void Digest(const void *data, size_t len) override;
+  bool Store(const void *data, size_t len) override;
+  // The recipe id and the chunk counts, after Close().
+  std::string Summary() const override;
+
+protected:
+  bool DoWrite(const void *data, size_t len) override;
+
+private:
+  struct ChunkRef {
+    std::string sha256;
+    size_t size;
+  };
+
+  void Absorb(const uint8_t *data, size_t len);
+  void Cut();
+  bool WriteChunk(const std::string &sha256, const uint8_t *data, size_t len);
+  bool WriteRecipe();
+
+  sink::Sink &target_;
+  std::filesystem::path dir_;
+  memory::Buffer chunk_;
+  size_t used_ = 0;
+  uint64_t hash_ = 0;
+  bool in_section_ = false;
+  bool digested_ = false;
+  // Set by a chunk write, which may run on the digest stage of a copy.
+  std::atomic<bool> failed_{false};
+  hashing::Sha256 image_;
+  std::vector<ChunkRef> recipe_;
+  std::unordered_set<std::string> seen_;
+  std::string id_;
+  size_t new_chunks_ = 0;
+  uint64_t new_bytes_ = 0;
+};
+
+// Throws unless a store can be created or updated at `dir`.
+void CheckStore(const std::filesystem::path &dir);
+
+// Rebuilds the image of `recipe` (a recipe file, or an image id in the store
+// at `dir`) at `output`. Chunks are read on a pool of worker threads, each
+// checked against its SHA-256 and written to every offset that uses it. The
+// output is staged and only replaced once every chunk checked out.
+void Extract(const std::filesystem::path &dir, const std::string &recipe,
+             const std::filesystem::path &output);
+
+} // namespace store
@@ -0,0 +1,155 @@
+#include "tar.h"
+
+#include <array>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+
+namespace {
+
+constexpr size_t NAME_SIZE = 100;
+constexpr size_t PREFIX_SIZE = 155;
+// Largest size the 11 octal digits of the ustar size field hold.
+constexpr uint64_t MAX_USTAR_SIZE = (1ull << 33) - 1;
+
+// Writes `value` as zero-padded octal filling `len - 1` digits and a NUL.
+void StoreOctal(char *field, size_t len, uint64_t value) {
+  field[len - 1] = '\0';
+  for (size_t i = len - 1; i-- > 0;) {
+    field[i] = static_cast<char>('0' + (value & 7));
+    value >>= 3;
+  }
+}
+
+// Splits `name` into the ustar prefix and name fields at a '/', if it fits.
+bool SplitName(const std::string &name, std::string &prefix,
+               std::string &rest) {
+  if (name.size() <= NAME_SIZE) {
+    prefix.clear();
+    rest = name;
+    return true;
+  }
+  for (size_t slash = name.find('/'); slash != std::string::npos;
+       slash = name.find('/', slash + 1)) {
+    if (slash <= PREFIX_SIZE && name.size() - slash - 1 <= NAME_SIZE &&
+        slash + 1 < name.size()) {
+      prefix = name.substr(0, slash);
+      rest = name.substr(slash + 1);
+      return true;
+    }
+  }
+  return false;
+}
+
+// One pax record: "<length> <key>=<value>\n", where the length counts itself.
+std::string PaxRecord(const std::string &key, const std::string &value) {
+  const size_t body = key.size() + value.size() + 3;
+  size_t len = body + 1;
+  while (std::to_string(len).size() + body != len)
+    len = std::to_string(len).size() + body;
+  return std::to_string(len) + " " + key + "=" + value + "\n";
+}
+
+uint64_t ArchiveTime() {
+  if (const char *epoch = std::getenv("SOURCE_DATE_EPOCH")) {
+    char *end = nullptr;
+    const unsigned long long value = std::strtoull(epoch, &end, 10);
+    if (end != epoch && *end == '\0')
+      return value;
+  }
+  return static_cast<uint64_t>(std::time(nullptr));
+}
+
+// Forwards a member's contents to the archive and pads it on Close().
+class MemberSink : public sink::Sink {
+public:
+  MemberSink(sink::Sink &archive, uint64_t size)
+      : archive_(archive), size_(size) {}
+
+  bool Flush() override { return archive_.Flush() && Ok(); }
+  bool Close() override {
+    if (Position() != size_) {
+      Fail();
+      return false;
+    }
+    return archive_.Pad(tar::BLOCK_SIZE) && Ok();
+  }
+
+protected:
+  bool DoWrite(const void *data, size_t len) override {
+    return Position() + len <= size_ && archive_.Write(data, len);
+  }
+
+private:
+  sink::Sink &archive_;
+  uint64_t size_;
+};
+
+} // namespace
+
+namespace tar {
+
+std::unique_ptr<Archive> Archive::Open(const std::filesystem::path &path) {
+  return std::unique_ptr<Archive>(
+      new Archive(sink::OpenOutput(path, false)));
+}
+
+Archive::Archive(std::unique_ptr<sink::Sink> out)
+    : out_(std::move(out)), mtime_(ArchiveTime()) {}
+
+bool Archive::WriteHeader(const std::string &name, uint64_t size, char type) {
+  std::array<char, BLOCK_SIZE> header{};
+  std::string prefix;
+  std::string rest;
+  if (!SplitName(name, prefix, rest))
+    rest = name.substr(0, NAME_SIZE);
+  std::memcpy(header.data(), rest.data(), rest.size());
+  StoreOctal(header.data() + 100, 8, 0644);
+  StoreOctal(header.data() + 108, 8, 0);
+  StoreOctal(header.data() + 116, 8, 0);
+  StoreOctal(header.data() + 124, 12, std::min(size, MAX_USTAR_SIZE));
+  StoreOctal(header.data() + 136, 12, mtime_);
+  header[156] = type;
+  std::memcpy(header.data() + 257, "ustar", 6);
+  std::memcpy(header.data() + 263, "00", 2);
+  std::memcpy(header.data() + 345, prefix.data(), prefix.size());
+  // The checksum is summed with its own field as spaces.
+  std::memset(header.data() + 148, ' ', 8);
+  uint32_t checksum = 0;
+  for (const char c : header)
+    checksum += static_cast<uint8_t>(c);
+  StoreOctal(header.data() + 148, 7, checksum);
+  return out_->Write(header.data(), header.size());
+}
+
+std::unique_ptr<sink::Sink>
+Archive::AddMember(const std::filesystem::path &path, uint64_t size) {
+  const auto relative = path.relative_path().lexically_normal();
+  const std::string name = relative.generic_string();
+  if (name.empty() || name == "." || *relative.begin() == "..")
+    throw std::runtime_error("Cannot name an archive member " + path.string() +
+                             ".");
+  std::string prefix;
+  std::string rest;
+  std::string pax;
+  if (!SplitName(name, prefix, rest))
+    pax += PaxRecord("path", name);
+  if (size > MAX_USTAR_SIZE)
+    pax += PaxRecord("size", std::to_string(size));
+  bool ok = true;
+  if (!pax.empty()) {
+    ok = WriteHeader("PaxHeaders/" + relative.filename().string(), pax.size(),
+                     'x') &&
+         out_->Write(pax.data(), pax.size()) && out_->Pad(BLOCK_SIZE);
+  }
+  if (!ok || !WriteHeader(name, size, '0'))
+    throw errors::FileWriteError(name + " header");
+  return std::make_unique<MemberSink>(*out_, size);
+}
+
+bool Archive::Close() {
+  static constexpr std::array<uint8_t, 2 * BLOCK_SIZE> end{};
+  return out_->Write(end.data(), end.size()) && out_->Close();
+}
+
+} // namespace tar
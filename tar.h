@@ -0,0 +1,43 @@
+#pragma once
+
+#include "sink.h"
+#include <filesystem>
+#include <memory>
+#include <string>
+
+// Bundles built images into one tar archive as they are written, so a build
+// that ships an archive writes each byte once.
+namespace tar {
+
+constexpr size_t BLOCK_SIZE = 512;
+
+// A ustar archive written front to back to a file or stdout. Members are
+// added one at a time with their final size, which the builders know from
+// the layout before the first byte, so the archive never seeks. Names that do
+// not fit the ustar name and prefix fields, and members of 8 GiB or more, get
+// a pax extended header. The modification time is SOURCE_DATE_EPOCH when set,
+// else the current time.
+class Archive {
+public:
+  // Opens `path` ("-" for stdout) like sink::OpenOutput(). Throws if it cannot
+  // be created.
+  static std::unique_ptr<Archive> Open(const std::filesystem::path &path);
+
+  // Writes the header of a `size` byte member named after `path` (relative,
+  // with "/" separators) and returns the sink for its contents. Closing the
+  // sink pads the member to the block size and fails unless exactly `size`
+  // bytes were written; it must be closed before the next member is added.
+  std::unique_ptr<sink::Sink> AddMember(const std::filesystem::path &path,
+                                        uint64_t size);
+  // Writes the end-of-archive blocks and closes the output.
+  bool Close();
+
+private:
+  explicit Archive(std::unique_ptr<sink::Sink> out);
+  bool WriteHeader(const std::string &name, uint64_t size, char type);
+
+  std::unique_ptr<sink::Sink> out_;
+  uint64_t mtime_;
+};
+
+} // namespace tar
@@ -0,0 +1,23 @@
+#include "utils.hpp"
+#include "zip.h"
+
+namespace utils {
+
+std::optional<FileWrapper> OpenFile(const std::filesystem::path &path) {
+  if (zip::IsEntryPath(path))
+    return zip::OpenEntry(path);
+  const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return std::nullopt;
+  struct stat st;
+  off_t size = -1;
+  if (fstat(fd, &st) == 0 && !S_ISDIR(st.st_mode))
+    size = S_ISREG(st.st_mode) ? st.st_size : lseek(fd, 0, SEEK_END);
+  if (size < 0) {
+    close(fd);
+    return std::nullopt;
+  }
+  return FileWrapper(fd, static_cast<size_t>(size));
+}
+
+} // namespace utils
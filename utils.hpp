@@ -1,92 +1,269 @@
 #pragma once
 
-#include "TinySHA1.hpp"
+#include "memory.h"
 #include <algorithm>
-#include <iostream>
 #include <array>
+#include <cerrno>
 #include <cstdint>
+#include <cstring>
 #include <filesystem>
-#include <fstream>
-#include <iomanip>
 #include <memory>
 #include <optional>
 #include <stdexcept>
-#include <regex>
 #include <string>
+#include <string_view>
 #include <system_error>
+#include <utility>
 #include <vector>
 
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 namespace utils {
 
-inline void WriteS32(std::ostream &stream, const std::string &value) {
-  std::array<char, 32> bytes{};
-  size_t len = std::min(value.size(), static_cast<size_t>(32));
-  std::copy_n(value.data(), len, bytes.data());
-  stream.write(bytes.data(), bytes.size());
+inline uint32_t ReadU32(const uint8_t *bytes) {
+  return static_cast<uint32_t>(bytes[0]) |
+         (static_cast<uint32_t>(bytes[1]) << 8) |
+         (static_cast<uint32_t>(bytes[2]) << 16) |
+         (static_cast<uint32_t>(bytes[3]) << 24);
 }
 
-inline void WriteU32(std::ostream &stream, uint32_t value) {
-  const std::array<uint8_t, 4> bytes{
-      static_cast<uint8_t>(value & 0xFF),
-      static_cast<uint8_t>((value >> 8) & 0xFF),
-      static_cast<uint8_t>((value >> 16) & 0xFF),
-      static_cast<uint8_t>((value >> 24) & 0xFF)};
-  stream.write(reinterpret_cast<const char *>(bytes.data()), bytes.size());
+inline void StoreU32(uint8_t *bytes, uint32_t value) {
+  bytes[0] = static_cast<uint8_t>(value & 0xFF);
+  bytes[1] = static_cast<uint8_t>((value >> 8) & 0xFF);
+  bytes[2] = static_cast<uint8_t>((value >> 16) & 0xFF);
+  bytes[3] = static_cast<uint8_t>((value >> 24) & 0xFF);
 }
 
-inline void WriteU64(std::ostream &stream, uint64_t value) {
-  const std::array<uint8_t, 8> bytes{
-      static_cast<uint8_t>(value & 0xFF),
-      static_cast<uint8_t>((value >> 8) & 0xFF),
-      static_cast<uint8_t>((value >> 16) & 0xFF),
-      static_cast<uint8_t>((value >> 24) & 0xFF),
-      static_cast<uint8_t>((value >> 32) & 0xFF),
-      static_cast<uint8_t>((value >> 40) & 0xFF),
-      static_cast<uint8_t>((value >> 48) & 0xFF),
-      static_cast<uint8_t>((value >> 56) & 0xFF)};
-  stream.write(reinterpret_cast<const char *>(bytes.data()), bytes.size());
+inline uint64_t ReadU64(const uint8_t *bytes) {
+  return static_cast<uint64_t>(ReadU32(bytes)) |
+         (static_cast<uint64_t>(ReadU32(bytes + 4)) << 32);
 }
 
-inline std::string UToS(uint32_t value) {
-  std::string result;
-  result.reserve(4);
-  result.push_back(static_cast<char>((value >> 24) & 0xFF));
-  result.push_back(static_cast<char>((value >> 16) & 0xFF));
-  result.push_back(static_cast<char>((value >> 8) & 0xFF));
-  result.push_back(static_cast<char>(value & 0xFF));
-  return result;
+// Input assembled from something other than a single descriptor, such as the
+// concatenated blobs of dtb::OpenSection.
+class Reader {
+public:
+  virtual ~Reader() = default;
+  // Reads exactly `len` bytes starting at `offset`.
+  virtual bool ReadAt(uint64_t offset, void *data, size_t len) = 0;
+};
+
+inline bool PreadAll(int fd, uint64_t offset, void *data, size_t len) {
+  auto *bytes = static_cast<uint8_t *>(data);
+  while (len > 0) {
+    const ssize_t n = pread(fd, bytes, len, static_cast<off_t>(offset));
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    bytes += n;
+    len -= static_cast<size_t>(n);
+    offset += static_cast<uint64_t>(n);
+  }
+  return true;
 }
 
+// An input opened once, with its size taken from that open. Reads are
+// positional, so passes over the input never rewind a shared cursor.
+//
+// A stream (see OpenInput) is the exception: it has no size until
+// pipeline::Run has read it to the end, which sets `size` to the bytes read,
+// and it cannot be read again.
 struct FileWrapper {
-  std::unique_ptr<std::istream> stream;
+  int fd = -1;
+  std::unique_ptr<Reader> reader;
   size_t size = 0;
-  explicit operator bool() const { return stream && stream->good(); }
+  bool stream = false;
+
+  FileWrapper() = default;
+  FileWrapper(int descriptor, size_t file_size)
+      : fd(descriptor), size(file_size) {}
+  FileWrapper(std::unique_ptr<Reader> source, size_t total_size)
+      : reader(std::move(source)), size(total_size) {}
+  FileWrapper(FileWrapper &&other) noexcept
+      : fd(std::exchange(other.fd, -1)), reader(std::move(other.reader)),
+        size(other.size), stream(other.stream) {}
+  FileWrapper &operator=(FileWrapper &&other) noexcept {
+    if (this != &other) {
+      if (fd >= 0)
+        close(fd);
+      fd = std::exchange(other.fd, -1);
+      reader = std::move(other.reader);
+      size = other.size;
+      stream = other.stream;
+    }
+    return *this;
+  }
+  ~FileWrapper() {
+    if (fd >= 0)
+      close(fd);
+  }
+
+  explicit operator bool() const { return fd >= 0 || reader; }
+  bool ReadAt(uint64_t offset, void *data, size_t len) const {
+    return reader ? reader->ReadAt(offset, data, len)
+                  : PreadAll(fd, offset, data, len);
+  }
+  // Reads the next bytes of a stream until `len` are read or it ends.
+  // Returns the count, short only at the end, or nullopt on an error.
+  std::optional<size_t> ReadNext(void *data, size_t len) const {
+    auto *bytes = static_cast<uint8_t *>(data);
+    size_t done = 0;
+    while (done < len) {
+      const ssize_t n = read(fd, bytes + done, len - done);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n < 0)
+        return std::nullopt;
+      if (n == 0)
+        break;
+      done += static_cast<size_t>(n);
+    }
+    return done;
+  }
 };
 
-inline std::optional<FileWrapper> OpenFile(const std::filesystem::path &path) {
-  auto file =
-      std::make_unique<std::ifstream>(path, std::ios::binary | std::ios::ate);
-  if (!*file)
-    return std::nullopt;
+// Bytes held in memory, such as a generated section.
+class BufferReader : public Reader {
+public:
+  explicit BufferReader(std::vector<uint8_t> data) : data_(std::move(data)) {}
 
-  std::streampos size = file->tellg();
-  if (size == std::streampos(-1)) {
-      return std::nullopt;
+  bool ReadAt(uint64_t offset, void *data, size_t len) override {
+    if (offset > data_.size() || len > data_.size() - offset)
+      return false;
+    std::memcpy(data, data_.data() + offset, len);
+    return true;
   }
-  file->seekg(0);
-  if (!*file) {
-      return std::nullopt;
+
+private:
+  std::vector<uint8_t> data_;
+};
+
+// Spooled copy of a stream, for inputs whose size is needed before their
+// bytes can be written. Kept in fixed-size chunks, so growing it never holds
+// two copies, and with the budget `reserved` for them until destroyed.
+class SpoolReader : public Reader {
+public:
+  static constexpr size_t CHUNK_SIZE = 1 << 20;
+
+  SpoolReader(std::vector<std::vector<uint8_t>> chunks,
+              memory::Reservation reserved)
+      : chunks_(std::move(chunks)), reserved_(std::move(reserved)) {}
+
+  bool ReadAt(uint64_t offset, void *data, size_t len) override {
+    auto *bytes = static_cast<uint8_t *>(data);
+    while (len > 0) {
+      const size_t index = static_cast<size_t>(offset / CHUNK_SIZE);
+      const size_t within = static_cast<size_t>(offset % CHUNK_SIZE);
+      if (index >= chunks_.size() || within >= chunks_[index].size())
+        return false;
+      const size_t n = std::min(len, chunks_[index].size() - within);
+      std::memcpy(bytes, chunks_[index].data() + within, n);
+      bytes += n;
+      offset += n;
+      len -= n;
+    }
+    return true;
+  }
+
+private:
+  std::vector<std::vector<uint8_t>> chunks_;
+  memory::Reservation reserved_;
+};
+
+// Opens an input by path. "archive.zip!/entry" paths open the entry (see
+// zip::OpenEntry, which throws for an entry it cannot read).
+std::optional<FileWrapper> OpenFile(const std::filesystem::path &path);
+
+// True for inputs that can only be read once, front to back: "-" (stdin),
+// FIFOs (including the pipes behind a shell's <(...)) and sockets.
+inline bool IsStreamInput(const std::filesystem::path &path) {
+  if (path == "-")
+    return true;
+  struct stat st;
+  return stat(path.c_str(), &st) == 0 &&
+         (S_ISFIFO(st.st_mode) || S_ISSOCK(st.st_mode));
+}
+
+// Opens an image section input. Beyond what OpenFile takes, it accepts the
+// inputs IsStreamInput() names, and "-" reads stdin. Those come back with
+// `stream` set.
+inline std::optional<FileWrapper> OpenInput(const std::filesystem::path &path) {
+  if (!IsStreamInput(path))
+    return OpenFile(path);
+  const int fd = path == "-" ? fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, 0)
+                             : open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return std::nullopt;
+  FileWrapper file(fd, 0);
+  file.stream = true;
+  return file;
+}
+
+// Upper bound on what Spool() holds in memory for one stream.
+constexpr size_t SPOOL_LIMIT = 256 << 20;
+
+// Reads a stream that has not been read yet into memory, so it gets a size
+// and random access, for builds that need the size before the bytes (a
+// manifest, stdout and in-place outputs, --plan). The memory is reserved from
+// the --max-memory budget as it grows. Throws if it holds more than `limit`
+// bytes or the budget runs out.
+inline void Spool(FileWrapper &file, size_t limit, const std::string &name) {
+  std::vector<std::vector<uint8_t>> chunks;
+  memory::Reservation reserved;
+  size_t size = 0;
+  for (;;) {
+    const size_t want = std::min(SpoolReader::CHUNK_SIZE, limit + 1 - size);
+    if (!reserved.Resize(reserved.size() + want))
+      throw std::runtime_error(
+          "The " + name + " stream does not fit in --max-memory: " +
+          std::to_string(size) + " bytes are read and " +
+          std::to_string(memory::Available()) +
+          " remain. Give it as a file, or raise the limit.");
+    std::vector<uint8_t> chunk(want);
+    const auto n = file.ReadNext(chunk.data(), want);
+    if (!n)
+      throw std::runtime_error("Could not read " + name + ".");
+    size += *n;
+    if (size > limit)
+      throw std::runtime_error(
+          "The " + name + " stream is larger than " + std::to_string(limit) +
+          " bytes, which is as much as this build can hold in memory; give "
+          "it as a file, or write the image to a regular file without "
+          "--manifest or --in-place.");
+    if (*n == 0)
+      break;
+    chunk.resize(*n);
+    chunks.push_back(std::move(chunk));
+    if (*n < want)
+      break;
   }
-  return FileWrapper{std::move(file), static_cast<size_t>(size)};
+  reserved.Resize(size);
+  file = FileWrapper(
+      std::make_unique<SpoolReader>(std::move(chunks), std::move(reserved)),
+      size);
 }
 
-inline std::vector<uint8_t> ReadFileContents(FileWrapper &file) {
-  std::vector<uint8_t> buffer(file.size);
-  if (file.size > 0 && !file.stream->read(reinterpret_cast<char *>(buffer.data()), file.size)) {
-    buffer.clear();
-    buffer.shrink_to_fit();
+// True if both files can be read and have the same bytes.
+inline bool SameContents(const std::filesystem::path &a,
+                         const std::filesystem::path &b, size_t chunk_size) {
+  auto fa = OpenFile(a);
+  auto fb = OpenFile(b);
+  if (!fa || !fb || fa->size != fb->size)
+    return false;
+  const auto ba = memory::Acquire(chunk_size);
+  const auto bb = memory::Acquire(chunk_size);
+  for (uint64_t offset = 0; offset < fa->size;) {
+    const size_t n =
+        static_cast<size_t>(std::min<uint64_t>(chunk_size, fa->size - offset));
+    if (!fa->ReadAt(offset, ba.get(), n) || !fb->ReadAt(offset, bb.get(), n) ||
+        std::memcmp(ba.get(), bb.get(), n) != 0)
+      return false;
+    offset += n;
   }
-  return buffer;
+  return true;
 }
 
 inline size_t GetFileSize(FileWrapper &file) { return file.size; }
@@ -101,25 +278,6 @@ inline size_t GetFileSize(const std::filesystem::path &path) {
   return ec ? 0 : size;
 }
 
-inline void PadFile(std::ostream &out, size_t padding) {
-  if (padding == 0)
-    return;
-  std::streampos pos = out.tellp();
-   if (pos == std::streampos(-1)) return; // Error check
-  size_t current_pos = static_cast<size_t>(pos);
-  size_t pad = (padding - (current_pos % padding)) % padding;
-  if (pad > 0) {
-    constexpr size_t buffer_size = 1024;
-    std::array<char, buffer_size> zeros{}; // Already zero-initialized
-    size_t remaining = pad;
-    while (remaining > 0) {
-        size_t to_write = std::min(remaining, buffer_size);
-        out.write(zeros.data(), to_write);
-        remaining -= to_write;
-    }
-  }
-}
-
 inline uint32_t GetNumberOfPages(uint32_t image_size, uint32_t page_size) {
     if (page_size == 0) return 0; // Avoid division by zero
     return (image_size + page_size - 1) / page_size;
@@ -146,30 +304,40 @@ AsciizString::operator()(const std::string &s) const {
 }
 
 
-namespace { // Anonymous namespace for internal linkage helper
-inline uint32_t ParseOSPatchLevel(const std::string &s) {
-  static const std::regex patch_re(R"(^(\d{4})-(\d{2})(?:-(\d{2}))?)");
-  std::smatch match;
-  if (std::regex_search(s, match, patch_re)) {
-    try {
-      int year = std::stoi(match[1]);
-      int month = std::stoi(match[2]);
-
-      // Basic validation
-      if (month < 1 || month > 12) return 0;
-
-      int y = year - 2000;
-      if (y < 0 || y >= 128) return 0; // Fits in 7 bits
-
-      // Result: 7 bits for year (offset 2000), 4 bits for month
-      return (static_cast<uint32_t>(y) << 4) | static_cast<uint32_t>(month);
-    } catch (const std::invalid_argument &) {
-    } catch (const std::out_of_range &) { }
+// Reads up to `max_digits` decimal digits at `pos`, advancing it. Returns
+// nullopt if there is no digit at `pos`.
+inline std::optional<uint32_t> ParseDigits(std::string_view s, size_t &pos,
+                                           size_t max_digits) {
+  uint32_t value = 0;
+  size_t count = 0;
+  while (pos < s.size() && count < max_digits && s[pos] >= '0' &&
+         s[pos] <= '9') {
+    value = value * 10 + static_cast<uint32_t>(s[pos] - '0');
+    ++pos;
+    ++count;
   }
-  return 0;
+  if (count == 0)
+    return std::nullopt;
+  return value;
 }
-} // anonymous namespace
 
+// Packs a "YYYY-MM[-DD]" prefix into 7 bits of year (offset 2000) and 4 bits
+// of month. Returns 0 when the string does not start with such a date.
+inline uint32_t ParseOSPatchLevel(std::string_view s) {
+  size_t pos = 0;
+  const auto year = ParseDigits(s, pos, 4);
+  if (!year || pos != 4 || pos >= s.size() || s[pos] != '-')
+    return 0;
+  ++pos;
+  const auto month = ParseDigits(s, pos, 2);
+  if (!month || pos != 7)
+    return 0;
+  if (*month < 1 || *month > 12)
+    return 0;
+  if (*year < 2000 || *year - 2000 >= 128)
+    return 0;
+  return ((*year - 2000) << 4) | *month;
+}
 
 struct OSVersion {
   uint32_t version = 0;
@@ -180,30 +348,35 @@ struct OSVersion {
   static inline void Parse(OSVersion &os_version);
 };
 
-
+// The version is the first "A[.B[.C]]" in the string, each component up to
+// three digits; components of 128 or more leave it at 0.
 inline void OSVersion::Parse(OSVersion &os_version) {
-  static const std::regex version_re(R"((\d{1,3})(?:\.(\d{1,3})(?:\.(\d{1,3}))?)?)");
-  std::smatch match;
   os_version.version = 0; // Reset before parsing
   os_version.patch_level = ParseOSPatchLevel(os_version.patch_level_str);
 
-  if (std::regex_search(os_version.version_str, match, version_re)) {
-    try {
-      uint32_t a = std::stoul(match[1]);
-      uint32_t b = match[2].matched ? std::stoul(match[2]) : 0;
-      uint32_t c = match[3].matched ? std::stoul(match[3]) : 0;
-
-      // Ensure components fit within 7 bits each (0-127)
-      if (a < 128 && b < 128 && c < 128) {
-        // Result: 7 bits for A, 7 bits for B, 7 bits for C
-        os_version.version = (a << 14) | (b << 7) | c;
-      }
-    } catch (const std::invalid_argument &) {
-    } catch (const std::out_of_range &) { }
-  }
+  const std::string_view s = os_version.version_str;
+  size_t pos = s.find_first_of("0123456789");
+  if (pos == std::string_view::npos)
+    return;
+  const uint32_t a = *ParseDigits(s, pos, 3);
+  uint32_t b = 0;
+  uint32_t c = 0;
+  auto component = [&](uint32_t &value) {
+    if (pos + 1 >= s.size() || s[pos] != '.' || s[pos + 1] < '0' ||
+        s[pos + 1] > '9')
+      return false;
+    ++pos;
+    value = *ParseDigits(s, pos, 3);
+    return true;
+  };
+  if (component(b))
+    component(c);
+
+  // Ensure components fit within 7 bits each (0-127)
+  if (a < 128 && b < 128 && c < 128)
+    os_version.version = (a << 14) | (b << 7) | c;
 }
 
-
 } // namespace utils
 
 namespace errors {
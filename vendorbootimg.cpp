@@ -1,21 +1,57 @@
 #include "vendorbootimg.h"
+#include "delta.h"
+#include "dtb.h"
+#include "format.h"
+#include "hash.h"
+#include "manifest.h"
+#include "memory.h"
+#include "pipeline.h"
+#include "sink.h"
+#include "store.h"
+#include "tar.h"
+#include "zip.h"
+
+#include <iostream>
+#include <map>
 
 namespace {
-constexpr std::string_view VENDOR_BOOT_MAGIC = "VNDRBOOT";
-constexpr uint32_t VENDOR_BOOT_MAGIC_SIZE = 8;
-constexpr uint32_t VENDOR_RAMDISK_NAME_SIZE = 32;
-constexpr uint32_t VENDOR_RAMDISK_TABLE_ENTRY_V4_SIZE = 108;
-constexpr uint32_t VENDOR_BOOT_IMAGE_HEADER_V3_SIZE = 2112;
-constexpr uint32_t VENDOR_BOOT_IMAGE_HEADER_V4_SIZE = 2128;
-constexpr uint32_t VENDOR_BOOT_ARGS_SIZE = 2048;
-constexpr uint32_t VENDOR_BOOT_NAME_SIZE = 16;
+using format::VENDOR_BOOT_ARGS_SIZE;
+using format::VENDOR_BOOT_IMAGE_HEADER_V3_SIZE;
+using format::VENDOR_BOOT_IMAGE_HEADER_V4_SIZE;
+using format::VENDOR_BOOT_MAGIC;
+using format::VENDOR_BOOT_MAGIC_SIZE;
+using format::VENDOR_BOOT_NAME_SIZE;
+using format::VENDOR_RAMDISK_NAME_SIZE;
+using format::VENDOR_RAMDISK_TABLE_ENTRY_V4_SIZE;
+
+constexpr size_t COPY_CHUNK_SIZE = 1 << 20;
+
+std::string RamdiskSectionName(const VendorRamdiskEntry &entry) {
+  return entry.name.empty() ? "vendor_ramdisk"
+                            : "vendor_ramdisk:" + entry.name;
+}
+
+// CRC-32C of a whole fragment, or 0 if it cannot be read (the byte
+// comparison then decides).
+uint32_t FragmentCrc(const std::filesystem::path &path, size_t chunk_size) {
+  auto file = utils::OpenFile(path);
+  if (!file)
+    return 0;
+  hashing::Crc32c crc;
+  const pipeline::Stage update = [&](const uint8_t *data, size_t len) {
+    crc.Update(data, len);
+    return true;
+  };
+  if (!pipeline::Run(*file, file->size, update, chunk_size))
+    return 0;
+  return crc.Final();
+}
 } // namespace
 
-void VendorBootBuilder::Build() {
-  std::ofstream out(args.output, std::ios::binary);
-  if (!out) {
-    throw std::runtime_error("Could not open output file.");
-  }
+void VendorBootBuilder::Prepare(bool spool) {
+  if (prepared)
+    return;
+  prepared = true;
 
   if (args.header_version > 3 && !args.vendor_ramdisk.empty()) {
     VendorRamdiskEntry MainEntry;
@@ -26,111 +62,558 @@ void VendorBootBuilder::Build() {
     args.ramdisks.insert(args.ramdisks.begin(), MainEntry);
   }
 
+  // Everything below is checked before any output is created, so a bad
+  // input never costs a partial write.
+  CollectRamdiskSizes();
+  chunk_size = memory::BufferSize(COPY_CHUNK_SIZE, pipeline::RING_DEPTH);
+  dtb = dtb::OpenSection(args.dtb);
+  if (!args.dtb.empty() && !dtb)
+    throw std::runtime_error("Could not open dtb " +
+                             args.dtb.front().string() + ".");
+  if (args.header_version > 3 && !args.bootconfig_sources.empty()) {
+    bootconfig = bootconfig::Build(args.bootconfig_sources);
+  } else if (args.header_version > 3 && !args.bootconfig.empty()) {
+    bootconfig = utils::OpenInput(args.bootconfig);
+    if (!bootconfig)
+      throw std::runtime_error("Could not open bootconfig " +
+                               args.bootconfig.string() + ".");
+  }
+  back_patch = !ramdisk_streams.empty() || (dtb && dtb->stream) ||
+               (bootconfig && bootconfig->stream);
+  if (back_patch && spool) {
+    SpoolStreams();
+    back_patch = false;
+  }
+  CheckSizes();
+  PlaceRamdisks();
+}
+
+// Checks the dtb and bootconfig against their 32-bit header fields; streams
+// pass until they have been copied.
+void VendorBootBuilder::CheckSizes() const {
+  if (dtb && dtb->size > UINT32_MAX)
+    throw std::runtime_error("The dtb is larger than 4 GiB.");
+  if (bootconfig && bootconfig->size > UINT32_MAX)
+    throw std::runtime_error("The bootconfig is larger than 4 GiB.");
+}
+
+void VendorBootBuilder::SpoolStreams() {
+  const size_t limit = utils::SPOOL_LIMIT;
+  for (auto &[index, file] : ramdisk_streams) {
+    utils::Spool(file, limit, "vendor ramdisk");
+    if (file.size > UINT32_MAX)
+      throw std::runtime_error("Vendor ramdisk stream is larger than 4 GiB.");
+    ramdisk_sizes[index] = static_cast<uint32_t>(file.size);
+  }
+  if (dtb && dtb->stream)
+    utils::Spool(*dtb, limit, "dtb");
+  if (bootconfig && bootconfig->stream)
+    utils::Spool(*bootconfig, limit, "bootconfig");
+}
+
+std::vector<std::pair<std::filesystem::path, std::string>>
+VendorBootBuilder::InputSections() const {
+  std::vector<std::pair<std::filesystem::path, std::string>> inputs;
+  if (!args.vendor_ramdisk.empty())
+    inputs.emplace_back(args.vendor_ramdisk, "vendor_ramdisk");
+  for (const auto &entry : args.ramdisks)
+    inputs.emplace_back(entry.path, RamdiskSectionName(entry));
+  for (const auto &path : args.dtb)
+    inputs.emplace_back(path, "dtb");
+  if (args.header_version > 3 && !args.bootconfig.empty())
+    inputs.emplace_back(args.bootconfig, "bootconfig");
+  for (const auto &source : args.bootconfig_sources) {
+    if (args.header_version > 3 && !source.file.empty())
+      inputs.emplace_back(source.file, "bootconfig");
+  }
+  return inputs;
+}
+
+layout::Image VendorBootBuilder::Plan() {
+  Prepare(true);
+  return PlanLayout();
+}
+
+void VendorBootBuilder::Build() {
+  // Pipes and in-place updates need the bytes in order and never seek back;
+  // a manifest, a store or a delta hashes the header first, and a tar member
+  // header holds the image size. Those need stream sizes up front.
+  const bool streamed = args.in_place || sink::IsBlockDevice(args.output) ||
+                        sink::IsStreamOutput(args.output);
+  Prepare(streamed || !args.manifest.empty() || !args.store.empty() ||
+          !args.tar.empty() || !args.delta.empty());
+  if (args.tar.empty())
+    sink::CheckOutput(args.output, args.dry_run, args.in_place, args.sparse);
+  else
+    sink::CheckOutput(args.tar, false);
+  if (!args.store.empty())
+    store::CheckStore(args.store);
+  // Digests, deltas, dry runs, streams, archives, sparse images and the
+  // outputs above are written in order; everything else at planned offsets.
+  if (args.manifest.empty() && args.store.empty() && args.tar.empty() &&
+      args.delta.empty() && !args.dry_run && !streamed && !back_patch &&
+      !args.sparse)
+    WritePlanned();
+  else
+    WriteSequential();
+}
+
+layout::Image VendorBootBuilder::PlanLayout() const {
+  layout::Image plan;
+  plan.path = args.output;
+  plan.kind = "vendor_boot";
+  plan.header_version = args.header_version;
+  plan.alignment = args.page_size;
+  plan.sections.reserve(args.ramdisks.size() + 5);
+  plan.Add("header", args.header_version > 3
+                         ? VENDOR_BOOT_IMAGE_HEADER_V4_SIZE
+                         : VENDOR_BOOT_IMAGE_HEADER_V3_SIZE);
   if (args.header_version > 3) {
-    for (const auto &entry : args.ramdisks) {
-      ramdisk_total_size += utils::GetFileSize(entry.path);
+    const uint64_t ramdisks_offset = plan.size;
+    for (size_t i = 0; i < args.ramdisks.size(); ++i) {
+      auto name = RamdiskSectionName(args.ramdisks[i]);
+      if (ramdisk_owners[i] == i)
+        plan.Append(std::move(name), ramdisk_sizes[i]);
+      else
+        plan.Share(std::move(name), ramdisks_offset + ramdisk_offsets[i],
+                   ramdisk_sizes[i]);
     }
   } else {
-    ramdisk_total_size = utils::GetFileSize(args.vendor_ramdisk);
+    plan.Append("vendor_ramdisk", ramdisk_sizes.front());
   }
+  plan.Align();
+  if (dtb)
+    plan.Add("dtb", dtb->size);
+  if (args.header_version > 3) {
+    plan.Add("vendor_ramdisk_table",
+             args.ramdisks.size() * VENDOR_RAMDISK_TABLE_ENTRY_V4_SIZE);
+    if (bootconfig)
+      plan.Add("bootconfig", bootconfig->size);
+  }
+  return plan;
+}
+
+// Preallocates the output, copies the ramdisks, dtb and bootconfig in
+// parallel to their planned offsets, then writes the table and the header.
+void VendorBootBuilder::WritePlanned() {
+  sink::MemorySink header;
+  if (!WriteHeader(header))
+    throw errors::FileWriteError("header");
+
+  const auto plan = PlanLayout();
+  const uint64_t keep =
+      args.changed_sections ? plan.FirstChangedOffset(*args.changed_sections)
+                            : 0;
+  layout::OutputFile file(args.output, plan.size, keep);
+
+  // One target per extent, reserved up front: the extents point into it.
+  const size_t count = args.ramdisks.size() + 3;
+  std::vector<layout::Extent> extents;
+  std::vector<layout::Target> targets;
+  extents.reserve(count);
+  targets.reserve(count);
+  auto add = [&](layout::Extent extent, uint64_t offset, bool stored) {
+    if (stored && offset >= file.kept()) {
+      targets.emplace_back(&file, offset);
+      extent.targets = std::span(&targets.back(), 1);
+    }
+    extents.push_back(extent);
+  };
+  const auto *placed = &plan.sections[1];
+  auto add_path = [&](const std::filesystem::path &path, bool stored) {
+    layout::Extent extent;
+    extent.name = "ramdisk table";
+    extent.path = &path;
+    extent.size = placed->size;
+    add(extent, placed->offset, stored);
+    ++placed;
+  };
+  auto add_file = [&](utils::FileWrapper &source, const char *name) {
+    const auto *section = plan.Find(name);
+    layout::Extent extent;
+    extent.name = name;
+    extent.source = &source;
+    extent.size = section->size;
+    add(extent, section->offset, true);
+  };
+  if (args.header_version > 3) {
+    for (size_t i = 0; i < args.ramdisks.size(); ++i)
+      add_path(args.ramdisks[i].path, ramdisk_owners[i] == i);
+  } else if (ramdisk_sizes.front() > 0) {
+    add_path(args.vendor_ramdisk, true);
+  }
+  if (dtb)
+    add_file(*dtb, "dtb");
+  if (bootconfig)
+    add_file(*bootconfig, "bootconfig");
+  // Empty fragments have nothing to copy.
+  extents.erase(std::remove_if(extents.begin(), extents.end(),
+                               [](const layout::Extent &extent) {
+                                 return extent.size == 0;
+                               }),
+                extents.end());
+  // Sized again from what the output left of the --max-memory budget.
+  chunk_size = memory::BufferSize(COPY_CHUNK_SIZE, pipeline::RING_DEPTH);
+  layout::CopyExtents(extents, chunk_size);
+
+  if (args.header_version > 3) {
+    const auto table = BuildTable();
+    const auto *section = plan.Find("vendor_ramdisk_table");
+    if (!file.WriteAt(section->offset, table.data(), table.size()))
+      throw errors::FileWriteError("ramdisk table entries");
+  }
+  if (!file.WriteAt(0, header.data().data(), header.data().size()))
+    throw errors::FileWriteError("header");
+  if (!file.Close())
+    throw errors::FileWriteError("image");
+}
+
+// Writes the image front to back through a sink, for manifests, dry runs and
+// the outputs that need the bytes in order. With back_patch, the header goes
+// out with the sizes known so far and is patched once the streams are copied;
+// the table comes after every ramdisk and is written complete.
+void VendorBootBuilder::WriteSequential() {
+  std::unique_ptr<tar::Archive> archive;
+  std::unique_ptr<sink::Sink> file;
+  if (!args.tar.empty()) {
+    archive = tar::Archive::Open(args.tar);
+    file = archive->AddMember(args.output, PlanLayout().size);
+  } else {
+    file = sink::OpenOutput(args.output, args.dry_run, args.in_place,
+                            args.sparse);
+  }
+  std::unique_ptr<delta::DeltaSink> pages;
+  if (!args.delta.empty())
+    pages = std::make_unique<delta::DeltaSink>(*file, args.delta_from,
+                                               args.delta, args.page_size);
+  sink::Sink &image = pages ? *pages : *file;
+  std::unique_ptr<manifest::DigestingSink> tee;
+  if (!args.manifest.empty())
+    tee = std::make_unique<manifest::DigestingSink>(image);
+  std::unique_ptr<store::StoreSink> chunks;
+  if (!args.store.empty())
+    chunks = std::make_unique<store::StoreSink>(
+        tee ? static_cast<sink::Sink &>(*tee) : image, args.store);
+  sink::Sink &out = chunks ? *chunks
+                    : tee  ? static_cast<sink::Sink &>(*tee)
+                           : image;
+  // Sized again from what the output left of the --max-memory budget.
+  chunk_size = memory::BufferSize(COPY_CHUNK_SIZE, pipeline::RING_DEPTH);
 
   if (!WriteHeader(out))
     throw errors::FileWriteError("header");
   if (!WriteRamdisks(out))
     throw errors::FileWriteError("ramdisk table");
 
-  if (auto dtb = utils::OpenFile(args.dtb)) {
-    auto data = utils::ReadFileContents(*dtb);
-    out.write(reinterpret_cast<const char *>(data.data()), data.size());
-    utils::PadFile(out, args.page_size);
+  if (dtb) {
+    out.BeginSection("dtb");
+    if (!sink::CopyFile(*dtb, out, chunk_size))
+      throw errors::FileWriteError("dtb");
+    out.EndSection();
+    out.Pad(args.page_size);
   }
 
   if (args.header_version > 3) {
     if (!WriteTableEntries(out))
       throw errors::FileWriteError("ramdisk table entries");
 
-    if (auto bc = utils::OpenFile(args.bootconfig)) {
-      auto data = utils::ReadFileContents(*bc);
-      out.write(reinterpret_cast<const char *>(data.data()), data.size());
-      utils::PadFile(out, args.page_size);
+    if (bootconfig) {
+      out.BeginSection("bootconfig");
+      if (!sink::CopyFile(*bootconfig, out, chunk_size))
+        throw errors::FileWriteError("bootconfig");
+      out.EndSection();
+      out.Pad(args.page_size);
+    }
+  }
+
+  if (back_patch) {
+    CheckSizes();
+    // Only the header struct changes; its page padding may already be a FILL
+    // chunk of a sparse output, which cannot be patched.
+    sink::MemorySink header;
+    if (!WriteHeader(header) ||
+        !out.Patch(0, header.data().data(),
+                   args.header_version > 3 ? VENDOR_BOOT_IMAGE_HEADER_V4_SIZE
+                                           : VENDOR_BOOT_IMAGE_HEADER_V3_SIZE))
+      throw errors::FileWriteError("header");
+  }
+
+  if (!out.Close())
+    throw errors::FileWriteError("image");
+  if (archive && !archive->Close())
+    throw errors::FileWriteError("archive");
+  const auto summary = file->Summary();
+  if (!summary.empty())
+    std::cout << args.output.string() << ": " << summary << "\n";
+  if (chunks)
+    std::cout << args.output.string() << ": " << chunks->Summary() << "\n";
+  if (pages)
+    std::cout << args.delta.string() << ": " << pages->Summary() << "\n";
+  if (tee) {
+    std::vector<manifest::ImageRecord> records;
+    records.push_back(tee->Finish(args.output));
+    manifest::WriteManifest(args.manifest, records);
+  }
+}
+
+// Stats every ramdisk exactly once. The sizes feed the header, the table and
+// the copy, and are checked here against the 32-bit header fields. A ramdisk
+// that is missing fails the build here rather than being left out. Streams
+// are opened instead, with a size of 0 until they are read.
+void VendorBootBuilder::CollectRamdiskSizes() {
+  auto add = [&](const std::filesystem::path &path) {
+    if (utils::IsStreamInput(path)) {
+      auto file = utils::OpenInput(path);
+      if (!file)
+        throw std::runtime_error("Could not open vendor ramdisk " +
+                                 path.string() + ".");
+      ramdisk_streams.emplace(ramdisk_sizes.size(), std::move(*file));
+      ramdisk_sizes.push_back(0);
+      return;
+    }
+    uint64_t size = 0;
+    if (zip::IsEntryPath(path)) {
+      // Only the central directory is read; the entry itself is not.
+      auto entry = zip::OpenEntry(path);
+      if (!entry)
+        throw std::runtime_error("Could not read vendor ramdisk " +
+                                 path.string() + ".");
+      size = entry->size;
+    } else {
+      std::error_code ec;
+      size = std::filesystem::file_size(path, ec);
+      if (ec)
+        throw std::runtime_error("Could not read vendor ramdisk " +
+                                 path.string() + ": " + ec.message());
+    }
+    if (size > UINT32_MAX)
+      throw std::runtime_error("Vendor ramdisk " + path.string() +
+                               " is larger than 4 GiB.");
+    ramdisk_sizes.push_back(static_cast<uint32_t>(size));
+  };
+
+  if (args.header_version > 3) {
+    if (static_cast<uint64_t>(args.ramdisks.size()) *
+            VENDOR_RAMDISK_TABLE_ENTRY_V4_SIZE >
+        UINT32_MAX)
+      throw std::runtime_error("Too many vendor ramdisk table entries.");
+    ramdisk_sizes.reserve(args.ramdisks.size());
+    for (const auto &entry : args.ramdisks)
+      add(entry.path);
+  } else {
+    if (args.vendor_ramdisk.empty())
+      throw std::runtime_error("Vendor boot v3 needs --vendor_ramdisk; "
+                               "ramdisk fragments need header version 4.");
+    add(args.vendor_ramdisk);
+  }
+}
+
+// Gives every ramdisk its offset in the vendor ramdisk section. With sharing
+// on, a v4 fragment with the same bytes as an earlier one is not stored
+// again: its table entry points at the earlier copy. Only fragments of equal
+// size can match. Where three or more share a size, each is hashed once
+// (CRC-32C) so that only equal hashes get compared, which keeps thousands of
+// same-size fragments linear; a byte comparison always confirms a match.
+// Candidates are grouped by sorting rather than in maps, so the bookkeeping
+// costs a few allocations per image instead of some per fragment.
+void VendorBootBuilder::PlaceRamdisks() {
+  const size_t count = ramdisk_sizes.size();
+  ramdisk_owners.resize(count);
+  for (size_t i = 0; i < count; ++i)
+    ramdisk_owners[i] = i;
+  if (args.header_version > 3 && args.share_ramdisks) {
+    // Shareable fragments, by size and then table order.
+    std::vector<size_t> order;
+    order.reserve(count);
+    for (size_t i = 0; i < count; ++i) {
+      if (ramdisk_sizes[i] > 0 && !ramdisk_streams.count(i))
+        order.push_back(i);
+    }
+    std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+      return std::pair(ramdisk_sizes[a], a) < std::pair(ramdisk_sizes[b], b);
+    });
+    // Calls `group(begin, end)` for every run of `order` that `same` holds
+    // together.
+    auto for_each_run = [&](auto same, auto group) {
+      for (size_t begin = 0; begin < order.size();) {
+        size_t end = begin + 1;
+        while (end < order.size() && same(order[begin], order[end]))
+          ++end;
+        group(begin, end);
+        begin = end;
+      }
+    };
+
+    std::vector<uint32_t> crcs(count, 0);
+    std::vector<size_t> hashed;
+    hashed.reserve(order.size());
+    for_each_run(
+        [&](size_t a, size_t b) { return ramdisk_sizes[a] == ramdisk_sizes[b]; },
+        [&](size_t begin, size_t end) {
+          if (end - begin > 2)
+            hashed.insert(hashed.end(), order.begin() + begin,
+                          order.begin() + end);
+        });
+    const size_t workers = memory::Workers(hashed.size(), chunk_size);
+    pipeline::RunJobs(hashed.size(), workers, [&](size_t k) {
+      crcs[hashed[k]] = FragmentCrc(args.ramdisks[hashed[k]].path, chunk_size);
+      return true;
+    });
+
+    // Equal sizes and hashes (0 where not hashed) are now adjacent, in table
+    // order; each fragment is compared with the stored ones of its run.
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+      return std::pair(ramdisk_sizes[a], crcs[a]) <
+             std::pair(ramdisk_sizes[b], crcs[b]);
+    });
+    std::vector<size_t> stored;
+    for_each_run(
+        [&](size_t a, size_t b) {
+          return ramdisk_sizes[a] == ramdisk_sizes[b] && crcs[a] == crcs[b];
+        },
+        [&](size_t begin, size_t end) {
+          stored.clear();
+          for (size_t k = begin; k < end; ++k) {
+            const size_t i = order[k];
+            const auto match =
+                std::find_if(stored.begin(), stored.end(), [&](size_t j) {
+                  return utils::SameContents(args.ramdisks[j].path,
+                                             args.ramdisks[i].path, chunk_size);
+                });
+            if (match != stored.end())
+              ramdisk_owners[i] = *match;
+            else
+              stored.push_back(i);
+          }
+        });
+  }
+  AssignRamdiskOffsets();
+}
+
+// Packs the stored ramdisks back to back in table order; a shared entry takes
+// the offset of the one it shares.
+void VendorBootBuilder::AssignRamdiskOffsets() {
+  ramdisk_offsets.resize(ramdisk_sizes.size());
+  uint64_t total = 0;
+  for (size_t i = 0; i < ramdisk_sizes.size(); ++i) {
+    if (ramdisk_owners[i] != i) {
+      ramdisk_offsets[i] = ramdisk_offsets[ramdisk_owners[i]];
+      continue;
     }
+    ramdisk_offsets[i] = static_cast<uint32_t>(total);
+    total += ramdisk_sizes[i];
+    if (total > UINT32_MAX)
+      throw std::runtime_error("Vendor ramdisks add up to more than 4 GiB.");
   }
+  ramdisk_total_size = total;
 }
 
-bool VendorBootBuilder::WriteHeader(std::ostream &out) {
-  out.write(VENDOR_BOOT_MAGIC.data(), VENDOR_BOOT_MAGIC_SIZE);
-  utils::WriteU32(out, args.header_version);
-  utils::WriteU32(out, args.page_size);
-  utils::WriteU32(out, args.base + args.kernel_offset);
-  utils::WriteU32(out, args.base + args.ramdisk_offset);
-  utils::WriteU32(out, static_cast<uint32_t>(ramdisk_total_size));
+bool VendorBootBuilder::WriteHeader(sink::Sink &out) {
+  out.Write(VENDOR_BOOT_MAGIC.data(), VENDOR_BOOT_MAGIC_SIZE);
+  out.WriteU32(args.header_version);
+  out.WriteU32(args.page_size);
+  out.WriteU32(args.base + args.kernel_offset);
+  out.WriteU32(args.base + args.ramdisk_offset);
+  out.WriteU32(static_cast<uint32_t>(ramdisk_total_size));
 
-  std::vector<char> cmdline(args.vendor_cmdline.begin(), args.vendor_cmdline.end());
-  cmdline.resize(VENDOR_BOOT_ARGS_SIZE, 0);
-  out.write(cmdline.data(), cmdline.size());
+  const auto cmdline =
+      format::FixedField<VENDOR_BOOT_ARGS_SIZE>(args.vendor_cmdline);
+  out.Write(cmdline.data(), cmdline.size());
 
-  utils::WriteU32(out, args.base + args.tags_offset);
+  out.WriteU32(args.base + args.tags_offset);
 
-  std::vector<char> board(args.board.begin(), args.board.end());
-  board.resize(VENDOR_BOOT_NAME_SIZE, 0);
-  out.write(board.data(), board.size());
+  const auto board = format::FixedField<VENDOR_BOOT_NAME_SIZE>(args.board);
+  out.Write(board.data(), board.size());
 
   const uint32_t header_size = args.header_version > 3 ? VENDOR_BOOT_IMAGE_HEADER_V4_SIZE : VENDOR_BOOT_IMAGE_HEADER_V3_SIZE;
-  utils::WriteU32(out, header_size);
-  utils::WriteU32(out, utils::GetFileSize(args.dtb));
-  utils::WriteU64(out, args.base + args.dtb_offset);
+  out.WriteU32(header_size);
+  out.WriteU32(utils::GetFileSize(dtb));
+  out.WriteU64(args.base + args.dtb_offset);
 
   if (args.header_version > 3) {
     const uint32_t table_size = static_cast<uint32_t>(
         args.ramdisks.size() * VENDOR_RAMDISK_TABLE_ENTRY_V4_SIZE);
-    utils::WriteU32(out, table_size);
-    utils::WriteU32(out, static_cast<uint32_t>(args.ramdisks.size()));
-    utils::WriteU32(out, VENDOR_RAMDISK_TABLE_ENTRY_V4_SIZE);
-    utils::WriteU32(out, utils::GetFileSize(args.bootconfig));
+    out.WriteU32(table_size);
+    out.WriteU32(static_cast<uint32_t>(args.ramdisks.size()));
+    out.WriteU32(VENDOR_RAMDISK_TABLE_ENTRY_V4_SIZE);
+    out.WriteU32(utils::GetFileSize(bootconfig));
   }
 
-  utils::PadFile(out, args.page_size);
-  return out.good();
+  out.Pad(args.page_size);
+  return out.Ok();
 }
 
-bool VendorBootBuilder::WriteRamdisks(std::ostream &out) {
-  if (args.header_version > 3) {
-    for (const auto &entry : args.ramdisks) {
-      if (auto file = utils::OpenFile(entry.path)) {
-        auto data = utils::ReadFileContents(*file);
-        out.write(reinterpret_cast<const char *>(data.data()), data.size());
-      }
+bool VendorBootBuilder::WriteRamdisks(sink::Sink &out) {
+  // Copies ramdisk `index`; a stream is counted as it goes.
+  auto copy = [&](size_t index, const std::filesystem::path &path,
+                  const std::string &section) {
+    std::optional<utils::FileWrapper> opened;
+    utils::FileWrapper *file;
+    const auto stream = ramdisk_streams.find(index);
+    if (stream != ramdisk_streams.end()) {
+      file = &stream->second;
+    } else {
+      opened = utils::OpenFile(path);
+      if (!opened)
+        return false;
+      if (opened->size != ramdisk_sizes[index])
+        throw std::runtime_error("Vendor ramdisk " + path.string() +
+                                 " changed size while building.");
+      file = &*opened;
     }
-  } else {
-    if (auto file = utils::OpenFile(args.vendor_ramdisk)) {
-      auto data = utils::ReadFileContents(*file);
-      out.write(reinterpret_cast<const char *>(data.data()), data.size());
+    out.BeginSection(section);
+    if (!sink::CopyFile(*file, out, chunk_size))
+      return false;
+    out.EndSection();
+    if (file->size > UINT32_MAX)
+      throw std::runtime_error("Vendor ramdisk " + path.string() +
+                               " is larger than 4 GiB.");
+    ramdisk_sizes[index] = static_cast<uint32_t>(file->size);
+    return true;
+  };
+
+  if (args.header_version > 3) {
+    for (size_t i = 0; i < args.ramdisks.size(); ++i) {
+      const auto &entry = args.ramdisks[i];
+      if (ramdisk_owners[i] == i &&
+          !copy(i, entry.path, RamdiskSectionName(entry)))
+        return false;
     }
+  } else if (!copy(0, args.vendor_ramdisk, "vendor_ramdisk")) {
+    return false;
   }
-  utils::PadFile(out, args.page_size);
-  return out.good();
+  // The table that follows needs the offsets of whatever came after a stream.
+  if (back_patch)
+    AssignRamdiskOffsets();
+  out.Pad(args.page_size);
+  return out.Ok();
 }
 
-bool VendorBootBuilder::WriteTableEntries(std::ostream &out) {
-  uint32_t offset = 0;
-  for (const auto &entry : args.ramdisks) {
-    const auto size = static_cast<uint32_t>(utils::GetFileSize(entry.path));
-    utils::WriteU32(out, size);
-    utils::WriteU32(out, offset);
-    utils::WriteU32(out, entry.type);
-
-    std::vector<char> name(VENDOR_RAMDISK_NAME_SIZE, 0);
+std::vector<uint8_t> VendorBootBuilder::BuildTable() const {
+  // The whole table is laid out in one buffer and written with a single call.
+  std::vector<uint8_t> table(args.ramdisks.size() *
+                             VENDOR_RAMDISK_TABLE_ENTRY_V4_SIZE);
+  uint8_t *entry_bytes = table.data();
+  for (size_t i = 0; i < args.ramdisks.size(); ++i) {
+    const auto &entry = args.ramdisks[i];
+    utils::StoreU32(entry_bytes, ramdisk_sizes[i]);
+    utils::StoreU32(entry_bytes + 4, ramdisk_offsets[i]);
+    utils::StoreU32(entry_bytes + 8, entry.type);
     std::copy_n(entry.name.begin(),
-                std::min(entry.name.size(), static_cast<size_t>(VENDOR_RAMDISK_NAME_SIZE - 1)),
-                name.begin());
-    out.write(name.data(), name.size());
-
-    // TODO: Support board_id? Useless in most cases tho.
-    for (const auto &_ : entry.board_id) {
-      utils::WriteU32(out, 0);
-    }
-    offset += size;
+                std::min(entry.name.size(),
+                         static_cast<size_t>(VENDOR_RAMDISK_NAME_SIZE - 1)),
+                entry_bytes + 12);
+    // TODO: Support board_id? Useless in most cases tho. It stays zeroed.
+    entry_bytes += VENDOR_RAMDISK_TABLE_ENTRY_V4_SIZE;
   }
-  utils::PadFile(out, args.page_size);
-  return out.good();
+  return table;
+}
+
+bool VendorBootBuilder::WriteTableEntries(sink::Sink &out) {
+  const auto table = BuildTable();
+  out.BeginSection("vendor_ramdisk_table");
+  out.Write(table.data(), table.size());
+  out.EndSection();
+  out.Pad(args.page_size);
+  return out.Ok();
 }
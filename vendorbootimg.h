@@ -1,6 +1,13 @@
 #pragma once
 
+#include "bootconfig.h"
+#include "layout.h"
 #include "utils.hpp"
+#include <map>
+
+namespace sink {
+class Sink;
+}
 
 struct VendorRamdiskEntry {
   std::filesystem::path path;
@@ -11,8 +18,21 @@ struct VendorRamdiskEntry {
 
 struct VendorBootArgs {
   std::filesystem::path output;
-  std::filesystem::path dtb;
+  std::filesystem::path manifest;
+  // Also store the image in this chunk store (see store::StoreSink).
+  std::filesystem::path store;
+  // Write the image as a member of this tar archive, named after `output`,
+  // instead of to `output` itself.
+  std::filesystem::path tar;
+  // Also write the pages that differ from the previous build `delta_from` to
+  // `delta` (see delta::DeltaSink).
+  std::filesystem::path delta_from;
+  std::filesystem::path delta;
+  std::vector<std::filesystem::path> dtb;
   std::filesystem::path bootconfig;
+  // Parameters of a generated bootconfig, used instead of a finished
+  // `bootconfig` blob; see bootconfig::Build.
+  std::vector<bootconfig::Source> bootconfig_sources;
   std::filesystem::path vendor_ramdisk;
   std::string vendor_cmdline;
   std::string board;
@@ -24,18 +44,61 @@ struct VendorBootArgs {
   uint32_t tags_offset = 0x00000100;
   uint32_t page_size = 2048;
   uint32_t header_version = 3;
+  bool dry_run = false;
+  bool in_place = false;
+  // Write the image in the Android sparse format (see sink::SparseSink).
+  bool sparse = false;
+  // Store v4 fragments with identical contents once and point all their
+  // table entries at that copy. Off for bootloaders that expect every entry
+  // to have a range of its own.
+  bool share_ramdisks = true;
+  // Sections with new contents since the previous build; see BootImageArgs.
+  std::optional<std::vector<std::string>> changed_sections;
 };
 
 class VendorBootBuilder {
   VendorBootArgs args;
   uint64_t ramdisk_total_size = 0;
+  std::vector<uint32_t> ramdisk_sizes;
+  // Per entry: offset in the ramdisk section, and the index of the entry
+  // whose stored bytes it uses (itself unless shared).
+  std::vector<uint32_t> ramdisk_offsets;
+  std::vector<size_t> ramdisk_owners;
+  // Ramdisks that are streams (see utils::OpenInput), by entry index; index
+  // 0 for a v3 vendor ramdisk. They are opened once, up front, and never
+  // shared.
+  std::map<size_t, utils::FileWrapper> ramdisk_streams;
+  std::optional<utils::FileWrapper> dtb;
+  std::optional<utils::FileWrapper> bootconfig;
+  size_t chunk_size = 0;
+  bool prepared = false;
+  // Streams are copied before their sizes are known, and the header is
+  // patched once they are; see WriteSequential().
+  bool back_patch = false;
 
 public:
   explicit VendorBootBuilder(VendorBootArgs &&args) : args(std::move(args)) {}
   void Build();
+  // Computes the layout from the input sizes without writing anything.
+  layout::Image Plan();
+  // Every input path paired with the section it feeds.
+  std::vector<std::pair<std::filesystem::path, std::string>>
+  InputSections() const;
 
 private:
-  bool WriteHeader(std::ostream &out);
-  bool WriteRamdisks(std::ostream &out);
-  bool WriteTableEntries(std::ostream &out);
+  // Opens and checks the inputs. With `spool`, streams are read into memory
+  // so that every size is known; otherwise they are left for back_patch.
+  void Prepare(bool spool);
+  void CollectRamdiskSizes();
+  void SpoolStreams();
+  void CheckSizes() const;
+  void PlaceRamdisks();
+  void AssignRamdiskOffsets();
+  layout::Image PlanLayout() const;
+  void WritePlanned();
+  void WriteSequential();
+  std::vector<uint8_t> BuildTable() const;
+  bool WriteHeader(sink::Sink &out);
+  bool WriteRamdisks(sink::Sink &out);
+  bool WriteTableEntries(sink::Sink &out);
 };
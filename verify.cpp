@@ -0,0 +1,303 @@
+#include "verify.h"
+#include "format.h"
+#include "hash.h"
+#include "memory.h"
+#include "pipeline.h"
+
+#include <chrono>
+#include <fcntl.h>
+#include <iomanip>
+#include <iostream>
+#include <set>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+constexpr size_t HASH_CHUNK_SIZE = 4 << 20;
+
+// Read-only mapping of a whole image. Only the pages a check touches are
+// ever read from disk.
+class MappedImage {
+  const uint8_t *data_ = nullptr;
+  size_t size_ = 0;
+  int fd_ = -1;
+
+public:
+  explicit MappedImage(const std::filesystem::path &path) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+      throw std::runtime_error("cannot open file");
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+      close(fd);
+      throw std::runtime_error("not a regular file");
+    }
+    size_ = static_cast<size_t>(st.st_size);
+    if (size_ > 0) {
+      void *addr = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (addr == MAP_FAILED) {
+        close(fd);
+        throw std::runtime_error("cannot map file");
+      }
+      madvise(addr, size_, MADV_SEQUENTIAL);
+      data_ = static_cast<const uint8_t *>(addr);
+    }
+    fd_ = fd;
+  }
+  ~MappedImage() {
+    if (data_)
+      munmap(const_cast<uint8_t *>(data_), size_);
+    close(fd_);
+  }
+  MappedImage(const MappedImage &) = delete;
+  MappedImage &operator=(const MappedImage &) = delete;
+
+  const uint8_t *data() const { return data_; }
+  size_t size() const { return size_; }
+
+  // Copies a range out with pread, bypassing the mapping.
+  void Read(uint64_t offset, uint8_t *buf, size_t len) const {
+    while (len > 0) {
+      const ssize_t n = pread(fd_, buf, len, static_cast<off_t>(offset));
+      if (n <= 0)
+        throw std::runtime_error("read error");
+      buf += n;
+      offset += static_cast<uint64_t>(n);
+      len -= static_cast<size_t>(n);
+    }
+  }
+};
+
+struct VerifyResult {
+  bool ok = false;
+  std::string kind;
+  std::string error;
+  uint64_t size = 0;
+};
+
+struct Section {
+  uint64_t offset;
+  uint32_t size;
+};
+
+// Lays out `sizes` one after another starting at `offset`, each rounded up to
+// `page_size`, and checks that the image is long enough to hold them all.
+std::vector<Section> PlaceSections(std::initializer_list<uint32_t> sizes,
+                                   uint64_t offset, uint32_t page_size,
+                                   uint64_t file_size) {
+  std::vector<Section> sections;
+  for (uint32_t size : sizes) {
+    sections.push_back({offset, size});
+    offset += static_cast<uint64_t>(
+                  utils::GetNumberOfPages(size, page_size)) * page_size;
+  }
+  if (offset > file_size)
+    throw std::runtime_error("sections extend past end of file (" +
+                             std::to_string(offset) + " > " +
+                             std::to_string(file_size) + ")");
+  if (file_size % page_size != 0)
+    throw std::runtime_error("file length is not page aligned");
+  return sections;
+}
+
+void VerifyBootImage(const MappedImage &image, VerifyResult &result) {
+  auto hdr = format::ParseBootHeader(image.data(), image.size());
+  if (!hdr)
+    throw std::runtime_error("truncated boot header");
+  result.kind = "boot v" + std::to_string(hdr->header_version);
+
+  if (hdr->header_version >= 3) {
+    const uint32_t expected = hdr->header_version > 3
+                                  ? format::BOOT_IMAGE_HEADER_V4_SIZE
+                                  : format::BOOT_IMAGE_HEADER_V3_SIZE;
+    if (hdr->header_size != expected)
+      throw std::runtime_error("header_size " +
+                               std::to_string(hdr->header_size) +
+                               " != " + std::to_string(expected));
+    PlaceSections({hdr->kernel_size, hdr->ramdisk_size}, hdr->page_size,
+                  hdr->page_size, image.size());
+    return;
+  }
+
+  if (!format::IsValidPageSize(hdr->page_size))
+    throw std::runtime_error("invalid page_size " +
+                             std::to_string(hdr->page_size));
+  if (hdr->header_version == 1 &&
+      hdr->header_size != format::BOOT_IMAGE_HEADER_V1_SIZE)
+    throw std::runtime_error("header_size mismatch for v1");
+  if (hdr->header_version == 2 &&
+      hdr->header_size != format::BOOT_IMAGE_HEADER_V2_SIZE)
+    throw std::runtime_error("header_size mismatch for v2");
+
+  std::initializer_list<uint32_t> sizes = {
+      hdr->kernel_size, hdr->ramdisk_size, hdr->second_size,
+      hdr->recovery_dtbo_size, hdr->dtb_size};
+  auto sections =
+      PlaceSections(sizes, hdr->page_size, hdr->page_size, image.size());
+  if (hdr->recovery_dtbo_size > 0 &&
+      hdr->recovery_dtbo_offset != sections[3].offset)
+    throw std::runtime_error("recovery_dtbo_offset does not match layout");
+
+  const size_t hashed = hdr->header_version == 0   ? 3
+                        : hdr->header_version == 1 ? 4
+                                                   : 5;
+  const size_t chunk_size = memory::BufferSize(HASH_CHUNK_SIZE);
+  std::vector<uint8_t> buffer;
+  hashing::Sha1 sha;
+  for (size_t i = 0; i < hashed; ++i) {
+    if (memory::Limit() == 0) {
+      sha.Update(image.data() + sections[i].offset, sections[i].size);
+    } else {
+      // Faulting in the mapping would make RSS follow the section size, so
+      // hash through a bounded buffer instead.
+      buffer.resize(std::min<size_t>(chunk_size, sections[i].size));
+      for (uint32_t done = 0; done < sections[i].size;) {
+        const size_t n =
+            std::min<size_t>(buffer.size(), sections[i].size - done);
+        image.Read(sections[i].offset + done, buffer.data(), n);
+        sha.Update(buffer.data(), n);
+        done += static_cast<uint32_t>(n);
+      }
+    }
+    std::array<uint8_t, 4> size_bytes{
+        static_cast<uint8_t>(sections[i].size & 0xFF),
+        static_cast<uint8_t>((sections[i].size >> 8) & 0xFF),
+        static_cast<uint8_t>((sections[i].size >> 16) & 0xFF),
+        static_cast<uint8_t>((sections[i].size >> 24) & 0xFF)};
+    sha.Update(size_bytes.data(), size_bytes.size());
+  }
+  std::array<uint8_t, format::BOOT_ID_SIZE> id{};
+  const auto digest = sha.Final();
+  std::copy(digest.begin(), digest.end(), id.begin());
+  if (!std::equal(id.begin(), id.end(),
+                  image.data() + format::LEGACY_ID_OFFSET))
+    throw std::runtime_error("id does not match section contents");
+}
+
+void VerifyVendorBootImage(const MappedImage &image, VerifyResult &result) {
+  auto hdr = format::ParseVendorBootHeader(image.data(), image.size());
+  if (!hdr)
+    throw std::runtime_error("truncated vendor_boot header");
+  result.kind = "vendor_boot v" + std::to_string(hdr->header_version);
+
+  if (hdr->header_version < 3)
+    throw std::runtime_error("unsupported header_version");
+  if (!format::IsValidPageSize(hdr->page_size))
+    throw std::runtime_error("invalid page_size " +
+                             std::to_string(hdr->page_size));
+  const uint32_t expected = hdr->header_version > 3
+                                ? format::VENDOR_BOOT_IMAGE_HEADER_V4_SIZE
+                                : format::VENDOR_BOOT_IMAGE_HEADER_V3_SIZE;
+  if (hdr->header_size != expected)
+    throw std::runtime_error("header_size " + std::to_string(hdr->header_size) +
+                             " != " + std::to_string(expected));
+
+  if (hdr->header_version == 3) {
+    PlaceSections({hdr->header_size, hdr->vendor_ramdisk_size, hdr->dtb_size},
+                  0, hdr->page_size, image.size());
+    return;
+  }
+
+  if (hdr->table_entry_size != format::VENDOR_RAMDISK_TABLE_ENTRY_V4_SIZE)
+    throw std::runtime_error("unexpected vendor_ramdisk_table_entry_size");
+  if (static_cast<uint64_t>(hdr->table_entry_num) * hdr->table_entry_size !=
+      hdr->table_size)
+    throw std::runtime_error("vendor_ramdisk_table_size mismatch");
+
+  auto sections =
+      PlaceSections({hdr->header_size, hdr->vendor_ramdisk_size, hdr->dtb_size,
+                     hdr->table_size, hdr->bootconfig_size},
+                    0, hdr->page_size, image.size());
+
+  // Entries are packed back to back, except that an entry may reuse the exact
+  // range of an earlier one when their fragments are identical.
+  const uint8_t *table = image.data() + sections[3].offset;
+  uint64_t expected_offset = 0;
+  std::set<std::pair<uint32_t, uint32_t>> ranges;
+  for (uint32_t i = 0; i < hdr->table_entry_num; ++i) {
+    const uint8_t *entry = table + static_cast<size_t>(i) * hdr->table_entry_size;
+    const uint32_t size = utils::ReadU32(entry);
+    const uint32_t offset = utils::ReadU32(entry + 4);
+    if (offset != expected_offset && ranges.count({offset, size}))
+      continue;
+    if (offset != expected_offset)
+      throw std::runtime_error("ramdisk table entry " + std::to_string(i) +
+                               " has offset " + std::to_string(offset) +
+                               ", expected " + std::to_string(expected_offset));
+    ranges.insert({offset, size});
+    expected_offset += size;
+  }
+  if (expected_offset != hdr->vendor_ramdisk_size)
+    throw std::runtime_error("ramdisk table sizes add up to " +
+                             std::to_string(expected_offset) +
+                             ", vendor_ramdisk_size is " +
+                             std::to_string(hdr->vendor_ramdisk_size));
+}
+
+VerifyResult VerifyImage(const std::filesystem::path &path) {
+  VerifyResult result;
+  try {
+    MappedImage image(path);
+    result.size = image.size();
+    if (image.size() < format::BOOT_MAGIC_SIZE)
+      throw std::runtime_error("file too small");
+
+    std::string_view magic(reinterpret_cast<const char *>(image.data()),
+                           format::BOOT_MAGIC_SIZE);
+    if (magic == format::BOOT_MAGIC)
+      VerifyBootImage(image, result);
+    else if (magic == format::VENDOR_BOOT_MAGIC)
+      VerifyVendorBootImage(image, result);
+    else
+      throw std::runtime_error("unknown magic");
+    result.ok = true;
+  } catch (const std::exception &e) {
+    result.error = e.what();
+  }
+  return result;
+}
+
+} // namespace
+
+bool VerifyImages(const std::vector<std::filesystem::path> &paths) {
+  const auto start = std::chrono::steady_clock::now();
+
+  std::vector<VerifyResult> results(paths.size());
+  const size_t workers =
+      memory::Workers(paths.size(), memory::BufferSize(HASH_CHUNK_SIZE));
+  pipeline::RunJobs(paths.size(), workers, [&](size_t i) {
+    results[i] = VerifyImage(paths[i]);
+    return true;
+  });
+
+  const std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+
+  size_t failed = 0;
+  uint64_t total_bytes = 0;
+  for (size_t i = 0; i < paths.size(); ++i) {
+    const auto &result = results[i];
+    total_bytes += result.size;
+    if (result.ok) {
+      std::cout << "OK    " << paths[i].string() << " (" << result.kind
+                << ")\n";
+    } else {
+      ++failed;
+      std::cout << "FAIL  " << paths[i].string() << ": "
+                << (result.kind.empty() ? "" : result.kind + ": ")
+                << result.error << "\n";
+    }
+  }
+
+  const double mib = static_cast<double>(total_bytes) / (1024.0 * 1024.0);
+  const double seconds = elapsed.count();
+  std::cout << "Verified " << paths.size() << " images, " << failed
+            << " failed, " << std::fixed << std::setprecision(1) << mib
+            << " MiB in " << std::setprecision(3) << seconds << " s";
+  if (seconds > 0)
+    std::cout << " (" << std::setprecision(1) << mib / seconds << " MiB/s)";
+  std::cout << std::endl;
+  return failed == 0;
+}
@@ -0,0 +1,11 @@
+#pragma once
+
+#include <filesystem>
+#include <vector>
+
+// Checks header consistency of existing boot and vendor_boot images: magic,
+// header size, section sizes against the file length, page alignment, the
+// vendor ramdisk table and, for legacy boot images, the SHA-1 id. Images are
+// spread across all cores. Prints one line per image plus a throughput
+// summary and returns true when every image passed.
+bool VerifyImages(const std::vector<std::filesystem::path> &paths);
@@ -0,0 +1,146 @@
+#include "watch.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <poll.h>
+#include <stdexcept>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+namespace {
+
+// How long the inputs must stay quiet before a rebuild starts.
+constexpr int SETTLE_MS = 50;
+constexpr uint32_t WATCH_MASK = IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE;
+
+struct WatchedDir {
+  // File name -> sections; an empty name matches every *.dtb in the
+  // directory.
+  std::multimap<std::string, std::string> files;
+};
+
+class Inotify {
+public:
+  Inotify() : fd_(inotify_init1(IN_CLOEXEC)) {
+    if (fd_ < 0)
+      throw std::runtime_error("Could not initialize inotify.");
+  }
+  ~Inotify() { close(fd_); }
+  Inotify(const Inotify &) = delete;
+  Inotify &operator=(const Inotify &) = delete;
+
+  int Add(const std::filesystem::path &dir) {
+    const int wd = inotify_add_watch(fd_, dir.c_str(), WATCH_MASK);
+    if (wd < 0)
+      throw std::runtime_error("Could not watch " + dir.string());
+    return wd;
+  }
+
+  // Waits up to `timeout_ms` (-1 for ever) and appends the sections touched
+  // by the events read. Returns false on timeout.
+  bool Read(int timeout_ms, const std::map<int, WatchedDir> &dirs,
+            std::vector<std::string> &changed) {
+    pollfd pfd{fd_, POLLIN, 0};
+    const int ready = poll(&pfd, 1, timeout_ms);
+    if (ready < 0 && errno != EINTR)
+      throw std::runtime_error("Waiting for input changes failed.");
+    if (ready <= 0)
+      return false;
+
+    alignas(inotify_event) char buffer[16 * 1024];
+    const ssize_t len = read(fd_, buffer, sizeof(buffer));
+    if (len <= 0)
+      return true;
+    for (ssize_t pos = 0; pos < len;) {
+      const auto *event = reinterpret_cast<const inotify_event *>(buffer + pos);
+      pos += static_cast<ssize_t>(sizeof(inotify_event) + event->len);
+      auto dir = dirs.find(event->wd);
+      if (dir == dirs.end() || event->len == 0)
+        continue;
+      const std::string name(event->name);
+      auto add = [&](const std::string &section) {
+        if (std::find(changed.begin(), changed.end(), section) ==
+            changed.end())
+          changed.push_back(section);
+      };
+      auto [first, last] = dir->second.files.equal_range(name);
+      for (auto it = first; it != last; ++it)
+        add(it->second);
+      if (std::filesystem::path(name).extension() == ".dtb") {
+        auto [any_first, any_last] = dir->second.files.equal_range("");
+        for (auto it = any_first; it != any_last; ++it)
+          add(it->second);
+      }
+    }
+    return true;
+  }
+
+private:
+  int fd_;
+};
+
+// Runs one build and reports how long it took. Returns false if it failed.
+bool Build(const watch::BuildFn &build,
+           const std::vector<std::string> *changed) {
+  const auto start = std::chrono::steady_clock::now();
+  try {
+    build(changed);
+  } catch (const std::exception &e) {
+    std::cerr << e.what() << std::endl;
+    std::cout << "Build failed; waiting for changes." << std::endl;
+    return false;
+  }
+  const std::chrono::duration<double, std::milli> elapsed =
+      std::chrono::steady_clock::now() - start;
+  std::cout << (changed ? "Rebuilt" : "Built");
+  if (changed) {
+    for (size_t i = 0; i < changed->size(); ++i)
+      std::cout << (i ? ", " : " ") << (*changed)[i];
+  }
+  std::cout << " in " << std::fixed << std::setprecision(1) << elapsed.count()
+            << " ms" << std::endl;
+  return true;
+}
+
+} // namespace
+
+namespace watch {
+
+void Run(const std::vector<Input> &inputs, const BuildFn &build) {
+  Inotify inotify;
+  std::map<std::filesystem::path, int> by_path;
+  std::map<int, WatchedDir> dirs;
+  auto watch_dir = [&](const std::filesystem::path &dir) -> WatchedDir & {
+    auto it = by_path.find(dir);
+    if (it == by_path.end())
+      it = by_path.emplace(dir, inotify.Add(dir)).first;
+    return dirs[it->second];
+  };
+  for (const auto &input : inputs) {
+    const auto path = std::filesystem::absolute(input.path).lexically_normal();
+    if (std::filesystem::is_directory(path)) {
+      watch_dir(path).files.emplace("", input.section);
+      continue;
+    }
+    watch_dir(path.parent_path())
+        .files.emplace(path.filename().string(), input.section);
+  }
+
+  // A failed build may have left the output half written, so the build
+  // after it starts from scratch.
+  bool ok = Build(build, nullptr);
+  for (;;) {
+    std::vector<std::string> changed;
+    inotify.Read(-1, dirs, changed);
+    while (inotify.Read(SETTLE_MS, dirs, changed)) {
+    }
+    if (!changed.empty())
+      ok = Build(build, ok ? &changed : nullptr);
+  }
+}
+
+} // namespace watch
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <filesystem>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace watch {
+
+// An input path and the image section it feeds. A directory (such as a --dtb
+// directory) stands for every *.dtb file in it.
+struct Input {
+  std::filesystem::path path;
+  std::string section;
+};
+
+// Receives nullptr for a full build, otherwise the sections whose inputs
+// changed since the previous build.
+using BuildFn = std::function<void(const std::vector<std::string> *changed)>;
+
+// Builds once, then watches the directories holding `inputs` with inotify and
+// rebuilds whenever one of them is written or replaced. Events are collected
+// until the inputs have been quiet for a short moment, so an editor's
+// save-by-rename or a multi-file copy triggers a single rebuild. Every build
+// reports its latency on stdout. A failed build is reported and watching goes
+// on, with a full build on the next change. Throws if inotify cannot be set
+// up; otherwise never returns.
+[[noreturn]] void Run(const std::vector<Input> &inputs, const BuildFn &build);
+
+} // namespace watch
@@ -0,0 +1,712 @@
+#include "zip.h"
+#include "memory.h"
+
+#include <map>
+#include <mutex>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unordered_map>
+
+namespace {
+
+constexpr uint32_t LOCAL_HEADER_SIGNATURE = 0x04034b50;
+constexpr uint32_t CENTRAL_HEADER_SIGNATURE = 0x02014b50;
+constexpr uint32_t END_SIGNATURE = 0x06054b50;
+constexpr uint32_t ZIP64_END_SIGNATURE = 0x06064b50;
+constexpr uint32_t ZIP64_LOCATOR_SIGNATURE = 0x07064b50;
+constexpr size_t LOCAL_HEADER_SIZE = 30;
+constexpr size_t CENTRAL_HEADER_SIZE = 46;
+constexpr size_t END_SIZE = 22;
+constexpr size_t ZIP64_END_SIZE = 56;
+constexpr size_t ZIP64_LOCATOR_SIZE = 20;
+constexpr uint16_t ZIP64_EXTRA_ID = 0x0001;
+constexpr uint16_t METHOD_STORED = 0;
+constexpr uint16_t METHOD_DEFLATED = 8;
+constexpr uint16_t FLAG_ENCRYPTED = 0x0001;
+// Under a memory limit, mapped archive pages that were read are dropped from
+// the resident set every this many bytes.
+constexpr uint64_t RELEASE_INTERVAL = 1 << 20;
+
+uint16_t ReadU16(const uint8_t *bytes) {
+  return static_cast<uint16_t>(bytes[0] | (bytes[1] << 8));
+}
+
+std::runtime_error Malformed(const std::filesystem::path &archive) {
+  return std::runtime_error("Malformed zip archive " + archive.string() + ".");
+}
+
+// CRC-32 (IEEE, reflected), as stored for every zip entry.
+class Crc32 {
+public:
+  void Update(const uint8_t *data, size_t len) {
+    static const auto table = [] {
+      std::array<uint32_t, 256> t{};
+      for (uint32_t i = 0; i < 256; ++i) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; ++k)
+          c = c & 1 ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+        t[i] = c;
+      }
+      return t;
+    }();
+    uint32_t c = crc_;
+    for (size_t i = 0; i < len; ++i)
+      c = table[(c ^ data[i]) & 0xFF] ^ (c >> 8);
+    crc_ = c;
+  }
+  uint32_t Final() const { return ~crc_; }
+
+private:
+  uint32_t crc_ = 0xFFFFFFFF;
+};
+
+// Canonical Huffman code of a deflate block. Codes of up to FAST_BITS bits
+// decode with one table lookup; longer ones bit by bit from the counts.
+struct Huffman {
+  static constexpr int MAX_BITS = 15;
+  static constexpr int FAST_BITS = 10;
+
+  // (symbol << 4) | length, or 0 for codes longer than FAST_BITS.
+  std::array<uint16_t, 1 << FAST_BITS> fast{};
+  std::array<uint16_t, MAX_BITS + 1> count{};
+  // Symbols ordered by code.
+  std::array<uint16_t, 288> symbol{};
+
+  // Returns false for an over-subscribed code. Incomplete codes are
+  // accepted; their unused codes fail when decoded.
+  bool Build(const uint8_t *lengths, size_t n) {
+    count.fill(0);
+    for (size_t i = 0; i < n; ++i)
+      ++count[lengths[i]];
+    count[0] = 0;
+    int left = 1;
+    for (int len = 1; len <= MAX_BITS; ++len) {
+      left = (left << 1) - count[len];
+      if (left < 0)
+        return false;
+    }
+    std::array<uint16_t, MAX_BITS + 1> offsets{};
+    for (int len = 1; len < MAX_BITS; ++len)
+      offsets[len + 1] = static_cast<uint16_t>(offsets[len] + count[len]);
+    std::array<uint16_t, MAX_BITS + 1> next_code{};
+    uint16_t code = 0;
+    for (int len = 1; len <= MAX_BITS; ++len) {
+      code = static_cast<uint16_t>((code + count[len - 1]) << 1);
+      next_code[len] = code;
+    }
+    fast.fill(0);
+    for (size_t i = 0; i < n; ++i) {
+      const int len = lengths[i];
+      if (len == 0)
+        continue;
+      symbol[offsets[len]++] = static_cast<uint16_t>(i);
+      const uint32_t assigned = next_code[len]++;
+      if (len > FAST_BITS)
+        continue;
+      // The stream holds codes most significant bit first.
+      uint32_t reversed = 0;
+      for (int b = 0; b < len; ++b)
+        reversed |= ((assigned >> b) & 1) << (len - 1 - b);
+      for (uint32_t j = reversed; j < fast.size(); j += 1u << len)
+        fast[j] = static_cast<uint16_t>((i << 4) | len);
+    }
+    return true;
+  }
+};
+
+// RFC 1951 decoder over a compressed stream that is entirely in memory (the
+// archive mapping), so only the output side ever pauses: Read() stops at any
+// byte, in the middle of a block or a match, and picks up from there.
+class Inflater {
+public:
+  Inflater(const uint8_t *data, size_t size) : in_(data), end_(data + size) {}
+
+  // Fills up to `len` bytes. Returns the count, 0 at the end of the stream,
+  // or nullopt on corrupt data.
+  std::optional<size_t> Read(uint8_t *out, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+      if (match_left_ > 0) {
+        const size_t n = std::min<size_t>(match_left_, len - done);
+        for (size_t i = 0; i < n; ++i)
+          Emit(out, done, window_[(total_ - match_distance_) & WINDOW_MASK]);
+        match_left_ -= static_cast<uint32_t>(n);
+        continue;
+      }
+      if (state_ == State::Header) {
+        if (last_block_)
+          break;
+        if (!ReadBlockHeader())
+          return std::nullopt;
+        continue;
+      }
+      if (state_ == State::Stored) {
+        const size_t n = std::min<size_t>(stored_left_, len - done);
+        if (static_cast<size_t>(end_ - in_) < n)
+          return std::nullopt;
+        for (size_t i = 0; i < n; ++i)
+          Emit(out, done, in_[i]);
+        in_ += n;
+        stored_left_ -= static_cast<uint32_t>(n);
+        if (stored_left_ == 0)
+          state_ = State::Header;
+        continue;
+      }
+      const int sym = Decode(literals_);
+      if (sym < 0)
+        return std::nullopt;
+      if (sym < 256) {
+        Emit(out, done, static_cast<uint8_t>(sym));
+      } else if (sym == 256) {
+        state_ = State::Header;
+      } else if (!StartMatch(sym)) {
+        return std::nullopt;
+      }
+    }
+    if (overrun_)
+      return std::nullopt;
+    return done;
+  }
+
+  // Compressed bytes consumed so far.
+  size_t Consumed(const uint8_t *start) const {
+    return static_cast<size_t>(in_ - start);
+  }
+
+private:
+  enum class State { Header, Stored, Huffman };
+  static constexpr size_t WINDOW_SIZE = 1 << 15;
+  static constexpr size_t WINDOW_MASK = WINDOW_SIZE - 1;
+
+  void Emit(uint8_t *out, size_t &done, uint8_t byte) {
+    out[done++] = byte;
+    window_[total_++ & WINDOW_MASK] = byte;
+  }
+
+  void Refill() {
+    while (bit_count_ <= 56) {
+      uint64_t byte = 0;
+      if (in_ < end_)
+        byte = *in_++;
+      else
+        ++padding_;
+      bits_ |= byte << bit_count_;
+      bit_count_ += 8;
+    }
+  }
+
+  void Drop(int n) {
+    bits_ >>= n;
+    bit_count_ -= n;
+    // Bits past the end of the input were read.
+    if (bit_count_ < padding_ * 8)
+      overrun_ = true;
+  }
+
+  uint32_t Bits(int n) {
+    Refill();
+    const uint32_t value = static_cast<uint32_t>(bits_ & ((1ull << n) - 1));
+    Drop(n);
+    return value;
+  }
+
+  // Hands the whole bytes still buffered back to the input, for the byte
+  // aligned contents of a stored block.
+  void Unbuffer() {
+    const int whole = bit_count_ / 8 - padding_;
+    in_ -= whole;
+    bits_ = 0;
+    bit_count_ = 0;
+    padding_ = 0;
+  }
+
+  int Decode(const Huffman &h) {
+    Refill();
+    const uint16_t entry = h.fast[bits_ & ((1u << Huffman::FAST_BITS) - 1)];
+    if (entry != 0) {
+      Drop(entry & 15);
+      return entry >> 4;
+    }
+    int code = 0;
+    int first = 0;
+    int index = 0;
+    for (int len = 1; len <= Huffman::MAX_BITS; ++len) {
+      code |= static_cast<int>((bits_ >> (len - 1)) & 1);
+      const int count = h.count[len];
+      if (code - count < first) {
+        Drop(len);
+        return h.symbol[index + (code - first)];
+      }
+      index += count;
+      first = (first + count) << 1;
+      code <<= 1;
+    }
+    return -1;
+  }
+
+  bool StartMatch(int sym) {
+    static constexpr std::array<uint16_t, 29> LENGTH_BASE = {
+        3,  4,  5,  6,  7,  8,  9,  10, 11,  13,  15,  17,  19,  23, 27,
+        31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+    static constexpr std::array<uint8_t, 29> LENGTH_EXTRA = {
+        0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2,
+        2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+    static constexpr std::array<uint16_t, 30> DISTANCE_BASE = {
+        1,    2,    3,    4,    5,    7,     9,     13,    17,  25,
+        33,   49,   65,   97,   129,  193,   257,   385,   513, 769,
+        1025, 1537, 2049, 3073, 4097, 6145,  8193,  12289, 16385, 24577};
+    static constexpr std::array<uint8_t, 30> DISTANCE_EXTRA = {
+        0, 0, 0, 0, 1, 1, 2, 2,  3,  3,  4,  4,  5,  5,  6,
+        6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+    const int length_index = sym - 257;
+    if (length_index >= static_cast<int>(LENGTH_BASE.size()))
+      return false;
+    match_left_ =
+        LENGTH_BASE[length_index] + Bits(LENGTH_EXTRA[length_index]);
+    const int distance_index = Decode(distances_);
+    if (distance_index < 0 ||
+        distance_index >= static_cast<int>(DISTANCE_BASE.size()))
+      return false;
+    match_distance_ =
+        DISTANCE_BASE[distance_index] + Bits(DISTANCE_EXTRA[distance_index]);
+    return match_distance_ <= total_;
+  }
+
+  bool ReadBlockHeader() {
+    last_block_ = Bits(1) != 0;
+    switch (Bits(2)) {
+    case 0: {
+      Drop(bit_count_ % 8);
+      const uint32_t len = Bits(16);
+      const uint32_t inverted = Bits(16);
+      if (overrun_ || (len ^ 0xFFFF) != inverted)
+        return false;
+      Unbuffer();
+      stored_left_ = len;
+      state_ = len > 0 ? State::Stored : State::Header;
+      return true;
+    }
+    case 1:
+      BuildFixed();
+      state_ = State::Huffman;
+      return true;
+    case 2:
+      if (!ReadDynamicTables())
+        return false;
+      state_ = State::Huffman;
+      return true;
+    default:
+      return false;
+    }
+  }
+
+  void BuildFixed() {
+    std::array<uint8_t, 288> lengths;
+    std::fill(lengths.begin(), lengths.begin() + 144, 8);
+    std::fill(lengths.begin() + 144, lengths.begin() + 256, 9);
+    std::fill(lengths.begin() + 256, lengths.begin() + 280, 7);
+    std::fill(lengths.begin() + 280, lengths.end(), 8);
+    literals_.Build(lengths.data(), lengths.size());
+    std::fill(lengths.begin(), lengths.begin() + 30, 5);
+    distances_.Build(lengths.data(), 30);
+  }
+
+  bool ReadDynamicTables() {
+    static constexpr std::array<uint8_t, 19> ORDER = {
+        16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+    const uint32_t literal_count = Bits(5) + 257;
+    const uint32_t distance_count = Bits(5) + 1;
+    const uint32_t code_count = Bits(4) + 4;
+    if (literal_count > 286 || distance_count > 30)
+      return false;
+    std::array<uint8_t, 19> code_lengths{};
+    for (uint32_t i = 0; i < code_count; ++i)
+      code_lengths[ORDER[i]] = static_cast<uint8_t>(Bits(3));
+    Huffman codes;
+    if (!codes.Build(code_lengths.data(), code_lengths.size()))
+      return false;
+
+    std::array<uint8_t, 286 + 30> lengths{};
+    const uint32_t total = literal_count + distance_count;
+    for (uint32_t i = 0; i < total;) {
+      const int sym = Decode(codes);
+      if (sym < 0 || overrun_)
+        return false;
+      if (sym < 16) {
+        lengths[i++] = static_cast<uint8_t>(sym);
+        continue;
+      }
+      uint8_t value = 0;
+      uint32_t repeat = 0;
+      if (sym == 16) {
+        if (i == 0)
+          return false;
+        value = lengths[i - 1];
+        repeat = 3 + Bits(2);
+      } else if (sym == 17) {
+        repeat = 3 + Bits(3);
+      } else {
+        repeat = 11 + Bits(7);
+      }
+      if (i + repeat > total)
+        return false;
+      std::fill_n(lengths.begin() + i, repeat, value);
+      i += repeat;
+    }
+    if (lengths[256] == 0)
+      return false;
+    return literals_.Build(lengths.data(), literal_count) &&
+           distances_.Build(lengths.data() + literal_count, distance_count);
+  }
+
+  const uint8_t *in_;
+  const uint8_t *end_;
+  uint64_t bits_ = 0;
+  int bit_count_ = 0;
+  // Zero bytes appended to the bit buffer past the end of the input.
+  int padding_ = 0;
+  bool overrun_ = false;
+
+  State state_ = State::Header;
+  bool last_block_ = false;
+  uint32_t stored_left_ = 0;
+  Huffman literals_;
+  Huffman distances_;
+  uint32_t match_left_ = 0;
+  uint32_t match_distance_ = 0;
+
+  std::array<uint8_t, WINDOW_SIZE> window_;
+  uint64_t total_ = 0;
+};
+
+struct Entry {
+  uint16_t method = 0;
+  uint16_t flags = 0;
+  uint32_t crc = 0;
+  uint64_t compressed_size = 0;
+  uint64_t size = 0;
+  uint64_t local_header = 0;
+};
+
+// A mapped archive and its central directory, indexed by entry name.
+class Archive {
+public:
+  Archive(const std::filesystem::path &path, int fd, uint64_t size)
+      : path_(path), size_(size) {
+    if (size_ < END_SIZE)
+      throw Malformed(path_);
+    void *p = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p == MAP_FAILED)
+      throw std::runtime_error("Could not map " + path_.string() + ".");
+    data_ = static_cast<const uint8_t *>(p);
+    Index();
+  }
+  ~Archive() { munmap(const_cast<uint8_t *>(data_), size_); }
+  Archive(const Archive &) = delete;
+  Archive &operator=(const Archive &) = delete;
+
+  const std::filesystem::path &path() const { return path_; }
+
+  const Entry *Find(const std::string &name) const {
+    const auto it = entries_.find(name);
+    return it == entries_.end() ? nullptr : &it->second;
+  }
+
+  // The compressed bytes of `entry`, after its local header.
+  const uint8_t *Contents(const Entry &entry) const {
+    const uint64_t header = entry.local_header;
+    if (header > size_ || size_ - header < LOCAL_HEADER_SIZE ||
+        utils::ReadU32(data_ + header) != LOCAL_HEADER_SIGNATURE)
+      throw Malformed(path_);
+    const uint64_t start = header + LOCAL_HEADER_SIZE +
+                           ReadU16(data_ + header + 26) +
+                           ReadU16(data_ + header + 28);
+    if (start > size_ || size_ - start < entry.compressed_size)
+      throw Malformed(path_);
+    return data_ + start;
+  }
+
+  // Drops mapped pages in [begin, end) that were read from the resident set,
+  // to stay within --max-memory.
+  void Release(const uint8_t *begin, const uint8_t *end) const {
+    if (memory::Limit() == 0)
+      return;
+    const uintptr_t page = memory::BUFFER_ALIGNMENT;
+    const uintptr_t from =
+        (reinterpret_cast<uintptr_t>(begin) + page - 1) & ~(page - 1);
+    const uintptr_t to = reinterpret_cast<uintptr_t>(end) & ~(page - 1);
+    if (from < to)
+      madvise(reinterpret_cast<void *>(from), to - from, MADV_DONTNEED);
+  }
+
+private:
+  void Index() {
+    // The end record sits in the last 64 KiB, behind an optional comment.
+    uint64_t end = size_ - END_SIZE;
+    const uint64_t lowest =
+        size_ > END_SIZE + 0xFFFF ? size_ - END_SIZE - 0xFFFF : 0;
+    while (utils::ReadU32(data_ + end) != END_SIGNATURE) {
+      if (end == lowest)
+        throw Malformed(path_);
+      --end;
+    }
+    uint64_t count = ReadU16(data_ + end + 10);
+    uint64_t directory_size = utils::ReadU32(data_ + end + 12);
+    uint64_t directory = utils::ReadU32(data_ + end + 16);
+    if (end >= ZIP64_LOCATOR_SIZE &&
+        utils::ReadU32(data_ + end - ZIP64_LOCATOR_SIZE) ==
+            ZIP64_LOCATOR_SIGNATURE) {
+      const uint64_t end64 =
+          utils::ReadU64(data_ + end - ZIP64_LOCATOR_SIZE + 8);
+      if (end64 > size_ || size_ - end64 < ZIP64_END_SIZE ||
+          utils::ReadU32(data_ + end64) != ZIP64_END_SIGNATURE)
+        throw Malformed(path_);
+      count = utils::ReadU64(data_ + end64 + 32);
+      directory_size = utils::ReadU64(data_ + end64 + 40);
+      directory = utils::ReadU64(data_ + end64 + 48);
+    }
+    if (directory > size_ || size_ - directory < directory_size)
+      throw Malformed(path_);
+
+    entries_.reserve(static_cast<size_t>(
+        std::min<uint64_t>(count, directory_size / CENTRAL_HEADER_SIZE)));
+    const uint8_t *p = data_ + directory;
+    const uint8_t *const limit = p + directory_size;
+    for (uint64_t i = 0; i < count; ++i) {
+      if (limit - p < static_cast<ptrdiff_t>(CENTRAL_HEADER_SIZE) ||
+          utils::ReadU32(p) != CENTRAL_HEADER_SIGNATURE)
+        throw Malformed(path_);
+      Entry entry;
+      entry.flags = ReadU16(p + 8);
+      entry.method = ReadU16(p + 10);
+      entry.crc = utils::ReadU32(p + 16);
+      entry.compressed_size = utils::ReadU32(p + 20);
+      entry.size = utils::ReadU32(p + 24);
+      entry.local_header = utils::ReadU32(p + 42);
+      const size_t name_len = ReadU16(p + 28);
+      const size_t extra_len = ReadU16(p + 30);
+      const size_t comment_len = ReadU16(p + 32);
+      const size_t record =
+          CENTRAL_HEADER_SIZE + name_len + extra_len + comment_len;
+      if (static_cast<size_t>(limit - p) < record)
+        throw Malformed(path_);
+      ReadZip64Extra(p + CENTRAL_HEADER_SIZE + name_len, extra_len, entry);
+      entries_.emplace(
+          std::string(reinterpret_cast<const char *>(p + CENTRAL_HEADER_SIZE),
+                      name_len),
+          entry);
+      p += record;
+    }
+  }
+
+  // Fields saturated at 0xFFFFFFFF continue in the ZIP64 extra field, in
+  // this order.
+  void ReadZip64Extra(const uint8_t *extra, size_t len, Entry &entry) {
+    for (size_t pos = 0; pos + 4 <= len;) {
+      const uint16_t id = ReadU16(extra + pos);
+      const size_t size = ReadU16(extra + pos + 2);
+      if (pos + 4 + size > len)
+        throw Malformed(path_);
+      if (id == ZIP64_EXTRA_ID) {
+        const uint8_t *field = extra + pos + 4;
+        const uint8_t *field_end = field + size;
+        for (uint64_t *value :
+             {&entry.size, &entry.compressed_size, &entry.local_header}) {
+          if (*value != 0xFFFFFFFF)
+            continue;
+          if (field_end - field < 8)
+            throw Malformed(path_);
+          *value = utils::ReadU64(field);
+          field += 8;
+        }
+      }
+      pos += 4 + size;
+    }
+  }
+
+  std::filesystem::path path_;
+  const uint8_t *data_ = nullptr;
+  uint64_t size_ = 0;
+  std::unordered_map<std::string, Entry> entries_;
+};
+
+// Stored entry: reads are copies out of the mapping.
+class StoredReader : public utils::Reader {
+public:
+  StoredReader(std::shared_ptr<const Archive> archive, const uint8_t *data,
+               uint64_t size)
+      : archive_(std::move(archive)), data_(data), size_(size) {}
+
+  bool ReadAt(uint64_t offset, void *data, size_t len) override {
+    if (offset > size_ || len > size_ - offset)
+      return false;
+    std::memcpy(data, data_ + offset, len);
+    archive_->Release(data_ + offset, data_ + offset + len);
+    return true;
+  }
+
+private:
+  std::shared_ptr<const Archive> archive_;
+  const uint8_t *data_;
+  uint64_t size_;
+};
+
+// Deflated entry, inflated front to back. A read behind the current position
+// starts over; one ahead of it inflates and drops the bytes in between.
+class InflateReader : public utils::Reader {
+public:
+  InflateReader(std::shared_ptr<const Archive> archive, const uint8_t *data,
+                const Entry &entry)
+      : archive_(std::move(archive)), data_(data), entry_(entry) {}
+
+  bool ReadAt(uint64_t offset, void *data, size_t len) override {
+    if (offset > entry_.size || len > entry_.size - offset)
+      return false;
+    if (!inflater_ || offset < position_) {
+      inflater_ = std::make_unique<Inflater>(data_, entry_.compressed_size);
+      position_ = 0;
+      released_ = 0;
+      crc_ = Crc32();
+    }
+    std::array<uint8_t, 4096> skipped;
+    while (position_ < offset) {
+      const size_t n = static_cast<size_t>(
+          std::min<uint64_t>(skipped.size(), offset - position_));
+      if (!Next(skipped.data(), n))
+        return false;
+    }
+    return Next(static_cast<uint8_t *>(data), len);
+  }
+
+private:
+  bool Next(uint8_t *out, size_t len) {
+    const auto n = inflater_->Read(out, len);
+    if (!n || *n != len)
+      return false;
+    crc_.Update(out, len);
+    position_ += len;
+    const size_t consumed = inflater_->Consumed(data_);
+    if (consumed - released_ >= RELEASE_INTERVAL) {
+      archive_->Release(data_ + released_, data_ + consumed);
+      released_ = consumed;
+    }
+    if (position_ < entry_.size)
+      return true;
+    // The whole entry was inflated: it must end here and match its CRC.
+    uint8_t extra;
+    return inflater_->Read(&extra, 1) == size_t{0} &&
+           crc_.Final() == entry_.crc;
+  }
+
+  std::shared_ptr<const Archive> archive_;
+  const uint8_t *data_;
+  Entry entry_;
+  std::unique_ptr<Inflater> inflater_;
+  uint64_t position_ = 0;
+  size_t released_ = 0;
+  Crc32 crc_;
+};
+
+// Archives opened so far, kept while the file is unchanged so that many
+// entries of one archive (vendor ramdisk fragments, dtbs) share one mapping
+// and one index. Shared by the copy workers.
+struct CachedArchive {
+  dev_t dev;
+  ino_t ino;
+  off_t size;
+  timespec mtime;
+  std::shared_ptr<const Archive> archive;
+};
+std::mutex cache_mutex;
+
+std::map<std::string, CachedArchive> &Cache() {
+  static auto *cache = new std::map<std::string, CachedArchive>();
+  return *cache;
+}
+
+std::shared_ptr<const Archive> OpenArchive(const std::filesystem::path &path) {
+  const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return nullptr;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+    close(fd);
+    return nullptr;
+  }
+  std::lock_guard<std::mutex> lock(cache_mutex);
+  auto &cached = Cache()[path.string()];
+  if (!cached.archive || cached.dev != st.st_dev || cached.ino != st.st_ino ||
+      cached.size != st.st_size ||
+      cached.mtime.tv_sec != st.st_mtim.tv_sec ||
+      cached.mtime.tv_nsec != st.st_mtim.tv_nsec) {
+    try {
+      cached = {st.st_dev, st.st_ino, st.st_size, st.st_mtim,
+                std::make_shared<const Archive>(
+                    path, fd, static_cast<uint64_t>(st.st_size))};
+    } catch (...) {
+      close(fd);
+      Cache().erase(path.string());
+      throw;
+    }
+  }
+  close(fd);
+  return cached.archive;
+}
+
+} // namespace
+
+namespace zip {
+
+std::optional<EntryPath> SplitPath(const std::filesystem::path &path) {
+  const std::string &text = path.native();
+  for (size_t bang = text.find("!/"); bang != std::string::npos;
+       bang = text.find("!/", bang + 1)) {
+    struct stat st;
+    const std::string archive = text.substr(0, bang);
+    if (stat(archive.c_str(), &st) == 0 && S_ISREG(st.st_mode))
+      return EntryPath{archive, text.substr(bang + 2)};
+  }
+  return std::nullopt;
+}
+
+bool IsEntryPath(const std::filesystem::path &path) {
+  return path.native().find("!/") != std::string::npos &&
+         SplitPath(path).has_value();
+}
+
+std::optional<utils::FileWrapper> OpenEntry(const std::filesystem::path &path) {
+  const auto split = SplitPath(path);
+  if (!split)
+    return std::nullopt;
+  auto archive = OpenArchive(split->archive);
+  if (!archive)
+    return std::nullopt;
+  const Entry *entry = archive->Find(split->name);
+  if (!entry)
+    throw std::runtime_error("No entry " + split->name + " in " +
+                             split->archive.string() + ".");
+  if (entry->flags & FLAG_ENCRYPTED)
+    throw std::runtime_error("Zip entry " + path.string() +
+                             " is encrypted.");
+  const uint8_t *data = archive->Contents(*entry);
+  const size_t size = static_cast<size_t>(entry->size);
+  switch (entry->method) {
+  case METHOD_STORED:
+    if (entry->compressed_size != entry->size)
+      throw Malformed(split->archive);
+    return utils::FileWrapper(
+        std::make_unique<StoredReader>(std::move(archive), data, entry->size),
+        size);
+  case METHOD_DEFLATED:
+    return utils::FileWrapper(
+        std::make_unique<InflateReader>(std::move(archive), data, *entry),
+        size);
+  default:
+    throw std::runtime_error("Zip entry " + path.string() +
+                             " uses compression method " +
+                             std::to_string(entry->method) +
+                             "; only stored and deflated entries are read.");
+  }
+}
+
+} // namespace zip
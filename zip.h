@@ -0,0 +1,32 @@
+#pragma once
+
+#include "utils.hpp"
+
+namespace zip {
+
+// An input path of the form "archive.zip!/path/in/zip", split at the first
+// "!/" whose prefix is a regular file.
+struct EntryPath {
+  std::filesystem::path archive;
+  std::string name;
+};
+std::optional<EntryPath> SplitPath(const std::filesystem::path &path);
+
+// True if `path` names an archive entry (see SplitPath). utils::OpenFile
+// hands such paths to OpenEntry, so every input that is opened by path can be
+// an entry.
+bool IsEntryPath(const std::filesystem::path &path);
+
+// Opens an entry of a zip archive (ZIP64 included) as an input whose size is
+// the uncompressed size from the central directory, so nothing is
+// decompressed before the header is written. The archive is mapped once and
+// its directory indexed on first use; later entries of the same archive
+// reuse both while the file is unchanged. Stored entries read straight from
+// the mapping. Deflated entries are inflated as they are read, and their
+// CRC-32 is checked at the end; reading one again, or out of order,
+// inflates it again from the start. Throws if the archive is malformed, the
+// entry is missing, encrypted or compressed with anything but deflate.
+// Returns nullopt if the archive cannot be opened.
+std::optional<utils::FileWrapper> OpenEntry(const std::filesystem::path &path);
+
+} // namespace zip